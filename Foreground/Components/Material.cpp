@@ -1,9 +1,9 @@
 #include <utility>
 
 #include "Material.h"
-#include "Resources/ResourceManager.h"
+#include "Renderer/FrameConstantRing.h"
 
-#include <fstream>
+#include <cstring>
 #include <iostream>
 
 using namespace std;
@@ -13,46 +13,53 @@ using namespace RHI;
 namespace Foreground
 {
 
-static CShaderModule::Ref LoadSPIRV(CDevice::Ref device, const std::string& path)
+CMaterial::CMaterial(CDevice::Ref device, const string& VS_file, const string& PS_file)
+    : VSFile(VS_file)
+    , PSFile(PS_file)
 {
-    string filePath = CResourceManager::Get().FindShader(path);
-    ifstream file(filePath.c_str(), ios::binary | ios::ate);
-    streamsize size = file.tellg();
-    file.seekg(0, std::ios::beg);
+    VS = CShaderModuleCache::Get().Load(VS_file);
+    PS = CShaderModuleCache::Get().Load(PS_file);
+    collectResources();
 
-    vector<char> buffer(size);
-    if (file.read(buffer.data(), size))
-        return device->CreateShaderModule(buffer.size(), buffer.data());
-    return {};
+    this->device = device;
 }
 
-CMaterial::CMaterial(CDevice::Ref device, const string& VS_file, const string& PS_file)
+void CMaterial::collectResources()
 {
-    VS = LoadSPIRV(device, VS_file);
-    PS = LoadSPIRV(device, PS_file);
-
     // Setup resources hashmap from reflections, it's kind of dirty right now
-    for (CPipelineResource res : VS->GetShaderResources())
+    resources.clear();
+    for (const CPipelineResource& res : VS->Resources)
     {
         string id = string(res.Name);
 
         resources.insert_or_assign(id, res);
 
-        cout << "Shader " << VS_file << " : " << id << " set=" << res.Set
+        cout << "Shader " << VSFile << " : " << id << " set=" << res.Set
              << " binding=" << res.Binding << endl;
     }
 
-    for (CPipelineResource res : PS->GetShaderResources())
+    for (const CPipelineResource& res : PS->Resources)
     {
         string id = string(res.Name);
 
         resources.insert_or_assign(id, res);
 
-        cout << "Shader " << PS_file << " : " << id << " set=" << res.Set
+        cout << "Shader " << PSFile << " : " << id << " set=" << res.Set
              << " binding=" << res.Binding << endl;
     }
+}
 
-    this->device = device;
+void CMaterial::reloadShaders(CShaderModuleCache::FShaderRef newVS,
+                              CShaderModuleCache::FShaderRef newPS)
+{
+    if (newVS)
+        VS = std::move(newVS);
+    if (newPS)
+        PS = std::move(newPS);
+    collectResources();
+
+    if (renderPass)
+        createPipelineState();
 }
 
 CMaterial::~CMaterial()
@@ -110,11 +117,15 @@ void CMaterial::createPipeline(int w, int h)
     renderPass = device->CreateRenderPass(rpDesc);
 
     // 2. Create render pipeline
+    createPipelineState();
+}
 
+void CMaterial::createPipelineState()
+{
     // 2.1 Pipeline descriptions
     RHI::CPipelineDesc desc;
-    desc.VS = VS;
-    desc.PS = PS;
+    desc.VS = VS->Module;
+    desc.PS = PS->Module;
     desc.RasterizerState.CullMode = RHI::ECullModeFlags::None;
     desc.DepthStencilState.DepthEnable = false;
     desc.RenderPass = renderPass;
@@ -151,7 +162,43 @@ void CMaterial::createPipeline(int w, int h)
     }
 
     pipeline = device->CreateManagedPipeline(desc);
-    DescriptorSets = pipeline->CreateDescriptorSets();
+    for (auto& sets : DescriptorSets)
+        sets = pipeline->CreateDescriptorSets();
+    resolveSlots();
+}
+
+void CMaterial::resolveSlots()
+{
+    // Slots of names the shaders lost keep their index but no longer write anything
+    for (CSlot& slot : Slots)
+        slot.Set = CMaterialSlot::Invalid;
+    for (const auto& pair : resources)
+    {
+        auto result = SlotByName.emplace(pair.first, static_cast<uint32_t>(Slots.size()));
+        if (result.second)
+            Slots.emplace_back();
+        CSlot& slot = Slots[result.first->second];
+        slot.Set = pair.second.Set;
+        slot.Binding = pair.second.Binding;
+    }
+    // The sets are new
+    for (CSlot& slot : Slots)
+        for (CSlotState& bound : slot.Bound)
+            bound = CSlotState();
+}
+
+RHI::CDescriptorSet* CMaterial::getSlotSet(const CSlot& slot) const
+{
+    const auto& sets = DescriptorSets[Frame];
+    return slot.Set < sets.size() ? sets[slot.Set].get() : nullptr;
+}
+
+CMaterialSlot CMaterial::getSlot(const std::string& id) const
+{
+    auto iter = SlotByName.find(id);
+    if (iter == SlotByName.end())
+        return CMaterialSlot();
+    return CMaterialSlot { iter->second };
 }
 
 uint32_t CMaterial::getInputBufferBinding(std::string name) const
@@ -169,31 +216,70 @@ void CMaterial::setAttribute(std::string id, RHI::EFormat format, size_t offset,
         id, CMaterialNamedAttribute { id, format, offset, std::move(buffer_name) });
 }
 
-void CMaterial::setSampler(const std::string& id, RHI::CSampler::Ref obj)
+void CMaterial::setSampler(CMaterialSlot slot, RHI::CSampler::Ref obj)
 {
-    if (ctx)
+    if (!ctx || !slot.IsValid())
+        return;
+    CSlot& s = Slots[slot.Index];
+    CSlotState& bound = s.Bound[Frame];
+    RHI::CDescriptorSet* ds = getSlotSet(s);
+    if (!ds || bound.Sampler == obj)
+        return;
+    bound.Sampler = obj;
+    ds->BindSampler(std::move(obj), s.Binding, 0);
+    DescriptorWrites++;
+}
+
+void CMaterial::setImageView(CMaterialSlot slot, RHI::CImageView::Ref obj)
+{
+    if (!ctx || !slot.IsValid())
+        return;
+    CSlot& s = Slots[slot.Index];
+    CSlotState& bound = s.Bound[Frame];
+    RHI::CDescriptorSet* ds = getSlotSet(s);
+    if (!ds || bound.ImageView == obj)
+        return;
+    bound.ImageView = obj;
+    ds->BindImageView(std::move(obj), s.Binding, 0);
+    DescriptorWrites++;
+}
+
+void CMaterial::setStruct(CMaterialSlot slot, size_t size, const void* obj)
+{
+    if (!ctx || !slot.IsValid())
+        return;
+    CSlot& s = Slots[slot.Index];
+    CSlotState& bound = s.Bound[Frame];
+    RHI::CDescriptorSet* ds = getSlotSet(s);
+    if (!ds)
+        return;
+
+    // A frame slot keeps getting the same ring pages, so after a few frames only the offset moves
+    auto alloc = Constants->Allocate(size);
+    memcpy(alloc.Data, obj, size);
+    if (bound.Buffer != alloc.Buffer || bound.Range != size)
     {
-        CPipelineResource& r = resources.at(id);
-        DescriptorSets[r.Set]->BindSampler(std::move(obj), r.Binding, 0);
+        bound.Buffer = alloc.Buffer;
+        bound.Range = size;
+        ds->BindBuffer(alloc.Buffer, 0, size, s.Binding, 0);
+        DescriptorWrites++;
     }
+    ds->SetDynamicOffset(alloc.Offset, s.Binding, 0);
+}
+
+void CMaterial::setSampler(const std::string& id, RHI::CSampler::Ref obj)
+{
+    setSampler(getSlot(id), std::move(obj));
 }
 
 void CMaterial::setImageView(const std::string& id, RHI::CImageView::Ref obj)
 {
-    if (ctx)
-    {
-        CPipelineResource& r = resources.at(id);
-        DescriptorSets[r.Set]->BindImageView(std::move(obj), r.Binding, 0);
-    }
+    setImageView(getSlot(id), std::move(obj));
 }
 
 void CMaterial::setStruct(const std::string& id, size_t size, const void* obj)
 {
-    if (ctx)
-    {
-        CPipelineResource& r = resources.at(id);
-        DescriptorSets[r.Set]->BindConstants(obj, size, r.Binding, 0);
-    }
+    setStruct(getSlot(id), size, obj);
 }
 
 void CMaterial::setBuffer(const std::string& id, CBuffer& obj, size_t offset)
@@ -207,8 +293,12 @@ void CMaterial::setBuffer(const std::string& id, CBuffer& obj, size_t offset)
 
 const std::vector<RHI::CImageView::Ref>& CMaterial::getRTViews() const { return renderTargetViews; }
 
-void CMaterial::beginRender(const RHI::CCommandList::Ref& c)
+void CMaterial::beginRender(const RHI::CCommandList::Ref& c, CFrameConstantRing& constants)
 {
+    Constants = &constants;
+    Frame = constants.GetFrameIndex() % FramesInFlight;
+    DescriptorWrites = 0;
+
     PassCtx = c->CreateParallelRenderContext(renderPass, clearValues);
     ctx = PassCtx->CreateRenderContext(0);
 
@@ -223,15 +313,18 @@ void CMaterial::endRender()
     ctx = nullptr;
     PassCtx->FinishRecording();
     PassCtx = nullptr;
+    Constants = nullptr;
 }
 
 void CMaterial::blit2d() const
 {
     if (ctx)
     {
-        for (uint32_t i = 0; i < DescriptorSets.size(); i++)
-            if (DescriptorSets[i])
-                ctx->BindRenderDescriptorSet(i, *DescriptorSets[i]);
+        // Every pass records into a context of its own, so each set is bound once per pass
+        const auto& sets = DescriptorSets[Frame];
+        for (uint32_t i = 0; i < sets.size(); i++)
+            if (sets[i])
+                ctx->BindRenderDescriptorSet(i, *sets[i]);
         ctx->Draw(3, 1, 0, 0);
     }
 }
@@ -2,6 +2,8 @@
 
 #include "Event.h"
 #include "GameObject.h"
+#include "Renderer/FrameConstantRing.h"
+#include "Resources/ShaderModuleCache.h"
 
 #include <unordered_map>
 
@@ -46,16 +48,53 @@ struct CMaterialNamedAttribute
     std::string buffer_name;
 };
 
+// A shader parameter of a material resolved to its set and binding, see getSlot
+struct CMaterialSlot
+{
+    static const uint32_t Invalid = UINT32_MAX;
+    uint32_t Index = Invalid;
+
+    bool IsValid() const { return Index != Invalid; }
+};
+
 class CMaterial : public CGameObject
 {
+public:
+    static const uint32_t FramesInFlight = CFrameConstantRing::FramesInFlight;
+
 private:
     RHI::CRenderPass::Ref renderPass;
     RHI::CManagedPipeline::Ref pipeline;
-    RHI::CShaderModule::Ref VS, PS;
-    std::vector<RHI::CDescriptorSet::Ref> DescriptorSets;
+    CShaderModuleCache::FShaderRef VS, PS;
+    std::string VSFile, PSFile;
+    // A copy of the sets per frame in flight, so a frame only rewrites what it changed since the
+    // same frame slot last ran, never what the GPU may still read
+    std::vector<RHI::CDescriptorSet::Ref> DescriptorSets[FramesInFlight];
 
     std::unordered_map<std::string, RHI::CPipelineResource> resources;
 
+    // What each frame's sets hold, so parameters that did not change are not written again
+    struct CSlotState
+    {
+        RHI::CImageView::Ref ImageView;
+        RHI::CSampler::Ref Sampler;
+        RHI::CBuffer::Ref Buffer;
+        size_t Range = 0;
+    };
+    struct CSlot
+    {
+        uint32_t Set = 0;
+        uint32_t Binding = 0;
+        CSlotState Bound[FramesInFlight];
+    };
+    // Indices stay the same across shader reloads, new names are appended
+    std::vector<CSlot> Slots;
+    std::unordered_map<std::string, uint32_t> SlotByName;
+
+    CFrameConstantRing* Constants = nullptr;
+    uint32_t Frame = 0;
+    uint32_t DescriptorWrites = 0;
+
     std::vector<RHI::CImageView::Ref> renderTargetViews;
 
     RHI::CDevice::Ref device;
@@ -68,6 +107,13 @@ private:
     std::unordered_map<std::string, RHI::CVertexInputBindingDesc> inputBuffers;
     std::unordered_map<std::string, CMaterialNamedAttribute> vertexAttributes;
 
+    void collectResources();
+    void createPipelineState();
+    // Resolves every resource of the shaders to a slot and forgets what the sets held
+    void resolveSlots();
+    // This frame's set of the slot, null if the current shaders do not have it
+    RHI::CDescriptorSet* getSlotSet(const CSlot& slot) const;
+
 public:
     std::vector<CRenderTarget> renderTargets;
 
@@ -76,10 +122,26 @@ public:
 
     void createPipeline(int w, int h);
 
+    const std::string& getVSFile() const { return VSFile; }
+    const std::string& getPSFile() const { return PSFile; }
+    // Swaps in recompiled shaders, a null module keeps the current one. Rebuilds the pipeline
+    // if there is one, so call it between frames.
+    void reloadShaders(CShaderModuleCache::FShaderRef newVS,
+                       CShaderModuleCache::FShaderRef newPS);
+
     uint32_t getInputBufferBinding(std::string name) const;
 
     void setAttribute(std::string id, RHI::EFormat format, size_t offset, std::string buffer_name);
 
+    // Invalid until createPipeline, and for names the shaders do not have
+    CMaterialSlot getSlot(const std::string& id) const;
+
+    // Only write descriptors for parameters that differ from what this frame's sets hold.
+    // Structs go to the frame constant ring and are selected with a dynamic offset.
+    void setSampler(CMaterialSlot slot, RHI::CSampler::Ref obj);
+    void setImageView(CMaterialSlot slot, RHI::CImageView::Ref obj);
+    void setStruct(CMaterialSlot slot, size_t size, const void* obj);
+    // Same as above by name, which costs a lookup
     void setSampler(const std::string& id, RHI::CSampler::Ref obj);
     void setImageView(const std::string& id, RHI::CImageView::Ref obj);
     void setStruct(const std::string& id, size_t size, const void* obj);
@@ -88,7 +150,8 @@ public:
 
     const std::vector<RHI::CImageView::Ref>& getRTViews() const;
 
-    void beginRender(const RHI::CCommandList::Ref& ctx);
+    // Structs set until endRender are allocated from constants, which has to be in a frame
+    void beginRender(const RHI::CCommandList::Ref& ctx, CFrameConstantRing& constants);
     const RHI::IRenderContext::Ref& getContext() const;
     void endRender();
 
@@ -97,6 +160,9 @@ public:
 
     void drawObject() const {}; // eh... TODO
     void blit2d() const;
+
+    // Descriptors written since the last beginRender
+    uint32_t getDescriptorWrites() const { return DescriptorWrites; }
 };
 
 }
\ No newline at end of file
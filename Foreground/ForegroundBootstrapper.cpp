@@ -1,6 +1,8 @@
 #include "ForegroundBootstrapper.h"
 #include "ForegroundCommon.h"
+#include "Material/MaterialConstantArena.h"
 #include "Renderer/MegaPipeline.h"
+#include "Resources/ShaderModuleCache.h"
 
 namespace Foreground
 {
@@ -24,6 +26,8 @@ void CForegroundBootstrapper::Shutdown()
 
     PipelangContext.SetDevice(nullptr);
     RenderDevice->WaitIdle();
+    CMaterialConstantArena::Get().Shutdown();
+    CShaderModuleCache::Get().Shutdown();
     RenderQueue.reset();
     RenderDevice.reset();
 }
@@ -1,40 +1,124 @@
 #include "BasicMaterial.h"
 #include "ForegroundCommon.h"
 
+#include <functional>
 #include <imgui.h>
+#include <mutex>
+#include <vector>
 
 namespace Foreground
 {
 
-void CBasicMaterial::Bind(RHI::IRenderContext& context)
+// Sort ids are recycled so they stay small enough for the material field of the sort key
+static std::mutex SortIdMutex;
+static std::vector<uint32_t> FreeSortIds;
+static uint32_t NextSortId = 0;
+
+static constexpr Pl::CHashId MaterialConstantsId { "MaterialConstants" };
+static constexpr Pl::CHashId BaseColorTexId { "BaseColorTex" };
+static constexpr Pl::CHashId MetallicRoughnessTexId { "MetallicRoughnessTex" };
+
+CBasicMaterial::CBasicMaterial()
 {
-    if (bDSDirty)
+    std::lock_guard<std::mutex> lk(SortIdMutex);
+    if (FreeSortIds.empty())
+        SortId = NextSortId++;
+    else
     {
-        auto& lib = PipelangContext.GetLibrary("Internal");
-        auto& pb = lib.GetParameterBlock("BasicMaterialParams");
-        if (!DescriptorSet)
-            DescriptorSet = pb.CreateDescriptorSet();
+        SortId = FreeSortIds.back();
+        FreeSortIds.pop_back();
+    }
+}
+
+CBasicMaterial::~CBasicMaterial()
+{
+    CMaterialConstantArena::Get().Free(ConstantSlot);
+
+    std::lock_guard<std::mutex> lk(SortIdMutex);
+    FreeSortIds.push_back(SortId);
+}
+
+size_t CBasicMaterial::ComputeContentHash() const
+{
+    size_t hash = 0;
+    auto combine = [&hash](size_t value) {
+        hash ^= value + 0x9e3779b97f4a7c15ull + (hash << 6) + (hash >> 2);
+    };
+    for (float f : { Albedo.x, Albedo.y, Albedo.z, Albedo.w, Metallic, Roughness })
+        combine(std::hash<float>()(f));
+    combine(std::hash<RHI::CImageView*>()(AlbedoImage.get()));
+    combine(std::hash<RHI::CImageView*>()(MetallicRoughnessImage.get()));
+    return hash;
+}
+
+bool CBasicMaterial::IsContentEqual(const CBasicMaterial& other) const
+{
+    return Albedo.x == other.Albedo.x && Albedo.y == other.Albedo.y && Albedo.z == other.Albedo.z
+        && Albedo.w == other.Albedo.w && Metallic == other.Metallic
+        && Roughness == other.Roughness && AlbedoImage == other.AlbedoImage
+        && MetallicRoughnessImage == other.MetallicRoughnessImage;
+}
 
-        MaterialConstants materialConst;
+void CBasicMaterial::UpdateDescriptorSet()
+{
+    // A pipeline that started reading a binding this material skipped so far needs it written
+    if (ParamBlock && (ParamBlock->GetUsedBindingMask() & ~WrittenBindingMask))
+        bConstantsDirty = bTexturesDirty = true;
+    WriteDescriptorSet();
+}
+
+void CBasicMaterial::WriteDescriptorSet()
+{
+    if (!bConstantsDirty && !bTexturesDirty)
+        return;
+
+    auto& lib = PipelangContext.GetLibrary("Internal");
+    auto& pb = lib.GetParameterBlock("BasicMaterialParams");
+    ParamBlock = &pb;
+    // Bindings no pipeline reads yet are left alone
+    WrittenBindingMask = pb.GetUsedBindingMask();
+
+    auto constants = pb.GetBindingHandle(MaterialConstantsId);
+    if (pb.IsBindingUsed(constants) && (bConstantsDirty || !ConstantSlot.IsValid()))
+    {
+        MaterialConstants materialConst {};
         materialConst.BaseColor = GetAlbedo();
         materialConst.MetallicRoughness.z = GetMetallic();
         materialConst.MetallicRoughness.y = GetRoughness();
         materialConst.UseTextures = GetAlbedoImage() || GetMetallicRoughnessImage() ? 1 : 0;
 
-        MaterialConstantsBuffer = RenderDevice->CreateBuffer(
-            sizeof(MaterialConstants), RHI::EBufferUsageFlags::ConstantBuffer, &materialConst);
-
-        pb.BindBuffer(DescriptorSet, MaterialConstantsBuffer, 0, sizeof(MaterialConstants),
-                      "MaterialConstants");
-        pb.BindImageView(DescriptorSet, GetAlbedoImage(), "BaseColorTex");
-        if (GetAlbedoImage() && !GetMetallicRoughnessImage())
-            // TODO: replace this with a dummy texture
-            pb.BindImageView(DescriptorSet, GetAlbedoImage(), "MetallicRoughnessTex");
-        else
-            pb.BindImageView(DescriptorSet, GetMetallicRoughnessImage(), "MetallicRoughnessTex");
+        // Frames still in flight may read the old slot, so edits always move to a fresh one
+        auto& arena = CMaterialConstantArena::Get();
+        arena.Free(ConstantSlot);
+        ConstantSlot = arena.Allocate(&materialConst, sizeof(MaterialConstants));
+    }
+    bConstantsDirty = bTexturesDirty = false;
 
-        bDSDirty = false;
+    // The same goes for the set, every edit writes a fresh one in full. The old one goes back to
+    // the pool, which hands it out again once no frame in flight can read it.
+    DescriptorSet = pb.CreateDescriptorSet();
+    if (pb.IsBindingUsed(constants))
+        pb.BindBuffer(DescriptorSet, ConstantSlot.Buffer, ConstantSlot.Offset,
+                      sizeof(MaterialConstants), constants);
+    auto baseColor = pb.GetBindingHandle(BaseColorTexId);
+    if (pb.IsBindingUsed(baseColor))
+        pb.BindImageView(DescriptorSet, GetAlbedoImage(), baseColor);
+    auto metallicRoughness = pb.GetBindingHandle(MetallicRoughnessTexId);
+    if (pb.IsBindingUsed(metallicRoughness))
+    {
+        // TODO: replace this with a dummy texture
+        bool bAlbedoOnly = GetAlbedoImage() && !GetMetallicRoughnessImage();
+        pb.BindImageView(DescriptorSet,
+                         bAlbedoOnly ? GetAlbedoImage() : GetMetallicRoughnessImage(),
+                         metallicRoughness);
     }
+}
+
+void CBasicMaterial::Bind(RHI::IRenderContext& context)
+{
+    // Only flushes edits, a binding that a pipeline started reading meanwhile is written by the
+    // next UpdateDescriptorSet, which never races with recording
+    WriteDescriptorSet();
     context.BindRenderDescriptorSet(1, *DescriptorSet);
 }
 
@@ -42,9 +126,13 @@ void CBasicMaterial::ImGuiEditor()
 {
     if (ImGui::CollapsingHeader("Basic Material"))
     {
-        ImGui::DragFloat3("Albedo", &Albedo.x);
-        ImGui::DragFloat("Metallic", &Metallic);
-        ImGui::DragFloat("Roughness", &Roughness);
+        // Only an actual edit touches the constants, the editor is drawn every frame
+        if (ImGui::DragFloat3("Albedo", &Albedo.x))
+            bConstantsDirty = true;
+        if (ImGui::DragFloat("Metallic", &Metallic))
+            bConstantsDirty = true;
+        if (ImGui::DragFloat("Roughness", &Roughness))
+            bConstantsDirty = true;
     }
 }
 
@@ -1,6 +1,7 @@
 #include <utility>
 
 #pragma once
+#include "MaterialConstantArena.h"
 #include <Resources.h>
 #include <Pipelang.h>
 #include <Vector4.h>
@@ -13,16 +14,20 @@ namespace Foreground
 class CBasicMaterial
 {
 public:
-    CBasicMaterial() = default;
+    CBasicMaterial();
+    ~CBasicMaterial();
+    CBasicMaterial(const CBasicMaterial&) = delete;
+    CBasicMaterial& operator=(const CBasicMaterial&) = delete;
 
     void SetName(std::string name) { Name = std::move(name); }
     const std::string& GetName() const { return Name; }
 
-    void SetAlbedo(tc::Vector4 value) { Albedo = value; bDSDirty = true; }
-    void SetMetallic(float value) { Metallic = value; bDSDirty = true; }
-    void SetRoughness(float value) { Roughness = value; bDSDirty = true; }
-    void SetAlbedoImage(RHI::CImageView::Ref image) { AlbedoImage = std::move(image); bDSDirty = true; }
-    void SetMetallicRoughnessImage(RHI::CImageView::Ref image) { MetallicRoughnessImage = std::move(image); bDSDirty = true; }
+    void SetAlbedo(tc::Vector4 value) { Albedo = value; bConstantsDirty = true; }
+    void SetMetallic(float value) { Metallic = value; bConstantsDirty = true; }
+    void SetRoughness(float value) { Roughness = value; bConstantsDirty = true; }
+    // UseTextures lives in the constants, so texture changes dirty both
+    void SetAlbedoImage(RHI::CImageView::Ref image) { AlbedoImage = std::move(image); bConstantsDirty = bTexturesDirty = true; }
+    void SetMetallicRoughnessImage(RHI::CImageView::Ref image) { MetallicRoughnessImage = std::move(image); bConstantsDirty = bTexturesDirty = true; }
 
     const tc::Vector4& GetAlbedo() const { return Albedo; }
     float GetMetallic() const { return Metallic; }
@@ -30,12 +35,26 @@ public:
     RHI::CImageView::Ref GetAlbedoImage() const { return AlbedoImage; }
     RHI::CImageView::Ref GetMetallicRoughnessImage() const { return MetallicRoughnessImage; }
 
+    // Small and stable for the lifetime of the material, used to group draws by material
+    uint32_t GetSortId() const { return SortId; }
+
+    // Identify materials that would produce the same descriptor set, textures compare by identity
+    size_t ComputeContentHash() const;
+    bool IsContentEqual(const CBasicMaterial& other) const;
+
+    // Rebuilds the descriptor set if any parameter changed since the last call. Bind does this
+    // too, but parallel recording needs it done up front so that Bind never writes.
+    void UpdateDescriptorSet();
     void Bind(RHI::IRenderContext& context);
 
 	void ImGuiEditor();
 
 private:
+    // Writes whatever the dirty flags say
+    void WriteDescriptorSet();
+
     std::string Name;
+    uint32_t SortId;
 
     tc::Vector4 Albedo;
     float Metallic{};
@@ -51,9 +70,13 @@ private:
         uint32_t UseTextures;
     };
 
-    bool bDSDirty = true;
+    bool bConstantsDirty = true;
+    bool bTexturesDirty = true;
     RHI::CDescriptorSet::Ref DescriptorSet;
-	RHI::CBuffer::Ref MaterialConstantsBuffer;
+    const Pl::CParameterBlock* ParamBlock = nullptr;
+    // Bindings read by some pipeline at the last write, the others were skipped
+    uint32_t WrittenBindingMask = 0;
+    CMaterialConstantArena::CSlot ConstantSlot;
 };
 
 } /* namespace Foreground */
@@ -0,0 +1,74 @@
+#include "MaterialConstantArena.h"
+#include "ForegroundCommon.h"
+#include <cassert>
+#include <cstring>
+
+namespace Foreground
+{
+
+CMaterialConstantArena& CMaterialConstantArena::Get()
+{
+    static CMaterialConstantArena singleton;
+    return singleton;
+}
+
+CMaterialConstantArena::CSlot CMaterialConstantArena::Allocate(const void* data, size_t size)
+{
+    assert(size <= SlotSize);
+
+    std::lock_guard<std::mutex> lk(Mutex);
+    CSlot slot;
+    if (!FreeSlots.empty())
+    {
+        slot.Index = FreeSlots.back();
+        FreeSlots.pop_back();
+    }
+    else
+    {
+        slot.Index = NextSlot++;
+        if (slot.Index / SlotsPerPage == Pages.size())
+            Pages.push_back(RenderDevice->CreateBuffer(SlotSize * SlotsPerPage,
+                                                       RHI::EBufferUsageFlags::ConstantBuffer,
+                                                       nullptr));
+    }
+
+    slot.Buffer = Pages[slot.Index / SlotsPerPage];
+    slot.Offset = (slot.Index % SlotsPerPage) * SlotSize;
+
+    // Nothing in flight reads a freshly handed out slot, so it can be written right away
+    void* mapped = slot.Buffer->Map(slot.Offset, SlotSize);
+    memcpy(mapped, data, size);
+    slot.Buffer->Unmap();
+    return slot;
+}
+
+void CMaterialConstantArena::Free(const CSlot& slot)
+{
+    if (!slot.IsValid())
+        return;
+
+    std::lock_guard<std::mutex> lk(Mutex);
+    RetiredSlots.emplace_back(slot.Index, FrameNumber);
+}
+
+void CMaterialConstantArena::NextFrame()
+{
+    std::lock_guard<std::mutex> lk(Mutex);
+    FrameNumber++;
+    while (!RetiredSlots.empty() && RetiredSlots.front().second + RetireFrames <= FrameNumber)
+    {
+        FreeSlots.push_back(RetiredSlots.front().first);
+        RetiredSlots.pop_front();
+    }
+}
+
+void CMaterialConstantArena::Shutdown()
+{
+    std::lock_guard<std::mutex> lk(Mutex);
+    Pages.clear();
+    FreeSlots.clear();
+    RetiredSlots.clear();
+    NextSlot = 0;
+}
+
+} /* namespace Foreground */
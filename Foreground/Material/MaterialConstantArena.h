@@ -0,0 +1,56 @@
+#pragma once
+#include "Renderer/FrameConstantRing.h"
+#include <Resources.h>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <vector>
+
+namespace Foreground
+{
+
+// Persistent home for material constants. Every material owns one fixed size slot inside a few
+// large constant buffers. When a material changes it takes a fresh slot and gives the old one
+// back, but a returned slot is only handed out again once no frame in flight can still read it.
+class CMaterialConstantArena
+{
+public:
+    // One constant buffer offset alignment worth, more than any material needs
+    static const size_t SlotSize = 256;
+    static const uint32_t SlotsPerPage = 1024;
+    static const uint32_t RetireFrames = CFrameConstantRing::FramesInFlight;
+
+    struct CSlot
+    {
+        uint32_t Index = UINT32_MAX;
+        RHI::CBuffer::Ref Buffer;
+        size_t Offset = 0;
+
+        bool IsValid() const { return Index != UINT32_MAX; }
+    };
+
+    static CMaterialConstantArena& Get();
+
+    // Takes a slot and fills it with size bytes of data, size must not exceed SlotSize
+    CSlot Allocate(const void* data, size_t size);
+    // Returns a slot, it is recycled RetireFrames frames from now
+    void Free(const CSlot& slot);
+
+    // Called once per frame by the pipeline to age returned slots
+    void NextFrame();
+    // Drops every page, has to happen before the device goes away
+    void Shutdown();
+
+private:
+    CMaterialConstantArena() = default;
+
+    std::mutex Mutex;
+    std::vector<RHI::CBuffer::Ref> Pages;
+    std::vector<uint32_t> FreeSlots;
+    // Slot index and the frame it was returned in
+    std::deque<std::pair<uint32_t, uint64_t>> RetiredSlots;
+    uint32_t NextSlot = 0;
+    uint64_t FrameNumber = 0;
+};
+
+} /* namespace Foreground */
@@ -0,0 +1,85 @@
+#include "FrameConstantRing.h"
+#include "ForegroundCommon.h"
+#include <algorithm>
+#include <cassert>
+
+namespace Foreground
+{
+
+CFrameConstantRing::~CFrameConstantRing()
+{
+    if (bInFrame)
+        EndFrame();
+}
+
+void CFrameConstantRing::BeginFrame()
+{
+    assert(!bInFrame);
+    FrameIndex = (FrameIndex + 1) % FramesInFlight;
+    CFrame& frame = Frames[FrameIndex];
+    frame.PageIndex = 0;
+    frame.Offset = 0;
+    FrameUsage = 0;
+    bInFrame = true;
+}
+
+void CFrameConstantRing::EndFrame()
+{
+    assert(bInFrame);
+    for (CPage& page : Frames[FrameIndex].Pages)
+    {
+        if (page.Mapped)
+        {
+            page.Buffer->Unmap();
+            page.Mapped = nullptr;
+        }
+    }
+    bInFrame = false;
+}
+
+CFrameConstantRing::CAllocation CFrameConstantRing::Allocate(size_t size)
+{
+    assert(bInFrame);
+    CFrame& frame = Frames[FrameIndex];
+    for (;;)
+    {
+        if (frame.PageIndex == frame.Pages.size())
+        {
+            // Out of pages for this frame, the new one stays with the frame from now on
+            CPage page;
+            page.Size = std::max(PageSize, (size + Alignment - 1) / Alignment * Alignment);
+            page.Buffer = RenderDevice->CreateBuffer(page.Size,
+                                                     RHI::EBufferUsageFlags::ConstantBuffer,
+                                                     nullptr);
+            frame.Pages.push_back(std::move(page));
+            frame.Offset = 0;
+        }
+
+        CPage& page = frame.Pages[frame.PageIndex];
+        if (frame.Offset + size <= page.Size)
+        {
+            if (!page.Mapped)
+                MapPage(page);
+
+            CAllocation alloc;
+            alloc.Buffer = page.Buffer;
+            alloc.Offset = frame.Offset;
+            alloc.Data = page.Mapped + frame.Offset;
+
+            size_t alignedSize = (size + Alignment - 1) / Alignment * Alignment;
+            frame.Offset += alignedSize;
+            FrameUsage += alignedSize;
+            return alloc;
+        }
+
+        frame.PageIndex++;
+        frame.Offset = 0;
+    }
+}
+
+void CFrameConstantRing::MapPage(CPage& page)
+{
+    page.Mapped = static_cast<uint8_t*>(page.Buffer->Map(0, page.Size));
+}
+
+} /* namespace Foreground */
@@ -0,0 +1,80 @@
+#pragma once
+#include <Resources.h>
+#include <cstdint>
+#include <vector>
+
+namespace Foreground
+{
+
+// Linear allocator for constants that live for a single frame. Each frame in flight owns a set of
+// large persistently reused pages; allocating only bumps an offset, and consumers bind the page
+// once and select their slice with a dynamic offset.
+//
+// A frame's pages are only rewritten FramesInFlight frames later. The render thread is throttled
+// by swap chain acquisition to fewer frames than that, which is what makes the reuse safe.
+class CFrameConstantRing
+{
+public:
+    static const uint32_t FramesInFlight = 3;
+    // Satisfies the constant buffer offset alignment of every GPU we target
+    static const size_t Alignment = 256;
+    static const size_t PageSize = 4 * 1024 * 1024;
+
+    struct CAllocation
+    {
+        RHI::CBuffer::Ref Buffer;
+        size_t Offset = 0;
+        // Mapped memory at Offset, valid until EndFrame
+        void* Data = nullptr;
+    };
+
+    CFrameConstantRing() = default;
+    CFrameConstantRing(const CFrameConstantRing&) = delete;
+    CFrameConstantRing& operator=(const CFrameConstantRing&) = delete;
+    ~CFrameConstantRing();
+
+    // Moves on to the next frame's pages and maps them for writing
+    void BeginFrame();
+    // Unmaps the frame's pages, call before the frame is submitted
+    void EndFrame();
+
+    // Not thread safe, allocate while preparing lists on the render thread
+    CAllocation Allocate(size_t size);
+
+    template <typename T> CAllocation Push(const T& value)
+    {
+        CAllocation alloc = Allocate(sizeof(T));
+        *static_cast<T*>(alloc.Data) = value;
+        return alloc;
+    }
+
+    // Which of the FramesInFlight frames is current, e.g. to keep per frame copies of state
+    uint32_t GetFrameIndex() const { return FrameIndex; }
+    // Bytes handed out so far in the current frame, including alignment padding
+    size_t GetFrameUsage() const { return FrameUsage; }
+
+private:
+    struct CPage
+    {
+        RHI::CBuffer::Ref Buffer;
+        size_t Size = 0;
+        uint8_t* Mapped = nullptr;
+    };
+
+    struct CFrame
+    {
+        std::vector<CPage> Pages;
+        // Page currently being bumped and the offset into it
+        size_t PageIndex = 0;
+        size_t Offset = 0;
+    };
+
+    void MapPage(CPage& page);
+
+    CFrame Frames[FramesInFlight];
+    uint32_t FrameIndex = 0;
+    bool bInFrame = false;
+    size_t FrameUsage = 0;
+};
+
+} /* namespace Foreground */
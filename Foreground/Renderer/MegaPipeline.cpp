@@ -1,29 +1,20 @@
 #include "MegaPipeline.h"
 #include "GBufferRenderer.h"
+#include "Material/MaterialConstantArena.h"
 #include "Resources/ResourceManager.h"
+#include "Resources/ShaderModuleCache.h"
 
 #include <RHIImGuiBackend.h>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
 #include <ShaderModule.h>
-#include <fstream>
 #include <imgui.h>
 #include <iostream>
 
 namespace Foreground
 {
 
-    static RHI::CShaderModule::Ref LoadSPIRV(RHI::CDevice::Ref device, const std::string& path)
-    {
-        std::string filePath = CResourceManager::Get().FindShader(path);
-        std::ifstream file(filePath.c_str(), std::ios::binary | std::ios::ate);
-        std::streamsize size = file.tellg();
-        file.seekg(0, std::ios::beg);
-
-        std::vector<char> buffer(size);
-        if (file.read(buffer.data(), size))
-            return device->CreateShaderModule(buffer.size(), buffer.data());
-        return {};
-    }
-
     CMegaPipeline::CMegaPipeline(RHI::CSwapChain::Ref swapChain)
         : SwapChain(swapChain)
         , GBufferRenderer(this)
@@ -56,7 +47,213 @@ namespace Foreground
 
         RHI::CRHIImGuiBackend::Init(RenderDevice, gtao_color->getRenderPass());
 
+        PipelangContext.SetFramesInFlight(CFrameConstantRing::FramesInFlight);
         PipelangContext.CreateLibrary("Internal").Parse();
+        if (IsHotReloadEnabled())
+            StartHotReload();
+
+        // Rebuild last run's mesh pipelines while the scene loads
+        if (IsPipelineCacheEnabled())
+        {
+            bPipelineCacheWarm = PipelineCache.StartPrewarm(
+                PipelineCacheFile,
+                [this](uint32_t rendererId, CPipelineCache::FCreatePipeline& create,
+                    const RHI::CRenderPass*& renderPass) {
+                    return ResolveRenderer(rendererId, create, renderPass);
+                });
+        }
+    }
+
+    CMegaPipeline::~CMegaPipeline()
+    {
+        PipelineCache.WaitForPrewarm();
+        if (IsPipelineCacheEnabled() && !PipelineCache.SaveManifest(PipelineCacheFile))
+            std::cerr << "Could not write " << PipelineCacheFile << std::endl;
+    }
+
+    bool CMegaPipeline::IsPipelineCacheEnabled()
+    {
+        return !getenv("FOREGROUND_NO_PIPELINE_CACHE");
+    }
+
+    bool CMegaPipeline::ResolveRenderer(uint32_t rendererId,
+        CPipelineCache::FCreatePipeline& create, const RHI::CRenderPass*& renderPass)
+    {
+        switch (rendererId)
+        {
+        case CGBufferRenderer::RendererId:
+            create = [this](const CMeshPipelineKey& k) {
+                return GBufferRenderer.CreateMeshPipeline(k);
+            };
+            renderPass = GBufferRenderer.GetRenderPass();
+            return true;
+        case CZOnlyRenderer::RendererId:
+            create = [this](const CMeshPipelineKey& k) {
+                return ZOnlyRenderer.CreateMeshPipeline(k);
+            };
+            renderPass = ZOnlyRenderer.GetRenderPass();
+            return true;
+        case CVoxelizeRenderer::RendererId:
+            create = [this](const CMeshPipelineKey& k) {
+                return VoxelizeRenderer.CreateMeshPipeline(k);
+            };
+            renderPass = VoxelizeRenderer.GetRenderPass();
+            return true;
+        default:
+            return false;
+        }
+    }
+
+    bool CMegaPipeline::IsHotReloadEnabled()
+    {
+        return getenv("FOREGROUND_HOT_RELOAD") != nullptr;
+    }
+
+    void CMegaPipeline::CScreenPassSlots::Resolve(const CMaterial& material)
+    {
+        Sampler = material.getSlot("s");
+        Albedo = material.getSlot("t_albedo");
+        Normals = material.getSlot("t_normals");
+        Material = material.getSlot("t_material");
+        Depth = material.getSlot("t_depth");
+        Shadow = material.getSlot("t_shadow");
+        AO = material.getSlot("t_ao");
+        Lighting = material.getSlot("t_lighting");
+        Indirect = material.getSlot("t_indirect");
+        Voxels = material.getSlot("voxels");
+        Temporal = material.getSlot("temporal");
+        TAABuffer = material.getSlot("taaBuffer");
+        GlobalConstants = material.getSlot("GlobalConstants");
+        ExtendedMatrices = material.getSlot("ExtendedMatrices");
+        PrevProj = material.getSlot("prevProj");
+        Sun = material.getSlot("Sun");
+        Miscs = material.getSlot("EngineCommonMiscs");
+        PointLights = material.getSlot("pointLights");
+        DirectionalLights = material.getSlot("directionalLights");
+    }
+
+    void CMegaPipeline::ResolveScreenSlots()
+    {
+        gtao_visibility_slots.Resolve(*gtao_visibility);
+        gtao_blur_slots.Resolve(*gtao_blur);
+        gtao_color_slots.Resolve(*gtao_color);
+        lighting_deferred_slots.Resolve(*lighting_deferred);
+        lighting_indirect_slots.Resolve(*lighting_indirect);
+        indirect_blurX_slots.Resolve(*indirect_blurX);
+        indirect_blurY_slots.Resolve(*indirect_blurY);
+    }
+
+    std::vector<CMaterial*> CMegaPipeline::GetScreenMaterials() const
+    {
+        return { gtao_visibility.get(), gtao_blur.get(), gtao_color.get(),
+            lighting_deferred.get(), lighting_indirect.get(), indirect_blurX.get(),
+            indirect_blurY.get() };
+    }
+
+    void CMegaPipeline::StartHotReload()
+    {
+        PipelangContext.GetLibrary("Internal").EnableHotReload();
+
+        // Shaders are compiled the way Shader/CMakeLists.txt does, with the search dirs as
+        // include dirs
+        const auto& shaderPaths = CResourceManager::Get().GetShaderPaths();
+        ShaderIncludeDirs.assign(shaderPaths.begin(), shaderPaths.end());
+        ShaderWatcher = std::make_unique<Pl::CFileWatcher>();
+        for (const std::string& dir : ShaderIncludeDirs)
+            ShaderWatcher->Watch(dir);
+
+        ShaderDependencies = std::make_unique<Pl::CShaderDependencyGraph>(ShaderIncludeDirs);
+        for (CMaterial* material : GetScreenMaterials())
+        {
+            for (const std::string& spirvName : { material->getVSFile(), material->getPSFile() })
+            {
+                // Built next to the source as <source>.spv
+                std::string source = CResourceManager::Get().FindShader(
+                    spirvName.substr(0, spirvName.rfind(".spv")));
+                if (!source.empty())
+                    ScreenShaders[ShaderDependencies->AddShader(source)] = spirvName;
+            }
+        }
+        std::cout << "Hot reload: watching Pipelang scripts and " << ScreenShaders.size()
+                  << " screen pass shaders" << std::endl;
+    }
+
+    void CMegaPipeline::PollHotReload()
+    {
+        std::vector<Pl::CHashId> reloaded = PipelangContext.GetLibrary("Internal").PollHotReload();
+        if (!reloaded.empty())
+        {
+            uint32_t rebuilt = PipelineCache.Rebuild(reloaded,
+                [this](uint32_t rendererId, CPipelineCache::FCreatePipeline& create,
+                    const RHI::CRenderPass*& renderPass) {
+                    return ResolveRenderer(rendererId, create, renderPass);
+                });
+            std::cout << "Hot reload: swapped " << rebuilt << " mesh pipelines" << std::endl;
+        }
+
+        // Only the shaders including an edited file recompile
+        for (const std::string& path : ShaderWatcher->Poll())
+        {
+            for (const std::string& source : ShaderDependencies->GetAffectedShaders(path))
+            {
+                auto iter = ScreenShaders.find(source);
+                if (iter == ScreenShaders.end())
+                    continue;
+
+                // Rescanned right away, so that edits to an include added by this one already
+                // count
+                ShaderDependencies->AddShader(source);
+
+                CShaderReload reload;
+                reload.SourcePath = source;
+                reload.SPIRVName = iter->second;
+                reload.bVertex = source.size() > 5
+                    && source.compare(source.size() - 5, 5, ".vert") == 0;
+                reload.Module = PipelangContext.CompileShaderFileAsync(
+                    source, reload.bVertex ? "vertex" : "fragment", ShaderIncludeDirs);
+
+                // A newer edit supersedes a compile still running
+                ShaderReloads.erase(std::remove_if(ShaderReloads.begin(), ShaderReloads.end(),
+                                        [&](const CShaderReload& r) {
+                                            return r.SourcePath == source;
+                                        }),
+                    ShaderReloads.end());
+                ShaderReloads.push_back(std::move(reload));
+            }
+        }
+
+        for (auto iter = ShaderReloads.begin(); iter != ShaderReloads.end();)
+        {
+            if (iter->Module.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+            {
+                ++iter;
+                continue;
+            }
+
+            RHI::CShaderModule::Ref module = iter->Module.get();
+            if (!module)
+                std::cerr << "Hot reload: " << iter->SourcePath << " failed to compile"
+                          << std::endl;
+            // Through the cache, so passes recreated by a resize keep the edit
+            CShaderModuleCache::FShaderRef shader;
+            if (module)
+                shader = CShaderModuleCache::Get().Replace(iter->SPIRVName, std::move(module));
+            for (CMaterial* material : GetScreenMaterials())
+            {
+                if (!shader)
+                    break;
+                if (iter->bVertex && material->getVSFile() == iter->SPIRVName)
+                    material->reloadShaders(shader, nullptr);
+                if (!iter->bVertex && material->getPSFile() == iter->SPIRVName)
+                    material->reloadShaders(nullptr, shader);
+            }
+            // Includes may have changed again while it compiled
+            if (shader)
+                ShaderDependencies->AddShader(iter->SourcePath);
+            iter = ShaderReloads.erase(iter);
+            // Slots keep their index across reloads, only parameters new to a pass get one
+            ResolveScreenSlots();
+        }
     }
 
     void CMegaPipeline::SetSceneView(std::unique_ptr<CSceneView> sceneView,
@@ -75,6 +272,9 @@ namespace Foreground
     {
         std::cout << "Resizing" << std::endl;
 
+        // The prewarm thread builds against the current render passes
+        PipelineCache.WaitForPrewarm();
+
         SwapChain->AutoResize();
         uint32_t w, h;
         SwapChain->GetSize(w, h);
@@ -151,6 +351,10 @@ namespace Foreground
         if (!SceneView || !VoxelImage)
             return;
 
+        // Nothing of the last frame is being recorded anymore, safe to swap pipelines
+        if (ShaderWatcher)
+            PollHotReload();
+
         if (!SwapChain->AcquireNextImage())
         {
             return;
@@ -166,6 +370,11 @@ namespace Foreground
 
         VoxelizerSceneView->PrepareToRender();
 
+        FrameConstants.BeginFrame();
+        CMaterialConstantArena::Get().NextFrame();
+        PipelangContext.BeginFrame();
+        UploadEngineCommon();
+
         auto cmdList = RenderQueue->CreateCommandList();
         cmdList->Enqueue();
 
@@ -179,17 +388,11 @@ namespace Foreground
             GBufferPass,
             { RHI::CClearValue(0.0f, 0.0f, 0.0f, 0.0f), RHI::CClearValue(0.0f, 0.0f, 0.0f, 0.0f),
               RHI::CClearValue(0.0f, 0.0f, 0.0f, 0.0f), RHI::CClearValue(1.0f, 0) });
-        auto ctx = passCtx->CreateRenderContext(0);
-        GBufferRenderer.RenderList(*ctx, SceneView->GetVisiblePrimModelMatrix(),
-            SceneView->GetVisiblePrimitiveList());
-        ctx->FinishRecording();
+        RecordPassParallel(*passCtx, GBufferRenderer, *SceneView);
         passCtx->FinishRecording();
 
         passCtx = cmdList->CreateParallelRenderContext(ZOnlyPass, { RHI::CClearValue(1.0f, 0) });
-        ctx = passCtx->CreateRenderContext(0);
-        ZOnlyRenderer.RenderList(*ctx, ShadowSceneView->GetVisiblePrimModelMatrix(),
-            ShadowSceneView->GetVisiblePrimitiveList());
-        ctx->FinishRecording();
+        RecordPassParallel(*passCtx, ZOnlyRenderer, *ShadowSceneView);
         passCtx->FinishRecording();
 
         auto copyCtx = cmdList->CreateCopyContext();
@@ -216,25 +419,22 @@ namespace Foreground
         copyCtx->FinishRecording();
 
         passCtx = cmdList->CreateParallelRenderContext(VoxelizationPass, {});
-        ctx = passCtx->CreateRenderContext(0);
-        VoxelizeRenderer.RenderList(*ctx, VoxelizerSceneView->GetVisiblePrimModelMatrix(),
-            VoxelizerSceneView->GetVisiblePrimitiveList());
-        ctx->FinishRecording();
+        RecordPassParallel(*passCtx, VoxelizeRenderer, *VoxelizerSceneView);
         passCtx->FinishRecording();
 
-        gtao_visibility->beginRender(cmdList);
-        gtao_visibility->setSampler("s", GlobalLinearSampler);
-        gtao_visibility->setImageView("t_albedo", GBuffer0);
-        gtao_visibility->setImageView("t_normals", GBuffer1);
-        gtao_visibility->setImageView("t_depth", GBufferDepth);
-        gtao_visibility->setStruct("GlobalConstants", sizeof(CViewConstants),
+        gtao_visibility->beginRender(cmdList, FrameConstants);
+        gtao_visibility->setSampler(gtao_visibility_slots.Sampler, GlobalLinearSampler);
+        gtao_visibility->setImageView(gtao_visibility_slots.Albedo, GBuffer0);
+        gtao_visibility->setImageView(gtao_visibility_slots.Normals, GBuffer1);
+        gtao_visibility->setImageView(gtao_visibility_slots.Depth, GBufferDepth);
+        gtao_visibility->setStruct(gtao_visibility_slots.GlobalConstants, sizeof(CViewConstants),
             &SceneView->GetViewConstants());
         gtao_visibility->blit2d();
         gtao_visibility->endRender();
 
-        gtao_blur->beginRender(cmdList);
-        gtao_blur->setSampler("s", GlobalLinearSampler);
-        gtao_blur->setImageView("t_ao", gtao_visibility->getRTViews()[0]);
+        gtao_blur->beginRender(cmdList, FrameConstants);
+        gtao_blur->setSampler(gtao_blur_slots.Sampler, GlobalLinearSampler);
+        gtao_blur->setImageView(gtao_blur_slots.AO, gtao_visibility->getRTViews()[0]);
         gtao_blur->blit2d();
         gtao_blur->endRender();
 
@@ -249,78 +449,87 @@ namespace Foreground
         miscs.frameCount = frameCount;
         miscs.resolution = tc::Vector2(width, height);
 
-        lighting_indirect->beginRender(cmdList);
-        lighting_indirect->setSampler("s", GlobalLinearSampler);
-        lighting_indirect->setImageView("t_depth", GBufferDepth);
-        lighting_indirect->setImageView("t_normals", GBuffer1);
-        lighting_indirect->setImageView("t_shadow", ShadowDepth);
-        lighting_indirect->setImageView("voxels", VoxelBuffer);
-        lighting_indirect->setImageView("temporal", indirectTemporal);
-        lighting_indirect->setStruct("GlobalConstants", sizeof(CViewConstants),
-            &SceneView->GetViewConstants());
-        lighting_indirect->setStruct("ExtendedMatrices", sizeof(ExtendedMatricesConstants),
-            &matricesConstants);
-        lighting_indirect->setStruct("prevProj", sizeof(PreviousProjections), &prevProj);
-        lighting_indirect->setStruct("Sun", sizeof(PerLightConstants),
+        lighting_indirect->beginRender(cmdList, FrameConstants);
+        lighting_indirect->setSampler(lighting_indirect_slots.Sampler, GlobalLinearSampler);
+        lighting_indirect->setImageView(lighting_indirect_slots.Depth, GBufferDepth);
+        lighting_indirect->setImageView(lighting_indirect_slots.Normals, GBuffer1);
+        lighting_indirect->setImageView(lighting_indirect_slots.Shadow, ShadowDepth);
+        lighting_indirect->setImageView(lighting_indirect_slots.Voxels, VoxelBuffer);
+        lighting_indirect->setImageView(lighting_indirect_slots.Temporal, indirectTemporal);
+        lighting_indirect->setStruct(lighting_indirect_slots.GlobalConstants,
+            sizeof(CViewConstants), &SceneView->GetViewConstants());
+        lighting_indirect->setStruct(lighting_indirect_slots.ExtendedMatrices,
+            sizeof(ExtendedMatricesConstants), &matricesConstants);
+        lighting_indirect->setStruct(lighting_indirect_slots.PrevProj,
+            sizeof(PreviousProjections), &prevProj);
+        lighting_indirect->setStruct(lighting_indirect_slots.Sun, sizeof(PerLightConstants),
             &directionalLightLists.lights[0]);
-        lighting_indirect->setStruct("EngineCommonMiscs", sizeof(EngineCommonMiscs), &miscs);
+        lighting_indirect->setStruct(lighting_indirect_slots.Miscs,
+            sizeof(EngineCommonMiscs), &miscs);
         lighting_indirect->blit2d();
         lighting_indirect->endRender();
 
-        indirect_blurX->beginRender(cmdList);
-        indirect_blurX->setSampler("s", GlobalLinearSamplerClamped);
-        indirect_blurX->setImageView("t_depth", GBufferDepth);
-        indirect_blurX->setImageView("t_indirect", lighting_indirect->getRTViews()[0]);
-        indirect_blurX->setStruct("EngineCommonMiscs", sizeof(EngineCommonMiscs), &miscs);
+        indirect_blurX->beginRender(cmdList, FrameConstants);
+        indirect_blurX->setSampler(indirect_blurX_slots.Sampler, GlobalLinearSamplerClamped);
+        indirect_blurX->setImageView(indirect_blurX_slots.Depth, GBufferDepth);
+        indirect_blurX->setImageView(indirect_blurX_slots.Indirect,
+            lighting_indirect->getRTViews()[0]);
+        indirect_blurX->setStruct(indirect_blurX_slots.Miscs, sizeof(EngineCommonMiscs), &miscs);
         indirect_blurX->blit2d();
         indirect_blurX->endRender();
 
-        indirect_blurY->beginRender(cmdList);
-        indirect_blurY->setSampler("s", GlobalLinearSamplerClamped);
-        indirect_blurY->setImageView("t_depth", GBufferDepth);
-        indirect_blurY->setImageView("t_indirect", indirect_blurX->getRTViews()[0]);
-        indirect_blurY->setStruct("EngineCommonMiscs", sizeof(EngineCommonMiscs), &miscs);
+        indirect_blurY->beginRender(cmdList, FrameConstants);
+        indirect_blurY->setSampler(indirect_blurY_slots.Sampler, GlobalLinearSamplerClamped);
+        indirect_blurY->setImageView(indirect_blurY_slots.Depth, GBufferDepth);
+        indirect_blurY->setImageView(indirect_blurY_slots.Indirect,
+            indirect_blurX->getRTViews()[0]);
+        indirect_blurY->setStruct(indirect_blurY_slots.Miscs, sizeof(EngineCommonMiscs), &miscs);
         indirect_blurY->blit2d();
         indirect_blurY->endRender();
 
-        lighting_deferred->beginRender(cmdList);
-        lighting_deferred->setSampler("s", GlobalLinearSampler);
-        lighting_deferred->setImageView("t_albedo", GBuffer0);
-        lighting_deferred->setImageView("t_normals", GBuffer1);
-        lighting_deferred->setImageView("t_material", GBuffer2);
-        lighting_deferred->setImageView("t_depth", GBufferDepth);
-        lighting_deferred->setImageView("t_shadow", ShadowDepth);
-        lighting_deferred->setStruct("GlobalConstants", sizeof(CViewConstants),
-            &SceneView->GetViewConstants());
-        lighting_deferred->setStruct("pointLights", sizeof(LightLists), &pointLightLists);
-        lighting_deferred->setStruct("directionalLights", sizeof(LightLists), &directionalLightLists);
-        lighting_deferred->setStruct("ExtendedMatrices", sizeof(ExtendedMatricesConstants),
-            &matricesConstants);
+        lighting_deferred->beginRender(cmdList, FrameConstants);
+        lighting_deferred->setSampler(lighting_deferred_slots.Sampler, GlobalLinearSampler);
+        lighting_deferred->setImageView(lighting_deferred_slots.Albedo, GBuffer0);
+        lighting_deferred->setImageView(lighting_deferred_slots.Normals, GBuffer1);
+        lighting_deferred->setImageView(lighting_deferred_slots.Material, GBuffer2);
+        lighting_deferred->setImageView(lighting_deferred_slots.Depth, GBufferDepth);
+        lighting_deferred->setImageView(lighting_deferred_slots.Shadow, ShadowDepth);
+        lighting_deferred->setStruct(lighting_deferred_slots.GlobalConstants,
+            sizeof(CViewConstants), &SceneView->GetViewConstants());
+        lighting_deferred->setStruct(lighting_deferred_slots.PointLights,
+            sizeof(LightLists), &pointLightLists);
+        lighting_deferred->setStruct(lighting_deferred_slots.DirectionalLights,
+            sizeof(LightLists), &directionalLightLists);
+        lighting_deferred->setStruct(lighting_deferred_slots.ExtendedMatrices,
+            sizeof(ExtendedMatricesConstants), &matricesConstants);
         lighting_deferred->blit2d();
         lighting_deferred->endRender();
 
-        gtao_color->beginRender(cmdList);
-        gtao_color->setSampler("s", GlobalLinearSamplerClamped);
-        gtao_color->setImageView("t_albedo", GBuffer0);
-        gtao_color->setImageView("t_ao", gtao_blur->getRTViews()[0]);
-        gtao_color->setImageView("t_depth", GBufferDepth);
-        gtao_color->setImageView("t_lighting", lighting_deferred->getRTViews()[0]);
-        gtao_color->setImageView("t_shadow", ShadowDepth);
-        gtao_color->setImageView("t_indirect", indirect_blurY->getRTViews()[0]);
-        gtao_color->setImageView("taaBuffer", taaImageView);
-        gtao_color->setStruct("GlobalConstants", sizeof(CViewConstants),
+        gtao_color->beginRender(cmdList, FrameConstants);
+        gtao_color->setSampler(gtao_color_slots.Sampler, GlobalLinearSamplerClamped);
+        gtao_color->setImageView(gtao_color_slots.Albedo, GBuffer0);
+        gtao_color->setImageView(gtao_color_slots.AO, gtao_blur->getRTViews()[0]);
+        gtao_color->setImageView(gtao_color_slots.Depth, GBufferDepth);
+        gtao_color->setImageView(gtao_color_slots.Lighting, lighting_deferred->getRTViews()[0]);
+        gtao_color->setImageView(gtao_color_slots.Shadow, ShadowDepth);
+        gtao_color->setImageView(gtao_color_slots.Indirect, indirect_blurY->getRTViews()[0]);
+        gtao_color->setImageView(gtao_color_slots.TAABuffer, taaImageView);
+        gtao_color->setStruct(gtao_color_slots.GlobalConstants, sizeof(CViewConstants),
             &SceneView->GetViewConstants());
-        gtao_color->setStruct("ExtendedMatrices", sizeof(ExtendedMatricesConstants),
+        gtao_color->setStruct(gtao_color_slots.ExtendedMatrices, sizeof(ExtendedMatricesConstants),
             &matricesConstants);
-        gtao_color->setStruct("prevProj", sizeof(PreviousProjections), &prevProj);
-        gtao_color->setStruct("Sun", sizeof(PerLightConstants), &directionalLightLists.lights[0]);
-        gtao_color->setStruct("EngineCommonMiscs", sizeof(EngineCommonMiscs),
+        gtao_color->setStruct(gtao_color_slots.PrevProj, sizeof(PreviousProjections), &prevProj);
+        gtao_color->setStruct(gtao_color_slots.Sun,
+            sizeof(PerLightConstants), &directionalLightLists.lights[0]);
+        gtao_color->setStruct(gtao_color_slots.Miscs, sizeof(EngineCommonMiscs),
             &miscs);
         gtao_color->blit2d();
 
         prevProj.PrevModelView = SceneView->GetViewConstants().ViewMat;
         prevProj.PrevProjection = SceneView->GetViewConstants().ProjMat;
 
+        ShowRenderStatsImGui();
+
         // Render ImGui at the latest possible time so that we can still use ImGui inside renderer
         ImGui::Render();
         auto* drawData = ImGui::GetDrawData();
@@ -329,6 +538,7 @@ namespace Foreground
 
         gtao_color->endRender();
 
+        FrameConstants.EndFrame();
         cmdList->Commit();
 
         SceneView->FrameFinished();
@@ -338,41 +548,100 @@ namespace Foreground
         RHI::CSwapChainPresentInfo info;
         SwapChain->Present(info);
 
+        if (frameCount == 0)
+        {
+            auto elapsed = std::chrono::steady_clock::now() - StartTime;
+            std::cout << "First frame after "
+                      << std::chrono::duration_cast<std::chrono::milliseconds>(elapsed).count()
+                      << " ms, pipeline cache "
+                      << (bPipelineCacheWarm ? "warm" : "cold") << ", "
+                      << PipelineCache.GetPrewarmedCount() << " pipelines prewarmed" << std::endl;
+        }
         frameCount++;
     }
 
-    void CMegaPipeline::BindEngineCommonForView(RHI::IRenderContext & context, uint32_t viewIndex)
+    static const size_t ViewConstantsStride = (sizeof(CViewConstants)
+        + CFrameConstantRing::Alignment - 1) / CFrameConstantRing::Alignment
+        * CFrameConstantRing::Alignment;
+
+    void CMegaPipeline::UploadEngineCommon()
     {
         auto& lib = PipelangContext.GetLibrary("Internal");
         auto& pb = lib.GetParameterBlock("EngineCommon");
-        if (!EngineCommonDS)
-            EngineCommonDS = pb.CreateDescriptorSet();
-
+        if (!GlobalConstantsBinding.IsValid())
+        {
+            GlobalConstantsBinding = pb.GetBindingHandle("GlobalConstants");
+            EngineCommonMiscsBinding = pb.GetBindingHandle("EngineCommonMiscs");
+        }
+        // The constants move to this frame's ring page, frames in flight keep their own set
+        EngineCommonDS = pb.AllocateTransientDescriptorSet();
         pb.BindSampler(EngineCommonDS, GlobalNiceSampler, "GlobalNiceSampler");
         pb.BindSampler(EngineCommonDS, GlobalLinearSampler, "GlobalLinearSampler");
         pb.BindSampler(EngineCommonDS, GlobalNearestSampler, "GlobalNearestSampler");
 
-        if (viewIndex == 0)
-            pb.BindConstants(EngineCommonDS, &SceneView->GetViewConstants(), sizeof(CViewConstants),
-                "GlobalConstants");
-        else if (viewIndex == 1)
-            pb.BindConstants(EngineCommonDS, &ShadowSceneView->GetViewConstants(),
-                sizeof(CViewConstants), "GlobalConstants");
-        else if (viewIndex == 2)
-            pb.BindConstants(EngineCommonDS, &VoxelizerSceneView->GetViewConstants(),
-                sizeof(CViewConstants), "GlobalConstants");
+        // All three views followed by the miscs, in one allocation so they share a buffer
+        auto alloc = FrameConstants.Allocate(3 * ViewConstantsStride + sizeof(EngineCommonMiscs));
+        auto* data = static_cast<uint8_t*>(alloc.Data);
+        const CSceneView* views[] = { SceneView.get(), ShadowSceneView.get(),
+                                      VoxelizerSceneView.get() };
+        for (size_t i = 0; i < 3; i++)
+            memcpy(data + i * ViewConstantsStride, &views[i]->GetViewConstants(),
+                sizeof(CViewConstants));
 
-        EngineCommonMiscs miscs;
+        EngineCommonMiscs miscs {};
         miscs.frameCount = frameCount;
         miscs.resolution = tc::Vector2(width, height);
+        memcpy(data + 3 * ViewConstantsStride, &miscs, sizeof(EngineCommonMiscs));
+
+        pb.BindBuffer(EngineCommonDS, alloc.Buffer, 0, sizeof(CViewConstants),
+            GlobalConstantsBinding);
+        pb.BindBuffer(EngineCommonDS, alloc.Buffer, 0, sizeof(EngineCommonMiscs),
+            EngineCommonMiscsBinding);
+        pb.SetDynamicOffset(EngineCommonDS, alloc.Offset + 3 * ViewConstantsStride,
+            EngineCommonMiscsBinding);
+        EngineCommonOffset = alloc.Offset;
+    }
 
-        pb.BindConstants(EngineCommonDS, &miscs,
-            sizeof(EngineCommonMiscs), "EngineCommonMiscs");
+    void CMegaPipeline::UpdateEngineCommonForView(uint32_t viewIndex)
+    {
+        auto& pb = PipelangContext.GetLibrary("Internal").GetParameterBlock("EngineCommon");
+        pb.SetDynamicOffset(EngineCommonDS, EngineCommonOffset + viewIndex * ViewConstantsStride,
+            GlobalConstantsBinding);
+    }
 
+    void CMegaPipeline::BindEngineCommon(RHI::IRenderContext& context) const
+    {
         context.BindRenderDescriptorSet(0, *EngineCommonDS);
+    }
 
-        // TODO: careful! EngineCommonDS will still be in use after leaving this function, what if
-        // multiple thread calls this?
+    static void RenderStatsRow(const char* pass, const CRenderListStats& stats)
+    {
+        ImGui::Text("%-10s draws %5u  instances %5u  pipelines %4u  materials %4u  "
+                    "vertex buffers %4u",
+            pass, stats.DrawCount, stats.InstanceCount, stats.PipelineSwitches, stats.MaterialBinds,
+            stats.VertexBufferBinds);
+    }
+
+    void CMegaPipeline::ShowRenderStatsImGui() const
+    {
+        ImGui::Begin("Render Stats");
+        RenderStatsRow("GBuffer", GBufferRenderer.GetStats());
+        RenderStatsRow("Shadow", ZOnlyRenderer.GetStats());
+        RenderStatsRow("Voxelize", VoxelizeRenderer.GetStats());
+        ImGui::Text("Frame constants %.1f KiB", FrameConstants.GetFrameUsage() / 1024.0f);
+        ImGui::Text("Mesh pipelines %u", PipelineCache.GetPipelineCount());
+        Pl::CShaderDedupeStats shaders = PipelangContext.GetShaderDedupeStats();
+        ImGui::Text("Shader modules %u for %u requests, %u source and %u SPIR-V hits",
+            shaders.Modules, shaders.Requests, shaders.SourceHits, shaders.SPIRVHits);
+        Pl::CDescriptorSetStats sets = PipelangContext.GetDescriptorSetStats();
+        ImGui::Text("Descriptor sets %u in %u layouts, %u held, %u retiring, %u free",
+            sets.SetsCreated, sets.Layouts, sets.SetsHeld, sets.SetsRetiring, sets.SetsFree);
+        uint32_t screenWrites = 0;
+        for (CMaterial* material : GetScreenMaterials())
+            screenWrites += material->getDescriptorWrites();
+        ImGui::Text("Screen pass descriptor writes %u", screenWrites);
+        ImGui::Text("Screen pass shader modules %zu", CShaderModuleCache::Get().GetModuleCount());
+        ImGui::End();
     }
 
     void CMegaPipeline::CreateRenderPasses()
@@ -587,6 +856,8 @@ namespace Foreground
 
         indirect_blurY->renderTargets = { { indirectImageFinal, EFormat::R16G16B16A16_SFLOAT } };
         indirect_blurY->createPipeline(width, height);
+
+        ResolveScreenSlots();
     }
 
 } /* namespace Foreground */
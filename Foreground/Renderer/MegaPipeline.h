@@ -1,12 +1,20 @@
 #pragma once
 #include "ForegroundCommon.h"
+#include "FrameConstantRing.h"
 #include "GBufferRenderer.h"
+#include "PipelineCache.h"
 #include "SceneGraph/SceneView.h"
 #include "VoxelizeRenderer.h"
+#include "WorkerPool.h"
 #include "ZOnlyRenderer.h"
+#include <FileWatcher.h>
 #include <Pipeline.h>
 #include <Resources.h>
 #include <Sampler.h>
+#include <ShaderDependencies.h>
+#include <chrono>
+#include <unordered_map>
+#include <vector>
 
 #include <Components/Material.h>
 
@@ -23,6 +31,7 @@ class CMegaPipeline
 {
 public:
     explicit CMegaPipeline(RHI::CSwapChain::Ref swapChain);
+    ~CMegaPipeline();
 
     void SetSceneView(std::unique_ptr<CSceneView> sceneView,
                       std::unique_ptr<CSceneView> shadowView,
@@ -33,7 +42,14 @@ public:
 
     RHI::CImageView::Ref getVoxelsImageView() const { return VoxelBuffer; };
 
-    void BindEngineCommonForView(RHI::IRenderContext& context, uint32_t viewIndex);
+    // Points the shared EngineCommon set at the constants of a view. Has to happen on the
+    // render thread before any context of the pass binds it, never while recording.
+    void UpdateEngineCommonForView(uint32_t viewIndex);
+    // Safe to call from any recording thread
+    void BindEngineCommon(RHI::IRenderContext& context) const;
+
+    CFrameConstantRing& GetFrameConstants() { return FrameConstants; }
+    CPipelineCache& GetPipelineCache() { return PipelineCache; }
 
 protected:
     void CreateRenderPasses();
@@ -42,6 +58,46 @@ protected:
     void CreateScreenPass();
     void CreateVoxelizePass();
 
+    // Writes every view's constants for this frame into the constant ring
+    void UploadEngineCommon();
+    void ShowRenderStatsImGui() const;
+    // FOREGROUND_NO_PIPELINE_CACHE turns off both loading and saving the pipeline manifest
+    static bool IsPipelineCacheEnabled();
+    // Maps a renderer id of a pipeline cache key back to the renderer
+    bool ResolveRenderer(uint32_t rendererId, CPipelineCache::FCreatePipeline& create,
+                         const RHI::CRenderPass*& renderPass);
+
+    // FOREGROUND_HOT_RELOAD watches the Pipelang scripts and the shaders of the screen passes.
+    // Edits recompile in the background and are swapped in at the start of a frame.
+    static bool IsHotReloadEnabled();
+    void StartHotReload();
+    void PollHotReload();
+    std::vector<CMaterial*> GetScreenMaterials() const;
+    // Looks the parameters of the screen passes up once, after the materials were created or
+    // their shaders reloaded, so that Render never goes by name
+    void ResolveScreenSlots();
+
+    // Prepares the list of a mesh pass, then records its chunks on one render context each,
+    // spread over the recording workers
+    template <typename TPassContext, typename TRenderer>
+    void RecordPassParallel(TPassContext& passCtx, TRenderer& renderer, const CSceneView& view)
+    {
+        renderer.PrepareList(view, RecordingWorkers.GetThreadCount() + 1);
+
+        // Contexts are handed out in submission order, so create them before going wide
+        uint32_t chunkCount = renderer.GetChunkCount();
+        std::vector<decltype(passCtx.CreateRenderContext(0))> contexts;
+        contexts.reserve(chunkCount);
+        for (uint32_t i = 0; i < chunkCount; i++)
+            contexts.push_back(passCtx.CreateRenderContext(i));
+
+        RecordingWorkers.ParallelFor(chunkCount, [&](uint32_t i) {
+            renderer.RecordChunk(*contexts[i], i);
+            contexts[i]->FinishRecording();
+        });
+        renderer.FinishList();
+    }
+
 private:
     RHI::CSwapChain::Ref SwapChain;
     std::unique_ptr<CSceneView> SceneView;
@@ -51,6 +107,7 @@ private:
     PreviousProjections prevProj;
 
     uint32_t frameCount = 0;
+    std::chrono::steady_clock::time_point StartTime = std::chrono::steady_clock::now();
 
     uint32_t width;
     uint32_t height;
@@ -82,6 +139,10 @@ private:
     RHI::CSampler::Ref GlobalNearestSampler;
     RHI::CPipeline::Ref BlitPipeline;
 
+    // Shared by the mesh renderers, declared first so it outlives them
+    static constexpr const char* PipelineCacheFile = "ForegroundPipelines.cache";
+    CPipelineCache PipelineCache;
+    bool bPipelineCacheWarm = false;
     CGBufferRenderer GBufferRenderer;
     CZOnlyRenderer ZOnlyRenderer;
     CVoxelizeRenderer VoxelizeRenderer;
@@ -96,7 +157,49 @@ private:
     std::shared_ptr<CMaterial> indirect_blurX;
     std::shared_ptr<CMaterial> indirect_blurY;
 
+    // Every parameter the screen passes set, as slots of one material. Parameters the pass does
+    // not have stay invalid and are skipped.
+    struct CScreenPassSlots
+    {
+        CMaterialSlot Sampler;
+        CMaterialSlot Albedo, Normals, Material, Depth, Shadow, AO, Lighting, Indirect;
+        CMaterialSlot Voxels, Temporal, TAABuffer;
+        CMaterialSlot GlobalConstants, ExtendedMatrices, PrevProj, Sun, Miscs;
+        CMaterialSlot PointLights, DirectionalLights;
+
+        void Resolve(const CMaterial& material);
+    };
+    CScreenPassSlots gtao_visibility_slots;
+    CScreenPassSlots gtao_blur_slots;
+    CScreenPassSlots gtao_color_slots;
+    CScreenPassSlots lighting_deferred_slots;
+    CScreenPassSlots lighting_indirect_slots;
+    CScreenPassSlots indirect_blurX_slots;
+    CScreenPassSlots indirect_blurY_slots;
+
     RHI::CDescriptorSet::Ref EngineCommonDS;
+    size_t EngineCommonOffset = 0;
+    Pl::CBindingHandle GlobalConstantsBinding;
+    Pl::CBindingHandle EngineCommonMiscsBinding;
+    CFrameConstantRing FrameConstants;
+
+    CWorkerPool RecordingWorkers;
+
+    // A screen pass shader being recompiled
+    struct CShaderReload
+    {
+        std::string SourcePath;
+        // As the materials name it
+        std::string SPIRVName;
+        bool bVertex = false;
+        std::shared_future<RHI::CShaderModule::Ref> Module;
+    };
+    std::unique_ptr<Pl::CFileWatcher> ShaderWatcher;
+    std::unique_ptr<Pl::CShaderDependencyGraph> ShaderDependencies;
+    std::vector<std::string> ShaderIncludeDirs;
+    // Source path of each screen pass shader to its SPIR-V name
+    std::unordered_map<std::string, std::string> ScreenShaders;
+    std::vector<CShaderReload> ShaderReloads;
 };
 
 } /* namespace Foreground */
@@ -0,0 +1,290 @@
+#include "PipelineCache.h"
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+
+namespace Foreground
+{
+
+// Bump whenever the manifest layout or the meaning of a key changes
+static const char ManifestMagic[4] = { 'F', 'G', 'P', 'C' };
+static const uint32_t ManifestVersion = 1;
+
+static void HashCombine(size_t& hash, size_t value)
+{
+    hash ^= value + 0x9e3779b97f4a7c15ull + (hash << 6) + (hash >> 2);
+}
+
+void ApplyVertexInputSignature(RHI::CPipelineDesc& desc, const std::vector<uint32_t>& signature)
+{
+    // Attributes are (location, format, offset, binding), bindings are (index | high bit, stride)
+    size_t i = 0;
+    while (i < signature.size())
+    {
+        if (signature[i] & 0x80000000u)
+        {
+            desc.VertexBinding(signature[i] & 0x7FFFFFFFu, signature[i + 1]);
+            i += 2;
+        }
+        else
+        {
+            desc.VertexAttribFormat(signature[i], static_cast<RHI::EFormat>(signature[i + 1]),
+                                    signature[i + 2], signature[i + 3]);
+            i += 4;
+        }
+    }
+}
+
+bool IsVertexInputSignatureValid(const std::vector<uint32_t>& signature)
+{
+    size_t i = 0;
+    while (i < signature.size())
+        i += signature[i] & 0x80000000u ? 2 : 4;
+    return i == signature.size();
+}
+
+size_t CPipelineCache::CKeyHasher::operator()(const CMeshPipelineKey& key) const
+{
+    size_t hash = key.RendererId;
+    HashCombine(hash, std::hash<Pl::CHashId>()(key.StagesId));
+    for (uint32_t v : key.VertexInput)
+        HashCombine(hash, v);
+    HashCombine(hash, static_cast<size_t>(key.Topology));
+    HashCombine(hash, std::hash<const void*>()(key.RenderPass));
+    HashCombine(hash, key.Subpass);
+    return hash;
+}
+
+CPipelineCache::~CPipelineCache() { WaitForPrewarm(); }
+
+uint32_t CPipelineCache::FindOrCreate(const CMeshPipelineKey& key, const FCreatePipeline& create)
+{
+    auto iter = Handles.find(key);
+    if (iter != Handles.end())
+        return iter->second;
+
+    RHI::CPipeline::Ref pipeline;
+    {
+        std::lock_guard<std::mutex> lk(CreateMutex);
+        auto prewarmed = Prewarmed.find(key);
+        if (prewarmed != Prewarmed.end())
+        {
+            pipeline = std::move(prewarmed->second);
+            Prewarmed.erase(prewarmed);
+        }
+        else
+        {
+            Claimed.insert(key);
+            pipeline = create(key);
+        }
+    }
+
+    uint32_t handle = static_cast<uint32_t>(Pipelines.size());
+    Pipelines.push_back(std::move(pipeline));
+    Keys.push_back(key);
+    Handles.emplace(key, handle);
+    return handle;
+}
+
+void CPipelineCache::Clear()
+{
+    Handles.clear();
+    Pipelines.clear();
+    Keys.clear();
+
+    std::lock_guard<std::mutex> lk(CreateMutex);
+    Prewarmed.clear();
+    Claimed.clear();
+}
+
+template <typename T> static void WriteValue(std::ofstream& ofs, const T& value)
+{
+    ofs.write(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+template <typename T> static bool ReadValue(std::ifstream& ifs, T& value)
+{
+    return static_cast<bool>(ifs.read(reinterpret_cast<char*>(&value), sizeof(T)));
+}
+
+// Reads the count of an array of elementSize byte elements and checks the file still has room
+// for them, so a damaged count cannot ask for gigabytes
+static bool ReadCount(std::ifstream& ifs, uint64_t fileSize, size_t elementSize, uint32_t& count)
+{
+    if (!ReadValue(ifs, count))
+        return false;
+    std::streamoff pos = ifs.tellg();
+    return pos >= 0 && static_cast<uint64_t>(count) * elementSize <= fileSize - pos;
+}
+
+uint32_t CPipelineCache::Rebuild(const std::vector<Pl::CHashId>& stagesIds,
+                                 const FResolveRenderer& resolveRenderer)
+{
+    // Prewarmed pipelines were built from the old shaders, they are created again on demand
+    WaitForPrewarm();
+    std::unordered_set<Pl::CHashId> stale(stagesIds.begin(), stagesIds.end());
+    {
+        std::lock_guard<std::mutex> lk(CreateMutex);
+        for (auto iter = Prewarmed.begin(); iter != Prewarmed.end();)
+        {
+            if (stale.count(iter->first.StagesId))
+            {
+                Claimed.erase(iter->first);
+                iter = Prewarmed.erase(iter);
+            }
+            else
+                ++iter;
+        }
+    }
+
+    uint32_t rebuilt = 0;
+    for (uint32_t handle = 0; handle < Keys.size(); handle++)
+    {
+        const CMeshPipelineKey& key = Keys[handle];
+        FCreatePipeline create;
+        const RHI::CRenderPass* renderPass = nullptr;
+        if (!stale.count(key.StagesId) || !resolveRenderer(key.RendererId, create, renderPass))
+            continue;
+        if (RHI::CPipeline::Ref pipeline = create(key))
+        {
+            Pipelines[handle] = std::move(pipeline);
+            rebuilt++;
+        }
+    }
+    return rebuilt;
+}
+
+// Reads one key as SaveManifest writes it, every count is checked against the file size
+static bool ReadKey(std::ifstream& ifs, uint64_t fileSize, CMeshPipelineKey& key)
+{
+    uint32_t topology, stageCount, inputCount;
+    // Every stage takes at least its length
+    if (!ReadValue(ifs, key.RendererId) || !ReadValue(ifs, key.Subpass)
+        || !ReadValue(ifs, topology) || !ReadCount(ifs, fileSize, sizeof(uint32_t), stageCount))
+        return false;
+    key.Topology = static_cast<RHI::EPrimitiveTopology>(topology);
+    key.Stages.resize(stageCount);
+    for (std::string& stage : key.Stages)
+    {
+        uint32_t length = 0;
+        if (!ReadCount(ifs, fileSize, 1, length))
+            return false;
+        stage.resize(length);
+        if (length && !ifs.read(&stage[0], length))
+            return false;
+    }
+    key.StagesId = Pl::CHashId(key.Stages);
+
+    if (!ReadCount(ifs, fileSize, sizeof(uint32_t), inputCount))
+        return false;
+    key.VertexInput.resize(inputCount);
+    char* input = reinterpret_cast<char*>(key.VertexInput.data());
+    if (inputCount && !ifs.read(input, inputCount * sizeof(uint32_t)))
+        return false;
+    // The renderers apply it without checks
+    return IsVertexInputSignatureValid(key.VertexInput);
+}
+
+bool CPipelineCache::StartPrewarm(const std::string& path, FResolveRenderer resolveRenderer)
+{
+    std::ifstream ifs(path, std::ios::binary | std::ios::ate);
+    if (!ifs)
+        return false;
+    uint64_t fileSize = static_cast<uint64_t>(ifs.tellg());
+    ifs.seekg(0, std::ios::beg);
+
+    char magic[4];
+    uint32_t version = 0;
+    if (!ifs.read(magic, 4) || memcmp(magic, ManifestMagic, 4) != 0 || !ReadValue(ifs, version)
+        || version != ManifestVersion)
+    {
+        fprintf(stderr, "Ignoring pipeline cache %s, it was written by another version\n",
+                path.c_str());
+        return false;
+    }
+
+    // A damaged entry ends the list, the entries before it are still good
+    uint32_t count = 0;
+    ReadValue(ifs, count);
+    std::vector<std::pair<CMeshPipelineKey, FCreatePipeline>> work;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        CMeshPipelineKey key;
+        if (!ReadKey(ifs, fileSize, key))
+        {
+            fprintf(stderr, "Pipeline cache %s is damaged after %u entries\n", path.c_str(), i);
+            break;
+        }
+
+        FCreatePipeline create;
+        if (resolveRenderer(key.RendererId, create, key.RenderPass))
+            work.emplace_back(std::move(key), std::move(create));
+    }
+
+    WaitForPrewarm();
+    PrewarmedCount = 0;
+    PrewarmThread = std::thread([this, work = std::move(work)]() {
+        for (const auto& item : work)
+        {
+            std::lock_guard<std::mutex> lk(CreateMutex);
+            // The render thread got there first
+            if (!Claimed.insert(item.first).second)
+                continue;
+            Prewarmed.emplace(item.first, item.second(item.first));
+            PrewarmedCount++;
+        }
+    });
+    return true;
+}
+
+void CPipelineCache::WaitForPrewarm()
+{
+    if (PrewarmThread.joinable())
+        PrewarmThread.join();
+}
+
+bool CPipelineCache::SaveManifest(const std::string& path) const
+{
+    // Keys differing only by render pass, e.g. after a resize, are the same entry on disk
+    std::unordered_set<CMeshPipelineKey, CKeyHasher> unique;
+    for (size_t i = 0; i < Keys.size(); i++)
+    {
+        if (!Pipelines[i])
+            continue;
+        CMeshPipelineKey key = Keys[i];
+        key.RenderPass = nullptr;
+        unique.insert(std::move(key));
+    }
+
+    // Write next to the target and rename, so a crash never leaves a torn manifest behind
+    std::string tempPath = path + ".tmp";
+    {
+        std::ofstream ofs(tempPath, std::ios::binary | std::ios::trunc);
+        if (!ofs)
+            return false;
+
+        ofs.write(ManifestMagic, 4);
+        WriteValue(ofs, ManifestVersion);
+        WriteValue(ofs, static_cast<uint32_t>(unique.size()));
+        for (const CMeshPipelineKey& key : unique)
+        {
+            WriteValue(ofs, key.RendererId);
+            WriteValue(ofs, key.Subpass);
+            WriteValue(ofs, static_cast<uint32_t>(key.Topology));
+            WriteValue(ofs, static_cast<uint32_t>(key.Stages.size()));
+            for (const std::string& stage : key.Stages)
+            {
+                WriteValue(ofs, static_cast<uint32_t>(stage.size()));
+                ofs.write(stage.data(), stage.size());
+            }
+            WriteValue(ofs, static_cast<uint32_t>(key.VertexInput.size()));
+            ofs.write(reinterpret_cast<const char*>(key.VertexInput.data()),
+                      key.VertexInput.size() * sizeof(uint32_t));
+        }
+        if (!ofs)
+            return false;
+    }
+    return std::rename(tempPath.c_str(), path.c_str()) == 0;
+}
+
+} /* namespace Foreground */
@@ -0,0 +1,110 @@
+#pragma once
+#include <HashId.h>
+#include <Pipeline.h>
+#include <RenderPass.h>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+namespace Foreground
+{
+
+// Everything that varies between the mesh pipelines of a renderer. The rest of the description
+// is fixed per renderer, and each renderer has its own render pass.
+struct CMeshPipelineKey
+{
+    // Which renderer builds the pipeline, so that a key read back from disk can find it again
+    uint32_t RendererId = 0;
+    std::vector<std::string> Stages;
+    // Id of Stages, keys compare and hash by it instead of the strings
+    Pl::CHashId StagesId;
+    std::vector<uint32_t> VertexInput;
+    RHI::EPrimitiveTopology Topology;
+    const RHI::CRenderPass* RenderPass = nullptr;
+    uint32_t Subpass = 0;
+
+    bool operator==(const CMeshPipelineKey& rhs) const
+    {
+        return RendererId == rhs.RendererId && Topology == rhs.Topology
+            && RenderPass == rhs.RenderPass && Subpass == rhs.Subpass
+            && StagesId == rhs.StagesId && VertexInput == rhs.VertexInput;
+    }
+};
+
+// Fills in the vertex input state described by CTriangleMesh::AppendVertexInputSignature
+void ApplyVertexInputSignature(RHI::CPipelineDesc& desc, const std::vector<uint32_t>& signature);
+// True if the signature is a whole number of attribute and binding records, as the ones
+// CTriangleMesh writes are. Signatures read back from disk are checked before they are applied.
+bool IsVertexInputSignatureValid(const std::vector<uint32_t>& signature);
+
+// Pipelines shared by every primitive that asks for the same key, addressed by small dense
+// handles so that draws never have to look anything up by primitive.
+//
+// The keys in use are written to a manifest on shutdown. On the next start they are rebuilt on a
+// background thread before the first frame asks for them.
+class CPipelineCache
+{
+public:
+    static const uint32_t InvalidHandle = UINT32_MAX;
+
+    // Builds the pipeline for a key, returns null on failure. May run on the prewarm thread.
+    using FCreatePipeline = std::function<RHI::CPipeline::Ref(const CMeshPipelineKey& key)>;
+    // Maps a renderer id to its create function and current render pass, returns false for ids
+    // it does not know
+    using FResolveRenderer = std::function<bool(uint32_t rendererId, FCreatePipeline& create,
+                                                const RHI::CRenderPass*& renderPass)>;
+
+    ~CPipelineCache();
+
+    // Returns the handle for key, calling create the first time the key is seen. A failed create
+    // is remembered too, its handle resolves to null. Render thread only.
+    uint32_t FindOrCreate(const CMeshPipelineKey& key, const FCreatePipeline& create);
+
+    // Handles stay valid until Clear, safe to call concurrently while nothing is being created
+    RHI::CPipeline* Get(uint32_t handle) const { return Pipelines[handle].get(); }
+    uint32_t GetPipelineCount() const { return static_cast<uint32_t>(Pipelines.size()); }
+
+    void Clear();
+
+    // Recreates in place the pipeline of every key built from one of stagesIds, e.g. after their
+    // shaders were reloaded. Handles stay the same, a failed create keeps the old pipeline.
+    // Render thread, between frames. Returns how many pipelines were replaced.
+    uint32_t Rebuild(const std::vector<Pl::CHashId>& stagesIds,
+                     const FResolveRenderer& resolveRenderer);
+
+    // Reads the manifest at path and starts rebuilding its pipelines in the background.
+    // Returns false if there is no usable manifest.
+    bool StartPrewarm(const std::string& path, FResolveRenderer resolveRenderer);
+    void WaitForPrewarm();
+    uint32_t GetPrewarmedCount() const { return PrewarmedCount; }
+
+    // Writes the keys of every pipeline created this run, render passes are not persisted
+    bool SaveManifest(const std::string& path) const;
+
+private:
+    struct CKeyHasher
+    {
+        size_t operator()(const CMeshPipelineKey& key) const;
+    };
+
+    std::unordered_map<CMeshPipelineKey, uint32_t, CKeyHasher> Handles;
+    std::vector<RHI::CPipeline::Ref> Pipelines;
+    std::vector<CMeshPipelineKey> Keys;
+
+    // Serializes pipeline creation between the render and the prewarm thread, and guards the two
+    // sets below. Pipelang code generation is not reentrant.
+    std::mutex CreateMutex;
+    std::unordered_map<CMeshPipelineKey, RHI::CPipeline::Ref, CKeyHasher> Prewarmed;
+    std::unordered_set<CMeshPipelineKey, CKeyHasher> Claimed;
+
+    std::thread PrewarmThread;
+    std::atomic<uint32_t> PrewarmedCount { 0 };
+};
+
+} /* namespace Foreground */
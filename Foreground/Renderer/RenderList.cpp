@@ -0,0 +1,193 @@
+#include "RenderList.h"
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstring>
+
+namespace Foreground
+{
+
+// Distances past this all land in the last depth bucket
+static const float MaxSortDepth = 512.0f;
+
+static uint64_t QuantizeDepth(float depth)
+{
+    float t = std::min(std::max(depth, 0.0f) / MaxSortDepth, 1.0f);
+    // sqrt spends more of the 16 bits close to the viewer, where ordering matters most
+    return static_cast<uint64_t>(std::sqrt(t) * 65535.0f);
+}
+
+bool CRenderStateTracker::SetPipeline(const RHI::CPipeline* pipeline)
+{
+    if (pipeline == BoundPipeline)
+        return false;
+    BoundPipeline = pipeline;
+    Stats.PipelineSwitches++;
+    return true;
+}
+
+bool CRenderStateTracker::SetMaterial(const CBasicMaterial* material)
+{
+    if (material == BoundMaterial)
+        return false;
+    BoundMaterial = material;
+    Stats.MaterialBinds++;
+    return true;
+}
+
+bool CRenderStateTracker::SetMesh(const CTriangleMesh* mesh)
+{
+    if (mesh == BoundMesh)
+        return false;
+    BoundMesh = mesh;
+    Stats.VertexBufferBinds++;
+    return true;
+}
+
+void CRenderList::Reset(uint32_t passIndex, ERenderListSortMode mode)
+{
+    PassIndex = passIndex;
+    SortMode = mode;
+    Items.clear();
+}
+
+void CRenderList::AddDraw(uint32_t index, uint32_t pipelineId, uint32_t materialId,
+                          uint32_t meshId, float depth)
+{
+    uint64_t pass = PassIndex & 0xF;
+    uint64_t pipeline = pipelineId & 0xFFF;
+    uint64_t material = materialId & 0xFFFF;
+    uint64_t mesh = meshId & 0xFFFF;
+    uint64_t z = QuantizeDepth(depth);
+
+    uint64_t key;
+    if (SortMode == ERenderListSortMode::FrontToBack)
+        key = pass << 60 | (z >> 10) << 54 | pipeline << 42 | material << 26 | mesh << 10
+            | (z & 0x3FF);
+    else
+        key = pass << 60 | pipeline << 48 | material << 32 | mesh << 16 | z;
+    Items.push_back({ key, index, pipelineId });
+}
+
+void CRenderList::Sort()
+{
+    // LSD radix sort, one byte per pass. The histograms for all 8 digits are gathered in a
+    // single sweep, and any digit that is identical across every key is skipped entirely.
+    const size_t count = Items.size();
+    if (count < 2)
+        return;
+
+    std::array<std::array<uint32_t, 256>, 8> histograms {};
+    for (const CDrawItem& item : Items)
+        for (uint32_t digit = 0; digit < 8; digit++)
+            histograms[digit][(item.SortKey >> (digit * 8)) & 0xFF]++;
+
+    SortScratch.resize(count);
+    CDrawItem* src = Items.data();
+    CDrawItem* dst = SortScratch.data();
+    for (uint32_t digit = 0; digit < 8; digit++)
+    {
+        auto& histogram = histograms[digit];
+        uint32_t firstByte = (src[0].SortKey >> (digit * 8)) & 0xFF;
+        if (histogram[firstByte] == count)
+            continue;
+
+        uint32_t offset = 0;
+        for (uint32_t& bucket : histogram)
+        {
+            uint32_t bucketCount = bucket;
+            bucket = offset;
+            offset += bucketCount;
+        }
+
+        for (size_t i = 0; i < count; i++)
+            dst[histogram[(src[i].SortKey >> (digit * 8)) & 0xFF]++] = src[i];
+        std::swap(src, dst);
+    }
+
+    if (src != Items.data())
+        Items.swap(SortScratch);
+}
+
+void CRenderList::BuildBatches(const CSceneView& view, CFrameConstantRing& constants)
+{
+    const auto& modelMats = view.GetVisiblePrimModelMatrix();
+    const auto& primitives = view.GetVisiblePrimitiveList();
+
+    // Every batch has to start at a constant buffer offset alignment boundary
+    const size_t instancesPerAlignment = 256 / sizeof(CInstanceConstants);
+
+    Batches.clear();
+    InstanceData.clear();
+    InstanceBuffer.reset();
+    for (const CDrawItem& item : Items)
+    {
+        CPrimitive* primitive = primitives[item.Index];
+
+        bool extend = false;
+        if (!Batches.empty())
+        {
+            const CInstanceBatch& batch = Batches.back();
+            const CPrimitive* head = primitives[batch.Index];
+            extend = batch.InstanceCount < MaxInstancesPerBatch
+                && batch.PipelineId == item.PipelineId
+                && head->GetMaterial() == primitive->GetMaterial()
+                && head->GetShape() == primitive->GetShape();
+        }
+        if (!extend)
+        {
+            size_t first = (InstanceData.size() + instancesPerAlignment - 1)
+                / instancesPerAlignment * instancesPerAlignment;
+            InstanceData.resize(first);
+            Batches.push_back({ item.Index, item.PipelineId, 0,
+                                first * sizeof(CInstanceConstants) });
+        }
+
+        const tc::Matrix3x4& modelMat = modelMats[item.Index];
+        CInstanceConstants instance;
+        instance.ModelMat = modelMat.ToMatrix4().Transpose();
+        instance.NormalMat = modelMat.ToMatrix3().Inverse();
+        InstanceData.push_back(instance);
+        Batches.back().InstanceCount++;
+    }
+
+    if (Batches.empty())
+        return;
+
+    // Pad the tail so that binding a full block at the last batch stays inside the allocation
+    size_t size = InstanceData.size() * sizeof(CInstanceConstants);
+    auto alloc = constants.Allocate(size + InstanceBlockSize);
+    memcpy(alloc.Data, InstanceData.data(), size);
+    InstanceBuffer = alloc.Buffer;
+    for (CInstanceBatch& batch : Batches)
+        batch.InstanceOffset += alloc.Offset;
+}
+
+void CRenderList::SplitIntoChunks(std::vector<CRenderListChunk>& chunks, uint32_t maxChunks,
+                                  uint32_t minBatches) const
+{
+    uint32_t batchCount = static_cast<uint32_t>(Batches.size());
+    minBatches = std::max(minBatches, 1u);
+    uint32_t chunkCount = (batchCount + minBatches - 1) / minBatches;
+    chunkCount = std::min(std::max(chunkCount, 1u), std::max(maxChunks, 1u));
+
+    chunks.resize(chunkCount);
+    for (uint32_t i = 0; i < chunkCount; i++)
+    {
+        CRenderListChunk& chunk = chunks[i];
+        chunk.FirstBatch = static_cast<uint32_t>(uint64_t(batchCount) * i / chunkCount);
+        chunk.EndBatch = static_cast<uint32_t>(uint64_t(batchCount) * (i + 1) / chunkCount);
+        chunk.Stats = {};
+        chunk.bViewBound = false;
+    }
+}
+
+float CRenderList::ComputeViewDepth(const CViewConstants& view, const tc::Matrix3x4& modelMat,
+                                    const CPrimitive& primitive)
+{
+    tc::Vector3 center = modelMat * primitive.GetBoundingBox().Center();
+    tc::Vector3 eye(view.CameraPos.x, view.CameraPos.y, view.CameraPos.z);
+    return (center - eye).Length();
+}
+
+} /* namespace Foreground */
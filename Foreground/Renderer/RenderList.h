@@ -0,0 +1,158 @@
+#pragma once
+#include "FrameConstantRing.h"
+#include "SceneGraph/Primitive.h"
+#include "SceneGraph/SceneView.h"
+#include <Matrix3x4.h>
+#include <Pipeline.h>
+#include <Resources.h>
+#include <cstdint>
+#include <vector>
+
+namespace Foreground
+{
+
+enum class ERenderListSortMode
+{
+    // Nearest draws first so that early depth testing rejects as much as possible
+    FrontToBack,
+    // Grouped by pipeline, then material, then mesh, to minimize state changes
+    StateSorted
+};
+
+// Per pass counters, reset every frame by the renderer that owns them
+struct CRenderListStats
+{
+    uint32_t DrawCount = 0;
+    uint32_t InstanceCount = 0;
+    uint32_t PipelineSwitches = 0;
+    uint32_t MaterialBinds = 0;
+    uint32_t VertexBufferBinds = 0;
+
+    CRenderListStats& operator+=(const CRenderListStats& rhs)
+    {
+        DrawCount += rhs.DrawCount;
+        InstanceCount += rhs.InstanceCount;
+        PipelineSwitches += rhs.PipelineSwitches;
+        MaterialBinds += rhs.MaterialBinds;
+        VertexBufferBinds += rhs.VertexBufferBinds;
+        return *this;
+    }
+};
+
+// Remembers what is currently bound on a render context so redundant binds can be skipped
+class CRenderStateTracker
+{
+public:
+    explicit CRenderStateTracker(CRenderListStats& stats)
+        : Stats(stats)
+    {
+    }
+
+    // Each of these returns true if the caller has to issue the bind
+    bool SetPipeline(const RHI::CPipeline* pipeline);
+    bool SetMaterial(const CBasicMaterial* material);
+    bool SetMesh(const CTriangleMesh* mesh);
+    void CountDraw(uint32_t instanceCount = 1)
+    {
+        Stats.DrawCount++;
+        Stats.InstanceCount += instanceCount;
+    }
+
+private:
+    CRenderListStats& Stats;
+    const RHI::CPipeline* BoundPipeline = nullptr;
+    const CBasicMaterial* BoundMaterial = nullptr;
+    const CTriangleMesh* BoundMesh = nullptr;
+};
+
+// Per instance data read by the vertex stages, matches PerInstanceConstants in main.lua
+struct CInstanceConstants
+{
+    tc::Matrix4 ModelMat;
+    tc::Matrix4 NormalMat;
+};
+
+// Largest batch a single PerInstanceConstants block can describe
+static const uint32_t MaxInstancesPerBatch = 128;
+static const size_t InstanceBlockSize = MaxInstancesPerBatch * sizeof(CInstanceConstants);
+
+// Consecutive draws sharing pipeline, material and mesh, issued as one instanced draw
+struct CInstanceBatch
+{
+    // Index into the visible primitive list of the first instance
+    uint32_t Index;
+    uint32_t PipelineId;
+    uint32_t InstanceCount;
+    // Byte offset of the first instance in the instance buffer
+    size_t InstanceOffset;
+};
+
+// Below this many batches a chunk costs more in context setup than it saves in recording
+static const uint32_t MinBatchesPerChunk = 64;
+
+// A contiguous run of batches recorded on its own render context, possibly on a worker thread.
+// Everything a worker mutates while recording lives here, so chunks never share state.
+struct CRenderListChunk
+{
+    uint32_t FirstBatch = 0;
+    uint32_t EndBatch = 0;
+    // Each chunk moves the dynamic offset of its own instance descriptor set
+    RHI::CDescriptorSet::Ref InstanceDS;
+    CRenderListStats Stats;
+    bool bViewBound = false;
+};
+
+// A list of draws for a single pass, ordered by a 64 bit key
+//
+// Key layout, from the most significant bit:
+//   FrontToBack: pass(4) coarse depth(6) pipeline(12) material(16) mesh(16) fine depth(10)
+//   StateSorted: pass(4) pipeline(12) material(16) mesh(16) depth(16)
+// Front to back sorting only orders coarse depth slices, so that instancing still finds repeated
+// meshes within a slice. IDs wider than their field wrap around, which only costs some batching,
+// never correctness.
+class CRenderList
+{
+public:
+    struct CDrawItem
+    {
+        uint64_t SortKey;
+        // Index into the visible primitive list of the scene view
+        uint32_t Index;
+        uint32_t PipelineId;
+    };
+
+    void Reset(uint32_t passIndex, ERenderListSortMode mode);
+    void AddDraw(uint32_t index, uint32_t pipelineId, uint32_t materialId, uint32_t meshId,
+                 float depth);
+    void Sort();
+
+    // Collapses the sorted draws into instanced batches and streams their matrices into this
+    // frame's constant ring. Batch offsets are then relative to the start of the ring page.
+    void BuildBatches(const CSceneView& view, CFrameConstantRing& constants);
+
+    // Splits the batches into at most maxChunks even ranges, none smaller than minBatches unless
+    // there is only one. Always yields at least one chunk, possibly empty. Existing entries of
+    // chunks are reused so that their descriptor sets survive across frames.
+    void SplitIntoChunks(std::vector<CRenderListChunk>& chunks, uint32_t maxChunks,
+                         uint32_t minBatches) const;
+
+    const std::vector<CDrawItem>& GetItems() const { return Items; }
+    const std::vector<CInstanceBatch>& GetBatches() const { return Batches; }
+    const RHI::CBuffer::Ref& GetInstanceBuffer() const { return InstanceBuffer; }
+
+    // Distance from the view origin to the center of the primitive's bounds
+    static float ComputeViewDepth(const CViewConstants& view, const tc::Matrix3x4& modelMat,
+                                  const CPrimitive& primitive);
+
+private:
+    uint32_t PassIndex = 0;
+    ERenderListSortMode SortMode = ERenderListSortMode::StateSorted;
+    std::vector<CDrawItem> Items;
+    std::vector<CDrawItem> SortScratch;
+
+    std::vector<CInstanceBatch> Batches;
+    std::vector<CInstanceConstants> InstanceData;
+    RHI::CBuffer::Ref InstanceBuffer;
+};
+
+} /* namespace Foreground */
@@ -1,10 +1,13 @@
 #pragma once
+#include "PipelineCache.h"
+#include "RenderList.h"
 #include "SceneGraph/Primitive.h"
+#include "SceneGraph/SceneView.h"
 #include <Matrix3x4.h>
 #include <Pipeline.h>
-#include <map>
 #include <memory>
-#include <unordered_map>
+#include <mutex>
+#include <vector>
 
 namespace Foreground
 {
@@ -14,44 +17,60 @@ class CMegaPipeline;
 class CVoxelizeRenderer
 {
 public:
+    // Tags this renderer's keys in the pipeline cache
+    static const uint32_t RendererId = 2;
+
     explicit CVoxelizeRenderer(CMegaPipeline* p);
+    ~CVoxelizeRenderer();
 
     void SetRenderPass(RHI::CRenderPass::Ref renderPass, uint32_t subpass = 0);
-	
-    void RenderList(RHI::IRenderContext& context, const std::vector<tc::Matrix3x4>& modelMats,
-                    const std::vector<CPrimitive*>& primitives);
 
-    void PreparePrimitiveResources(std::shared_ptr<CPrimitive> primitive);
+    // Builds, sorts and batches the visible list of view, then splits it into at most maxChunks
+    // chunks. Runs on the thread owning the renderer, all cache and descriptor updates happen here.
+    void PrepareList(const CSceneView& view, uint32_t maxChunks);
+    uint32_t GetChunkCount() const { return static_cast<uint32_t>(Chunks.size()); }
+    // Records one chunk of the prepared list. Distinct chunks may be recorded concurrently.
+    void RecordChunk(RHI::IRenderContext& context, uint32_t chunkIndex);
+    // Gathers the stats of all chunks once recording is done
+    void FinishList();
+
+    void PreparePrimitiveResources(const CPrimitive& primitive);
+    // Builds the mesh pipeline for one of this renderer's keys. Only reads the key and the render
+    // pass, so the pipeline cache may call it from its prewarm thread.
+    RHI::CPipeline::Ref CreateMeshPipeline(const CMeshPipelineKey& key);
+    const RHI::CRenderPass* GetRenderPass() const { return RenderPass.get(); }
     void ClearResourceCache();
-    void GarbageCollectResourceCache();
+
+    const CRenderListStats& GetStats() const { return Stats; }
 
 protected:
-    void Render(RHI::IRenderContext& context, const tc::Matrix3x4& modelMat, CPrimitive* primitive);
+    void OnPrimitiveDestroyed(uint32_t primitiveId);
+    void Render(RHI::IRenderContext& context, CRenderStateTracker& tracker,
+                CRenderListChunk& chunk, const CInstanceBatch& batch, CPrimitive* primitive);
 
 private:
     CMegaPipeline* Parent;
 
-    struct PerPrimitiveConstants
-    {
-        tc::Matrix4 ModelMat;
-        tc::Matrix4 NormalMat;
-    };
-
     struct CPrimitiveResources
     {
-        RHI::CPipeline::Ref Pipeline;
-        RHI::CDescriptorSet::Ref NodeDS;
+        uint32_t Pipeline = CPipelineCache::InvalidHandle;
     };
 
     RHI::CRenderPass::Ref RenderPass;
-    std::map<std::weak_ptr<CPrimitive>, CPrimitiveResources,
-             std::owner_less<std::weak_ptr<CPrimitive>>>
-        CachedPrimitiveResources;
+    // Indexed by primitive id, entries are reset when their primitive is destroyed
+    std::vector<CPrimitiveResources> PrimitiveResources;
+    std::mutex ResourcesMutex;
+    uint32_t DestructionListener;
 
-    RHI::CDescriptorSet::Ref VoxelDS;
+    CRenderList DrawList;
+    CRenderListStats Stats;
+    std::vector<CRenderListChunk> Chunks;
+    // Only valid between PrepareList and FinishList
+    const std::vector<CPrimitive*>* VisiblePrimitives = nullptr;
+    Pl::CParameterBlock* InstanceBlock = nullptr;
+    Pl::CBindingHandle InstanceConstants;
 
-    // Temporary render flags
-    bool BoundSet0 = false;
+    RHI::CDescriptorSet::Ref VoxelDS;
 };
 
 }
@@ -1,6 +1,7 @@
 #include "ZOnlyRenderer.h"
 #include "ForegroundCommon.h"
 #include "MegaPipeline.h"
+#include <iterator>
 
 namespace Foreground
 {
@@ -8,109 +9,174 @@ namespace Foreground
 CZOnlyRenderer::CZOnlyRenderer(CMegaPipeline* p)
     : Parent(p)
 {
+    DestructionListener = CPrimitive::AddDestructionListener(
+        [this](uint32_t primitiveId) { OnPrimitiveDestroyed(primitiveId); });
+}
+
+CZOnlyRenderer::~CZOnlyRenderer()
+{
+    CPrimitive::RemoveDestructionListener(DestructionListener);
 }
 
 void CZOnlyRenderer::SetRenderPass(RHI::CRenderPass::Ref renderPass, uint32_t subpass)
 {
     RenderPass = std::move(renderPass);
-    // Optionally rebuild all pipelines
+    // Pipelines are keyed by render pass, so primitives pick up new ones on their next draw
+    ClearResourceCache();
 }
 
-void CZOnlyRenderer::RenderList(RHI::IRenderContext& context,
-                                const std::vector<tc::Matrix3x4>& modelMats,
-                                const std::vector<CPrimitive*>& primitives)
+void CZOnlyRenderer::PrepareList(const CSceneView& view, uint32_t maxChunks)
 {
-    GarbageCollectResourceCache();
-    if (modelMats.empty())
-        return;
+    std::lock_guard<std::mutex> lk(ResourcesMutex);
+    Stats = {};
 
-    bSet0AlreadyBound = false;
-    for (size_t i = 0; i < modelMats.size(); i++)
-        Render(context, modelMats[i], primitives[i]);
+    const auto& modelMats = view.GetVisiblePrimModelMatrix();
+    const auto& primitives = view.GetVisiblePrimitiveList();
+    VisiblePrimitives = &primitives;
+
+    DrawList.Reset(1, ERenderListSortMode::FrontToBack);
+    for (uint32_t i = 0; i < static_cast<uint32_t>(primitives.size()); i++)
+    {
+        CPrimitive* primitive = primitives[i];
+        uint32_t primitiveId = primitive->GetPrimitiveId();
+        if (primitiveId >= PrimitiveResources.size())
+            PrimitiveResources.resize(primitiveId + 1);
+        if (PrimitiveResources[primitiveId].Pipeline == CPipelineCache::InvalidHandle)
+            PreparePrimitiveResources(*primitive);
+        uint32_t pipeline = PrimitiveResources[primitiveId].Pipeline;
+        if (!Parent->GetPipelineCache().Get(pipeline))
+            continue;
+
+        // Material edits are flushed here so that recording threads only ever bind
+        primitive->GetMaterial()->UpdateDescriptorSet();
+
+        float depth = CRenderList::ComputeViewDepth(view.GetViewConstants(), modelMats[i],
+                                                    *primitive);
+        DrawList.AddDraw(i, pipeline, primitive->GetMaterial()->GetSortId(),
+                         primitive->GetShape()->GetSortId(), depth);
+    }
+    DrawList.Sort();
+    DrawList.BuildBatches(view, Parent->GetFrameConstants());
+    DrawList.SplitIntoChunks(Chunks, maxChunks, MinBatchesPerChunk);
+
+    Parent->UpdateEngineCommonForView(1);
+
+    InstanceBlock = &PipelangContext.GetLibrary("Internal").GetParameterBlock("PerInstance");
+    InstanceConstants = InstanceBlock->GetBindingHandle("PerInstanceConstants");
+    for (auto& chunk : Chunks)
+    {
+        // The ring page can change from frame to frame, so each frame binds it on a set of its
+        // own while older frames may still be in flight. Batches then only move the offset.
+        chunk.InstanceDS = InstanceBlock->AllocateTransientDescriptorSet();
+        if (DrawList.GetInstanceBuffer())
+            InstanceBlock->BindBuffer(chunk.InstanceDS, DrawList.GetInstanceBuffer(), 0,
+                                      InstanceBlockSize, InstanceConstants);
+    }
+}
+
+void CZOnlyRenderer::RecordChunk(RHI::IRenderContext& context, uint32_t chunkIndex)
+{
+    CRenderListChunk& chunk = Chunks[chunkIndex];
+    CRenderStateTracker tracker(chunk.Stats);
+    const auto& batches = DrawList.GetBatches();
+    for (uint32_t i = chunk.FirstBatch; i < chunk.EndBatch; i++)
+        Render(context, tracker, chunk, batches[i], (*VisiblePrimitives)[batches[i].Index]);
 }
 
-void CZOnlyRenderer::PreparePrimitiveResources(std::shared_ptr<CPrimitive> primitive)
+void CZOnlyRenderer::FinishList()
+{
+    for (const auto& chunk : Chunks)
+        Stats += chunk.Stats;
+    VisiblePrimitives = nullptr;
+}
+
+// We have to do this since shader combination is statically done
+// Maybe a compile time table is a better solution
+static constexpr const char* MeshStages[] = {
+    "EngineCommon", "StandardTriMesh", "PerInstance", "StaticMeshZOnlyVS", "DefaultRasterizer",
+    "BasicMaterialParams", "BasicZOnlyMaterial"
+};
+static constexpr Pl::CHashId MeshStagesId = Pl::CHashId::FromStrings(MeshStages);
+
+void CZOnlyRenderer::PreparePrimitiveResources(const CPrimitive& primitive)
 {
     auto& lib = PipelangContext.GetLibrary("Internal");
+    const auto& triMesh = primitive.GetShape();
+    const auto& locations = lib.GetVertexAttribs("StandardTriMesh").GetAttributesByLocation();
+
+    CMeshPipelineKey key;
+    key.RendererId = RendererId;
+    key.Stages.assign(std::begin(MeshStages), std::end(MeshStages));
+    key.StagesId = MeshStagesId;
+    triMesh->AppendVertexInputSignature(key.VertexInput, locations);
+    key.Topology = triMesh->GetPrimitiveTopology();
+    key.RenderPass = RenderPass.get();
+    key.Subpass = 0;
+
+    // Primitives sharing layout and topology share the pipeline, only the first one builds it
+    PrimitiveResources[primitive.GetPrimitiveId()].Pipeline =
+        Parent->GetPipelineCache().FindOrCreate(
+            key, [this](const CMeshPipelineKey& k) { return CreateMeshPipeline(k); });
+}
 
-    // We have to do this since shader combination is statically done
-    // Maybe a compile time table is a better solution
-    if (auto triMesh = std::dynamic_pointer_cast<CTriangleMesh>(primitive->GetShape()))
-    {
-        if (auto basicMat = std::dynamic_pointer_cast<CBasicMaterial>(primitive->GetMaterial()))
-        {
-            RHI::CPipelineDesc desc;
-            bool ok = lib.GetPipeline(desc,
-                                      { "EngineCommon", "StandardTriMesh", "PerPrimitive",
-                                        "StaticMeshZOnlyVS", "DefaultRasterizer",
-                                        "BasicMaterialParams", "BasicZOnlyMaterial" });
-
-            if (!ok)
-                return;
-
-            desc.PrimitiveTopology = triMesh->GetPrimitiveTopology();
-            desc.RasterizerState.CullMode = RHI::ECullModeFlags::None;
-            desc.RenderPass = RenderPass;
-            desc.Subpass = 0;
-            triMesh->PipelineSetVertexInputDesc(
-                desc, lib.GetVertexAttribs("StandardTriMesh").GetAttributesByLocation());
-            auto pipeline = RenderDevice->CreatePipeline(desc);
-
-            CPrimitiveResources resources;
-            resources.Pipeline = std::move(pipeline);
-            resources.NodeDS = lib.GetParameterBlock("PerPrimitive").CreateDescriptorSet();
-            CachedPrimitiveResources[primitive] = std::move(resources);
-        }
-    }
+RHI::CPipeline::Ref CZOnlyRenderer::CreateMeshPipeline(const CMeshPipelineKey& key)
+{
+    // Keys from an older render pass are stale, there is nothing to build them against
+    if (key.RenderPass != RenderPass.get())
+        return nullptr;
+
+    RHI::CPipelineDesc desc;
+    if (!PipelangContext.GetLibrary("Internal").GetPipeline(desc, key.Stages, key.StagesId))
+        return nullptr;
+
+    desc.PrimitiveTopology = key.Topology;
+    desc.RasterizerState.CullMode = RHI::ECullModeFlags::None;
+    desc.RenderPass = RenderPass;
+    desc.Subpass = key.Subpass;
+    ApplyVertexInputSignature(desc, key.VertexInput);
+    return RenderDevice->CreatePipeline(desc);
 }
 
-void CZOnlyRenderer::ClearResourceCache() { CachedPrimitiveResources.clear(); }
+void CZOnlyRenderer::ClearResourceCache()
+{
+    std::lock_guard<std::mutex> lk(ResourcesMutex);
+    PrimitiveResources.clear();
+}
 
-void CZOnlyRenderer::GarbageCollectResourceCache()
+void CZOnlyRenderer::OnPrimitiveDestroyed(uint32_t primitiveId)
 {
-    for (auto iter = CachedPrimitiveResources.begin(); iter != CachedPrimitiveResources.end();
-         iter++)
-    {
-        if (iter->first.expired())
-            CachedPrimitiveResources.erase(iter);
-    }
+    // The id is about to be handed to a new primitive, which must not inherit these resources
+    std::lock_guard<std::mutex> lk(ResourcesMutex);
+    if (primitiveId < PrimitiveResources.size())
+        PrimitiveResources[primitiveId] = {};
 }
 
-void CZOnlyRenderer::Render(RHI::IRenderContext& context, const tc::Matrix3x4& modelMat,
+void CZOnlyRenderer::Render(RHI::IRenderContext& context, CRenderStateTracker& tracker,
+                            CRenderListChunk& chunk, const CInstanceBatch& batch,
                             CPrimitive* primitive)
 {
-    auto iter = CachedPrimitiveResources.find(primitive->weak_from_this());
-    if (iter == CachedPrimitiveResources.end())
-    {
-        PreparePrimitiveResources(primitive->shared_from_this());
-        iter = CachedPrimitiveResources.find(primitive->weak_from_this());
-        if (iter == CachedPrimitiveResources.end())
-            return;
-    }
+    // Batches only ever carry pipelines that were successfully created while preparing the list
+    RHI::CPipeline* pipeline = Parent->GetPipelineCache().Get(batch.PipelineId);
+    CTriangleMesh* triMesh = primitive->GetShape().get();
+    CBasicMaterial* basicMat = primitive->GetMaterial().get();
 
-    if (auto triMesh = std::dynamic_pointer_cast<CTriangleMesh>(primitive->GetShape()))
-    {
-        if (auto basicMat = std::dynamic_pointer_cast<CBasicMaterial>(primitive->GetMaterial()))
-        {
-            context.BindRenderPipeline(*iter->second.Pipeline);
-
-            if (!bSet0AlreadyBound)
-                Parent->BindEngineCommonForView(context, 1);
-            bSet0AlreadyBound = true;
-
-            basicMat->Bind(context);
-
-            PerPrimitiveConstants primitiveConstants;
-            primitiveConstants.ModelMat = modelMat.ToMatrix4().Transpose();
-            auto& lib = PipelangContext.GetLibrary("Internal");
-            auto& pb = lib.GetParameterBlock("PerPrimitive");
-            pb.BindConstants(iter->second.NodeDS, &primitiveConstants, sizeof(primitiveConstants),
-                             "PerPrimitiveConstants");
-            context.BindRenderDescriptorSet(2, *iter->second.NodeDS);
-
-            triMesh->Draw(context);
-        }
-    }
+    if (tracker.SetPipeline(pipeline))
+        context.BindRenderPipeline(*pipeline);
+
+    if (!chunk.bViewBound)
+        Parent->BindEngineCommon(context);
+    chunk.bViewBound = true;
+
+    if (tracker.SetMaterial(basicMat))
+        basicMat->Bind(context);
+
+    InstanceBlock->SetDynamicOffset(chunk.InstanceDS, batch.InstanceOffset, InstanceConstants);
+    context.BindRenderDescriptorSet(2, *chunk.InstanceDS);
+
+    if (tracker.SetMesh(triMesh))
+        triMesh->BindBuffers(context);
+    triMesh->DrawElements(context, batch.InstanceCount);
+    tracker.CountDraw(batch.InstanceCount);
 }
 
 }
@@ -11,6 +11,7 @@ public:
     void Init();
     void Shutdown();
     std::string FindShader(const std::string& name);
+    const std::set<std::string>& GetShaderPaths() const { return ShaderPath; }
     std::string FindFile(const std::string& name);
 
 private:
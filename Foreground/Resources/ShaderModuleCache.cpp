@@ -0,0 +1,96 @@
+#include "ShaderModuleCache.h"
+#include "ForegroundCommon.h"
+#include "ResourceManager.h"
+#include <HashId.h>
+#include <fcntl.h>
+#include <iostream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace Foreground
+{
+
+CShaderModuleCache& CShaderModuleCache::Get()
+{
+    static CShaderModuleCache singleton;
+    return singleton;
+}
+
+CShaderModuleCache::FShaderRef CShaderModuleCache::CreateShader(RHI::CShaderModule::Ref module)
+{
+    auto shader = std::make_shared<CShader>();
+    for (const RHI::CPipelineResource& res : module->GetShaderResources())
+        shader->Resources.push_back(res);
+    shader->Module = std::move(module);
+    return shader;
+}
+
+CShaderModuleCache::FShaderRef CShaderModuleCache::Load(const std::string& name)
+{
+    std::lock_guard<std::mutex> lk(Mutex);
+    auto iter = ShadersByName.find(name);
+    if (iter != ShadersByName.end())
+        return iter->second;
+
+    std::string path = CResourceManager::Get().FindShader(name);
+    int fd = path.empty() ? -1 : open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        std::cerr << "Shader " << name << " not found" << std::endl;
+        return {};
+    }
+
+    struct stat st;
+    void* mapping = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size > 0 && st.st_size % sizeof(uint32_t) == 0)
+        mapping = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED)
+    {
+        std::cerr << "Shader " << path << " is not SPIR-V" << std::endl;
+        return {};
+    }
+
+    uint64_t hash = Pl::CHashId().AppendBytes(mapping, st.st_size).GetValue();
+    FShaderRef shader;
+    auto hashIter = ShadersByHash.find(hash);
+    if (hashIter != ShadersByHash.end())
+        shader = hashIter->second;
+    else
+    {
+        // Created straight from the mapping, the file is never copied
+        RHI::CShaderModule::Ref module = RenderDevice->CreateShaderModule(st.st_size, mapping);
+        if (module)
+            shader = ShadersByHash[hash] = CreateShader(std::move(module));
+    }
+    munmap(mapping, st.st_size);
+
+    if (shader)
+        ShadersByName[name] = shader;
+    return shader;
+}
+
+CShaderModuleCache::FShaderRef CShaderModuleCache::Replace(const std::string& name,
+                                                           RHI::CShaderModule::Ref module)
+{
+    FShaderRef shader = CreateShader(std::move(module));
+    std::lock_guard<std::mutex> lk(Mutex);
+    ShadersByName[name] = shader;
+    return shader;
+}
+
+size_t CShaderModuleCache::GetModuleCount() const
+{
+    std::lock_guard<std::mutex> lk(Mutex);
+    return ShadersByHash.size();
+}
+
+void CShaderModuleCache::Shutdown()
+{
+    std::lock_guard<std::mutex> lk(Mutex);
+    ShadersByName.clear();
+    ShadersByHash.clear();
+}
+
+} /* namespace Foreground */
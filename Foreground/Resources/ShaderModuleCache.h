@@ -0,0 +1,50 @@
+#pragma once
+#include <Pipeline.h>
+#include <ShaderModule.h>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace Foreground
+{
+
+// Process wide cache of the precompiled .spv modules the screen passes load by name. A name is
+// looked up and its file mapped only the first time, passes recreated on resize share the module
+// and its reflection. Files with the same content share one module.
+class CShaderModuleCache
+{
+public:
+    struct CShader
+    {
+        RHI::CShaderModule::Ref Module;
+        // Reflected once, when the module is created
+        std::vector<RHI::CPipelineResource> Resources;
+    };
+    using FShaderRef = std::shared_ptr<const CShader>;
+
+    static CShaderModuleCache& Get();
+
+    // Null if the shader paths have no such file or it is not SPIR-V
+    FShaderRef Load(const std::string& name);
+    // What name loads from now on, for shaders recompiled in memory by hot reload
+    FShaderRef Replace(const std::string& name, RHI::CShaderModule::Ref module);
+
+    size_t GetModuleCount() const;
+    // Drops every module, has to happen before the device goes away
+    void Shutdown();
+
+private:
+    CShaderModuleCache() = default;
+
+    static FShaderRef CreateShader(RHI::CShaderModule::Ref module);
+
+    mutable std::mutex Mutex;
+    std::unordered_map<std::string, FShaderRef> ShadersByName;
+    // Content hash of the SPIR-V to its shader
+    std::unordered_map<uint64_t, FShaderRef> ShadersByHash;
+};
+
+} /* namespace Foreground */
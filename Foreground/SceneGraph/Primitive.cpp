@@ -1,15 +1,58 @@
 #include "Primitive.h"
+#include <map>
+#include <mutex>
+#include <vector>
 
 namespace Foreground
 {
 
+static std::mutex PrimitiveRegistryMutex;
+static std::vector<uint32_t> FreePrimitiveIds;
+static uint32_t NextPrimitiveId = 0;
+static std::map<uint32_t, CPrimitive::FDestructionListener> DestructionListeners;
+static uint32_t NextListenerToken = 0;
+
+CPrimitive::CPrimitive()
+{
+    std::lock_guard<std::mutex> lk(PrimitiveRegistryMutex);
+    if (FreePrimitiveIds.empty())
+        PrimitiveId = NextPrimitiveId++;
+    else
+    {
+        PrimitiveId = FreePrimitiveIds.back();
+        FreePrimitiveIds.pop_back();
+    }
+}
+
+CPrimitive::~CPrimitive()
+{
+    std::lock_guard<std::mutex> lk(PrimitiveRegistryMutex);
+    for (const auto& pair : DestructionListeners)
+        pair.second(PrimitiveId);
+    FreePrimitiveIds.push_back(PrimitiveId);
+}
+
+uint32_t CPrimitive::AddDestructionListener(FDestructionListener listener)
+{
+    std::lock_guard<std::mutex> lk(PrimitiveRegistryMutex);
+    uint32_t token = NextListenerToken++;
+    DestructionListeners.emplace(token, std::move(listener));
+    return token;
+}
+
+void CPrimitive::RemoveDestructionListener(uint32_t token)
+{
+    std::lock_guard<std::mutex> lk(PrimitiveRegistryMutex);
+    DestructionListeners.erase(token);
+}
+
 tc::BoundingBox CPrimitive::GetBoundingBox() const { return Shape->GetBoundingBox(); }
 
-std::shared_ptr<CBasicMaterial> CPrimitive::GetMaterial() const { return Material; }
+const std::shared_ptr<CBasicMaterial>& CPrimitive::GetMaterial() const { return Material; }
 
 void CPrimitive::SetMaterial(std::shared_ptr<CBasicMaterial> material) { Material = material; }
 
-std::shared_ptr<CTriangleMesh> CPrimitive::GetShape() const { return Shape; }
+const std::shared_ptr<CTriangleMesh>& CPrimitive::GetShape() const { return Shape; }
 
 void CPrimitive::SetShape(std::shared_ptr<CTriangleMesh> shape) { Shape = shape; }
 
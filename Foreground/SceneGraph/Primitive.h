@@ -3,6 +3,7 @@
 #include "Material/BasicMaterial.h"
 #include "Shape/TriangleMesh.h"
 #include <BoundingBox.h>
+#include <functional>
 #include <memory>
 
 namespace Foreground
@@ -12,14 +13,29 @@ namespace Foreground
 class FOREGROUND_API CPrimitive : public std::enable_shared_from_this<CPrimitive>
 {
 public:
+    // Called with the id of every primitive that is destroyed, before the id can be reused
+    using FDestructionListener = std::function<void(uint32_t primitiveId)>;
+
+    CPrimitive();
+    ~CPrimitive();
+    CPrimitive(const CPrimitive&) = delete;
+    CPrimitive& operator=(const CPrimitive&) = delete;
+
+    // Dense and stable for the lifetime of the primitive, renderers index their caches with it
+    uint32_t GetPrimitiveId() const { return PrimitiveId; }
+
+    static uint32_t AddDestructionListener(FDestructionListener listener);
+    static void RemoveDestructionListener(uint32_t token);
+
     tc::BoundingBox GetBoundingBox() const;
 
-    std::shared_ptr<CBasicMaterial> GetMaterial() const;
+    const std::shared_ptr<CBasicMaterial>& GetMaterial() const;
     void SetMaterial(std::shared_ptr<CBasicMaterial> material);
-    std::shared_ptr<CTriangleMesh> GetShape() const;
+    const std::shared_ptr<CTriangleMesh>& GetShape() const;
     void SetShape(std::shared_ptr<CTriangleMesh> shape);
 
 private:
+    uint32_t PrimitiveId;
     std::shared_ptr<CBasicMaterial> Material;
     std::shared_ptr<CTriangleMesh> Shape;
 };
@@ -7,6 +7,7 @@
 
 #include <StringUtils.h>
 #include <map>
+#include <unordered_map>
 
 namespace Foreground
 {
@@ -203,6 +204,20 @@ public:
         if (metallicRoughnessTexture != m.values.end())
             material->SetMetallicRoughnessImage(
                 GetImage(metallicRoughnessTexture->second.TextureIndex()));
+
+        // Exporters often write one material per mesh even when they are all the same, share
+        // those so they end up with one descriptor set and one sort id
+        size_t hash = material->ComputeContentHash();
+        auto range = MaterialsByContent.equal_range(hash);
+        for (auto it = range.first; it != range.second; ++it)
+        {
+            if (it->second->IsContentEqual(*material))
+            {
+                Materials[index] = it->second;
+                return it->second;
+            }
+        }
+        MaterialsByContent.emplace(hash, material);
         Materials[index] = material;
         return material;
     }
@@ -332,6 +347,7 @@ private:
     std::map<uint32_t, RHI::CImageView::Ref> Images;
     std::map<uint32_t, RHI::CSampler::Ref> Samplers;
     std::map<uint32_t, std::shared_ptr<CBasicMaterial>> Materials;
+    std::unordered_multimap<size_t, std::shared_ptr<CBasicMaterial>> MaterialsByContent;
     // A mesh is a collecton of primitives
     std::map<uint32_t, std::vector<std::shared_ptr<CPrimitive>>> Meshes;
 };
@@ -5,6 +5,7 @@
 #include <RenderContext.h>
 #include <ShaderModule.h>
 #include <Pipelang.h>
+#include <atomic>
 
 namespace Foreground
 {
@@ -26,6 +27,12 @@ struct CVertexAttribute
 class CTriangleMesh
 {
 public:
+    CTriangleMesh()
+    {
+        static std::atomic<uint32_t> nextSortId { 0 };
+        SortId = nextSortId++;
+    }
+
     void SetAttributes(std::vector<CBufferBinding> bindings,
                        std::map<Pl::CVertexAttribs::ESemantic, CVertexAttribute> attributes)
     {
@@ -54,6 +61,30 @@ public:
             }
     }
 
+    // Everything PipelineSetVertexInputDesc writes into a pipeline, flattened so that meshes with
+    // the same vertex layout can share pipelines
+    void AppendVertexInputSignature(std::vector<uint32_t>& signature,
+                                    const std::map<uint32_t, Pl::CVertexAttribs::ESemantic>& locationMap) const
+    {
+        for (const auto& pair : locationMap)
+        {
+            auto iter = Attributes.find(pair.second);
+            if (iter != Attributes.end())
+            {
+                signature.push_back(pair.first);
+                signature.push_back(static_cast<uint32_t>(iter->second.Format));
+                signature.push_back(iter->second.Offset);
+                signature.push_back(iter->second.BindingIndex);
+            }
+        }
+        for (uint32_t i = 0; i < static_cast<uint32_t>(BufferBindings.size()); i++)
+            if (BufferBindings[i].Buffer)
+            {
+                signature.push_back(i | 0x80000000u);
+                signature.push_back(BufferBindings[i].Stride);
+            }
+    }
+
     void SetIndexBuffer(RHI::CBuffer::Ref buffer, RHI::EFormat format, uint32_t offset)
     {
         IndexBuffer = buffer;
@@ -70,7 +101,10 @@ public:
     const tc::BoundingBox& GetBoundingBox() const { return BoundingBox; }
     void SetBoundingBox(tc::BoundingBox bb) { BoundingBox = std::move(bb); }
 
-    void Draw(RHI::IRenderContext& context) const
+    // Small and stable for the lifetime of the mesh, used to group draws by mesh
+    uint32_t GetSortId() const { return SortId; }
+
+    void BindBuffers(RHI::IRenderContext& context) const
     {
         for (uint32_t i = 0; i < static_cast<uint32_t>(BufferBindings.size()); i++)
             if (BufferBindings[i].Buffer)
@@ -78,17 +112,27 @@ public:
                 context.BindVertexBuffer(i, *BufferBindings[i].Buffer, BufferBindings[i].Offset);
             }
         if (IndexBuffer)
-        {
             context.BindIndexBuffer(*IndexBuffer, IndexBufferOffset, IndexBufferFormat);
-            context.DrawIndexed(ElementCount, 1, 0, 0, 0);
-        }
+    }
+
+    // Assumes the buffers of this mesh are already bound
+    void DrawElements(RHI::IRenderContext& context, uint32_t instanceCount = 1) const
+    {
+        if (IndexBuffer)
+            context.DrawIndexed(ElementCount, instanceCount, 0, 0, 0);
         else
-        {
-            context.Draw(ElementCount, 1, 0, 0);
-        }
+            context.Draw(ElementCount, instanceCount, 0, 0);
+    }
+
+    void Draw(RHI::IRenderContext& context) const
+    {
+        BindBuffers(context);
+        DrawElements(context);
     }
 
 private:
+    uint32_t SortId;
+
     std::array<CBufferBinding, 16> BufferBindings;
     std::map<Pl::CVertexAttribs::ESemantic, CVertexAttribute> Attributes;
 
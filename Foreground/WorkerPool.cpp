@@ -0,0 +1,83 @@
+#include "WorkerPool.h"
+#include <algorithm>
+
+namespace Foreground
+{
+
+CWorkerPool::CWorkerPool(uint32_t threadCount)
+{
+    if (threadCount == 0)
+        threadCount = std::max(std::thread::hardware_concurrency(), 2u) - 1;
+    Threads.reserve(threadCount);
+    for (uint32_t i = 0; i < threadCount; i++)
+        Threads.emplace_back(&CWorkerPool::WorkerMain, this);
+}
+
+CWorkerPool::~CWorkerPool()
+{
+    {
+        std::lock_guard<std::mutex> lk(Mutex);
+        bQuit = true;
+    }
+    WorkAvailable.notify_all();
+    for (auto& thread : Threads)
+        thread.join();
+}
+
+void CWorkerPool::ParallelFor(uint32_t count, const std::function<void(uint32_t)>& job)
+{
+    if (count == 0)
+        return;
+    if (count == 1 || Threads.empty())
+    {
+        for (uint32_t i = 0; i < count; i++)
+            job(i);
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lk(Mutex);
+        Job = &job;
+        JobCount = count;
+        NextJob = 0;
+        BusyWorkers = GetThreadCount();
+        Generation++;
+    }
+    WorkAvailable.notify_all();
+
+    RunJobs();
+
+    // Every worker has to check out of this generation before job goes out of scope
+    std::unique_lock<std::mutex> lk(Mutex);
+    WorkDone.wait(lk, [this] { return BusyWorkers == 0; });
+    Job = nullptr;
+}
+
+void CWorkerPool::WorkerMain()
+{
+    uint64_t seenGeneration = 0;
+    for (;;)
+    {
+        {
+            std::unique_lock<std::mutex> lk(Mutex);
+            WorkAvailable.wait(lk, [&] { return bQuit || Generation != seenGeneration; });
+            if (bQuit)
+                return;
+            seenGeneration = Generation;
+        }
+
+        RunJobs();
+
+        std::lock_guard<std::mutex> lk(Mutex);
+        if (--BusyWorkers == 0)
+            WorkDone.notify_one();
+    }
+}
+
+void CWorkerPool::RunJobs()
+{
+    for (uint32_t i = NextJob++; i < JobCount; i = NextJob++)
+        (*Job)(i);
+}
+
+} /* namespace Foreground */
@@ -0,0 +1,49 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace Foreground
+{
+
+// A fixed set of threads for fork-join work within a frame, such as recording a pass on several
+// render contexts at once. Only one ParallelFor may be in flight at a time.
+class CWorkerPool
+{
+public:
+    // 0 picks one thread less than the hardware concurrency, the caller being the last one
+    explicit CWorkerPool(uint32_t threadCount = 0);
+    ~CWorkerPool();
+
+    CWorkerPool(const CWorkerPool&) = delete;
+    CWorkerPool& operator=(const CWorkerPool&) = delete;
+
+    uint32_t GetThreadCount() const { return static_cast<uint32_t>(Threads.size()); }
+
+    // Runs job(i) for every i in [0, count) and returns once all of them are done. The calling
+    // thread picks up jobs as well.
+    void ParallelFor(uint32_t count, const std::function<void(uint32_t)>& job);
+
+private:
+    void WorkerMain();
+    void RunJobs();
+
+    std::vector<std::thread> Threads;
+
+    std::mutex Mutex;
+    std::condition_variable WorkAvailable;
+    std::condition_variable WorkDone;
+    uint64_t Generation = 0;
+    uint32_t BusyWorkers = 0;
+    bool bQuit = false;
+
+    const std::function<void(uint32_t)>* Job = nullptr;
+    uint32_t JobCount = 0;
+    std::atomic<uint32_t> NextJob { 0 };
+};
+
+} /* namespace Foreground */
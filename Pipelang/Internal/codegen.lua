@@ -19,6 +19,7 @@ end
 
 function codegen.annotate_parse_tree(stage_list)
     local symtab = {}
+    local spec_constants = {}
     local curr_stage = parser.shader_stage.vertex
     local programmable_output_counter = 0
 
@@ -38,11 +39,19 @@ function codegen.annotate_parse_tree(stage_list)
             if stage.subclass == "rasterizer" then
                 curr_stage = parser.shader_stage.pixel
             end
+            if stage.subclass == "compute_shader" then
+                curr_stage = parser.shader_stage.compute
+                stage.stage = parser.shader_stage.compute
+                codegen.result.workgroup_size = { stage.states.LocalSizeX or 1,
+                                                  stage.states.LocalSizeY or 1,
+                                                  stage.states.LocalSizeZ or 1 }
+            end
         elseif stage.class == "programmable" then
 			codegen.result[curr_stage] = true
 
             stage.inputs = {}
             stage.outputs = {}
+            stage.shared = {}
             stage.code = ""
             local PROG_MT = {}
             PROG_MT.__index = function (t, k)
@@ -85,6 +94,49 @@ function codegen.annotate_parse_tree(stage_list)
                     end
                 end
 
+                if k == "Specialization" then
+                    return function (type)
+                        return function (name)
+                            -- Stages of a pipeline declaring the same name share the constant
+                            local constant = spec_constants[name]
+                            if constant == nil then
+                                constant = {
+                                    name = name,
+                                    type = type,
+                                    parent = stage.name,
+                                    id = #codegen.result.spec_constants
+                                }
+                                if type == "bool" then
+                                    constant.default = false
+                                else
+                                    constant.default = 0
+                                end
+                                spec_constants[name] = constant
+                                table.insert(codegen.result.spec_constants, constant)
+                            end
+                            return function (default)
+                                constant.default = default
+                            end
+                        end
+                    end
+                end
+
+                if k == "Shared" then
+                    return function (type)
+                        return function (name)
+                            if curr_stage ~= parser.shader_stage.compute then
+                                print("Error: shared memory outside of a compute shader", name)
+                            end
+                            local shared = { type = type, name = name }
+                            table.insert(stage.shared, shared)
+                            -- Arrays take their length, a number or a GLSL constant expression
+                            return function (count)
+                                shared.count = count
+                            end
+                        end
+                    end
+                end
+
                 if k == "Code" then
                     return function (code)
                         stage.code = stage.code .. code
@@ -111,9 +163,70 @@ function codegen.annotate_parse_tree(stage_list)
     end
 end
 
+-- Names the members of a uniform block declare, "mat4 InstanceMatrices[256];" declares
+-- InstanceMatrices
+local function uniform_members(code)
+    local members = {}
+    for decl in string.gmatch(code, "[^;]+") do
+        local name = string.match((string.gsub(decl, "%b[]", "")), "([%a_][%w_]*)%s*$")
+        if name then
+            table.insert(members, name)
+        end
+    end
+    return members
+end
+
+-- Whether code mentions name as a whole identifier
+local function references(code, name)
+    return string.find(code, "%f[%w_]" .. name .. "%f[^%w_]") ~= nil
+end
+
+local function glsl_literal(constant)
+    if constant.type == "bool" then
+        return constant.default and "true" or "false"
+    elseif constant.type == "uint" then
+        return string.format("%du", constant.default)
+    elseif constant.type == "float" then
+        local literal = string.format("%.9g", constant.default)
+        if not string.find(literal, "[%.eni]") then
+            literal = literal .. ".0"
+        end
+        return literal
+    end
+    return string.format("%d", constant.default)
+end
+
 function codegen.glsl_gen(stage_list, curr_stage)
     local glsl_src = { header = "", main = "" }
 
+    -- What the programmable stages of this shader read. Stages may use interface members without
+    -- declaring them as inputs, so their code counts too. Members nobody reads are not declared.
+    local stage_code = ""
+    local stage_inputs = {}
+    for _, stage_name in ipairs(stage_list) do
+        local stage = parser.all_stages[stage_name]
+        if stage.class == "programmable" and stage.stage == curr_stage then
+            stage_code = stage_code .. (stage.header or "") .. stage.code
+            for name, _ in pairs(stage.inputs) do
+                stage_inputs[name] = true
+            end
+        end
+    end
+
+    local function is_read(name, obj)
+        if stage_inputs[name] or references(stage_code, name) then
+            return true
+        end
+        if obj.type == "uniform" or obj.type == "buffer" then
+            for _, member in ipairs(uniform_members(obj.code)) do
+                if references(stage_code, member) then
+                    return true
+                end
+            end
+        end
+        return false
+    end
+
     function glsl_src:emit_semicolon()
         self.header = self.header .. ";\n";
     end
@@ -132,12 +245,12 @@ function codegen.glsl_gen(stage_list, curr_stage)
 
     function glsl_src:emit_global_decl(name, obj, input)
 	    -- Ok this is full of hacks but whatever
-		if obj.binding and string.sub(obj.type, 1, 5) == "image" then
+		if obj.binding and string.match(obj.type, "^[iu]?image") then
             self.header = self.header ..
                 string.format("layout(set=%d, binding=%d, %s) uniform ", obj.set, obj.binding, obj.format)
-        elseif obj.binding and string.sub(obj.type, 1, 6) == "uimage" then
+        elseif obj.binding and obj.type == "buffer" then
             self.header = self.header ..
-                string.format("layout(set=%d, binding=%d, %s) uniform ", obj.set, obj.binding, obj.format)
+                string.format("layout(set=%d, binding=%d, std430) buffer ", obj.set, obj.binding)
         elseif obj.binding then
             self.header = self.header ..
                 string.format("layout(set=%d, binding=%d) uniform ", obj.set, obj.binding)
@@ -163,11 +276,12 @@ function codegen.glsl_gen(stage_list, curr_stage)
                 string.format("layout(location=%s) out ", string.sub(name, 7))
         end
 
-        if obj.type ~= "uniform" then
+        local is_block = obj.type == "uniform" or obj.type == "buffer"
+        if not is_block then
             self.header = self.header .. obj.type .. " "
         end
         self.header = self.header .. string.format("%s", name)
-        if obj.type == "uniform" then
+        if is_block then
             self:emit_block(obj.code)
         else
 			if obj.location and input and curr_stage == "geometry" then
@@ -204,6 +318,15 @@ function codegen.glsl_gen(stage_list, curr_stage)
         return par.class == "interface"
     end
 
+    -- Specialization constants go in every shader that declares or reads them, under the same id
+    for _, constant in ipairs(codegen.result.spec_constants) do
+        if parser.all_stages[constant.parent].stage == curr_stage
+            or references(stage_code, constant.name) then
+            glsl_src:emit_header(string.format("layout(constant_id=%d) const %s %s = %s;",
+                constant.id, constant.type, constant.name, glsl_literal(constant)))
+        end
+    end
+
     -- Loop over all stages as usual
     local imported_vars = {}
     for _, stage_name in ipairs(stage_list) do
@@ -213,7 +336,10 @@ function codegen.glsl_gen(stage_list, curr_stage)
             if stage.subclass ~= "vertex_attribs" or curr_stage == "vertex" then
                 for name, var in pairs(stage.outputs) do
                     -- TODO: check the stage flags of the output and curr_stage
-                    glsl_src:emit_global_decl(name, var, true)
+                    if is_read(name, var) then
+                        glsl_src:emit_global_decl(name, var, true)
+                        codegen.result.used_interface[name] = true
+                    end
                 end
             end
         elseif stage.class == "programmable" and stage.stage == curr_stage then
@@ -226,6 +352,14 @@ function codegen.glsl_gen(stage_list, curr_stage)
             for name, var in pairs(stage.outputs) do
                 glsl_src:emit_global_decl(name, var)
             end
+            for _, shared in ipairs(stage.shared) do
+                if shared.count then
+                    glsl_src:emit_header(string.format("shared %s %s[%s];", shared.type,
+                        shared.name, tostring(shared.count)))
+                else
+                    glsl_src:emit_header(string.format("shared %s %s;", shared.type, shared.name))
+                end
+            end
 
             glsl_src:emit_stmts_main(stage.code)
         elseif stage.class == "fixed" and stage.subclass == "geometry_shader" then
@@ -235,6 +369,13 @@ layout(%s) in;
 layout(%s, max_vertices=%d) out;
 ]], stage.states.InputPrimitive, stage.states.OutputPrimitive, stage.states.MaxVertices))
 			end
+        elseif stage.class == "fixed" and stage.subclass == "compute_shader" then
+            if curr_stage == "compute" then
+                local size = codegen.result.workgroup_size
+                glsl_src:emit_header(string.format(
+                    "layout(local_size_x=%d, local_size_y=%d, local_size_z=%d) in;",
+                    size[1], size[2], size[3]))
+            end
 		end
     end
     return glsl_src:get_string()
@@ -242,7 +383,20 @@ end
 
 function codegen.make_pipeline(stage_list)
     codegen.result = {}
+    -- Interface members read by any shader of the pipeline, the host can skip binding the rest
+    codegen.result.used_interface = {}
+    -- Specialization constants the stages declare, in constant_id order
+    codegen.result.spec_constants = {}
     codegen.annotate_parse_tree(stage_list)
+    -- A compute pipeline is its one shader, stages after a ComputeShader stage make up the kernel
+    if codegen.result.compute then
+        if codegen.result.vertex or codegen.result.pixel or codegen.result.geometry then
+            print("Error: graphics and compute stages in one pipeline")
+            return false
+        end
+        codegen.result.cs = codegen.glsl_gen(stage_list, "compute")
+        return true
+    end
     codegen.result.vs = codegen.glsl_gen(stage_list, "vertex")
     codegen.result.ps = codegen.glsl_gen(stage_list, "pixel")
 	if codegen.result.geometry then
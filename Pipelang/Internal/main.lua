@@ -29,13 +29,28 @@ ParameterBlock "PerPrimitive" : Set(2) {
     ]] : Stages "VDHG";
 };
 
+-- Instanced alternative to PerPrimitive, holding (ModelMat, NormalToWorld) pairs for up to 128
+-- instances. Stages check for PerInstanceConstants to pick the instanced code path.
+ParameterBlock "PerInstance" : Set(2) {
+    Output "uniform" "PerInstanceConstants" [[
+        mat4 InstanceMatrices[256];
+    ]] : Stages "VDHG";
+};
+
 function StaticMeshVS()
     Input "vec3" "Position";
     Input "vec3" "Normal";
     Input "vec2" "TexCoord0";
     Input "uniform" "GlobalConstants";
-    Input "uniform" "PerPrimitiveConstants";
     Input "uniform" "EngineCommonMiscs";
+    if PerInstanceConstants then
+        Input "uniform" "PerInstanceConstants";
+        Code [[
+        mat4 ModelMat = InstanceMatrices[2 * gl_InstanceIndex];
+        ]];
+    else
+        Input "uniform" "PerPrimitiveConstants";
+    end
     Output "vec3" "iPosition";
     Output "vec3" "iNormal";
     Output "vec4" "iTangent";
@@ -72,6 +87,14 @@ function StaticMeshPassThruVS()
 		vgTangent = Tangent;
         vgTexCoord0 = TexCoord0;
     ]];
+
+    -- The geometry stage does the transform, so it needs to know which instance this is
+    if PerInstanceConstants then
+        Output "uint" "vgInstanceIndex" "flat";
+        Code [[
+        vgInstanceIndex = uint(gl_InstanceIndex);
+        ]];
+    end
 end
 
 GeometryShader "GSTriInTriOut" {
@@ -89,7 +112,14 @@ function VoxelGS()
     Output "vec4" "iTangent";
     Output "vec2" "iTexCoord0";
 	Output "uint" "iOrientation" "flat";
-	
+
+    if PerInstanceConstants then
+        Input "uint" "vgInstanceIndex";
+        Code [[
+		mat4 ModelMat = InstanceMatrices[2 * vgInstanceIndex[0]];
+        ]];
+    end
+
     Code [[
 		vec3 viewPos[3];
 		int i;
@@ -147,8 +177,15 @@ function StaticMeshZOnlyVS()
     Input "vec3" "Position";
     Input "vec2" "TexCoord0";
     Input "uniform" "GlobalConstants";
-    Input "uniform" "PerPrimitiveConstants";
     Output "vec2" "iTexCoord0";
+    if PerInstanceConstants then
+        Input "uniform" "PerInstanceConstants";
+        Code [[
+        mat4 ModelMat = InstanceMatrices[2 * gl_InstanceIndex];
+        ]];
+    else
+        Input "uniform" "PerPrimitiveConstants";
+    end
     Code [[
         gl_Position = ProjMat * ViewMat * ModelMat * vec4(Position, 1);
         iTexCoord0 = TexCoord0;
@@ -184,6 +221,8 @@ function BasicMaterial()
     Output "vec4" "BaseColor";
     Output "float" "Metallic";
     Output "float" "Roughness";
+    -- Opaque materials can turn the discard off without another shader
+    Specialization "bool" "AlphaTest" (true);
 
     Code [[
         if (!UseTextures)
@@ -196,7 +235,7 @@ function BasicMaterial()
         {
             BaseColor = texture(sampler2D(BaseColorTex, GlobalLinearSampler), iTexCoord0) * BaseColorFactor;
 
-            if (BaseColor.a < 0.05) discard;
+            if (AlphaTest && BaseColor.a < 0.05) discard;
 
             vec4 mr = texture(sampler2D(MetallicRoughnessTex, GlobalLinearSampler), iTexCoord0);
             Metallic = mr.b * MetallicRoughness.b;
@@ -209,9 +248,10 @@ function BasicZOnlyMaterial()
     Input "vec2" "iTexCoord0";
     Input "uniform" "MaterialConstants";
     Input "texture2D" "BaseColorTex";
+    Specialization "bool" "AlphaTest" (true);
 
     Code [[
-        if (UseTextures) {
+        if (AlphaTest && UseTextures) {
             float alpha = texture(sampler2D(BaseColorTex, GlobalLinearSampler), iTexCoord0).a * BaseColorFactor.a;
             if (alpha < 0.05) {
                 discard;
@@ -282,6 +322,59 @@ function NormalVisPS()
     ]]
 end
 
+-- Compute pipelines list their parameter blocks, then a ComputeShader stage with the workgroup
+-- size, then the stages of the kernel
+ParameterBlock "SeparableBlurParams" : Set(0) {
+    Output "uniform" "BlurConstants" [[
+        ivec2 BlurDirection;
+        int BlurRadius;
+    ]] : Stages "C";
+    Output "buffer" "BlurKernel" [[
+        float BlurWeights[];
+    ]] : Stages "C";
+    Output "image2D" "BlurSource" : Stages "C" : Format "rgba16f";
+    Output "image2D" "BlurTarget" : Stages "C" : Format "rgba16f";
+};
+
+ComputeShader "Workgroup64" {
+    LocalSizeX = 64;
+};
+
+-- Blurs a run of 64 texels along BlurDirection per workgroup, dispatch (width / 64, height) groups
+-- for a horizontal pass
+function SeparableBlurCS()
+    Input "uniform" "BlurConstants";
+    Input "buffer" "BlurKernel";
+    Input "image2D" "BlurSource";
+    Input "image2D" "BlurTarget";
+    Specialization "int" "MaxBlurRadius" (16);
+    -- The run and the texels around it are loaded once, each of them is read by many invocations
+    Shared "vec4" "BlurTile" ("64 + 2 * MaxBlurRadius");
+
+    Code [[
+        ivec2 size = imageSize(BlurSource);
+        int extent = BlurDirection.x != 0 ? size.x : size.y;
+        int across = int(gl_WorkGroupID.y);
+        int first = int(gl_WorkGroupID.x) * 64;
+        for (int i = int(gl_LocalInvocationID.x); i < 64 + 2 * MaxBlurRadius; i += 64)
+        {
+            int t = clamp(first + i - MaxBlurRadius, 0, extent - 1);
+            BlurTile[i] = imageLoad(BlurSource, BlurDirection * t + BlurDirection.yx * across);
+        }
+        barrier();
+
+        int x = int(gl_LocalInvocationID.x);
+        if (first + x < extent)
+        {
+            int radius = min(BlurRadius, MaxBlurRadius);
+            vec4 sum = BlurTile[x + MaxBlurRadius] * BlurWeights[0];
+            for (int r = 1; r <= radius; r++)
+                sum += (BlurTile[x + MaxBlurRadius - r] + BlurTile[x + MaxBlurRadius + r]) * BlurWeights[r];
+            imageStore(BlurTarget, BlurDirection * (first + x) + BlurDirection.yx * across, sum);
+        }
+    ]]
+end
+
 DepthStencil "DefaultDepthStencil" {
 };
 
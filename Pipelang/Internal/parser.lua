@@ -12,7 +12,8 @@ local stage_subclass = { vertex_attribs = "vertex_attribs", VertexAttribs = "ver
                          parameter_block = "parameter_block", ParameterBlock = "parameter_block",
                          rasterizer = "rasterizer", Rasterizer = "rasterizer",
                          depthstencil = "depthstencil", DepthStencil = "depthstencil",
-                         blend = "blend", Blend = "blend", GeometryShader = "geometry_shader" }
+                         blend = "blend", Blend = "blend", GeometryShader = "geometry_shader",
+                         ComputeShader = "compute_shader" }
 local shader_stage = { undefined = "undefined", vertex = "vertex", domain = "domain", hull = "hull",
                        geometry = "geometry", pixel = "pixel", compute = "compute" }
 
@@ -73,7 +74,7 @@ local function add_stage(k, v)
                 result.outputs[output.a1].parent = k
                 result.outputs[output.a1].type = output.a0
                 result.outputs[output.a1].used = false
-                if output.a0 == "uniform" then
+                if output.a0 == "uniform" or output.a0 == "buffer" then
                     result.outputs[output.a1].code = output.a2
                 end
                 result.outputs[output.a1][locKey] = nextLoc()
@@ -0,0 +1,53 @@
+#include "CompileThreadPool.h"
+#include <algorithm>
+
+namespace Pl
+{
+
+CCompileThreadPool::CCompileThreadPool(uint32_t threadCount)
+{
+    if (threadCount == 0)
+        threadCount = std::max(std::thread::hardware_concurrency(), 1u);
+    Threads.reserve(threadCount);
+    for (uint32_t i = 0; i < threadCount; i++)
+        Threads.emplace_back(&CCompileThreadPool::WorkerMain, this);
+}
+
+CCompileThreadPool::~CCompileThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lk(Mutex);
+        bQuit = true;
+    }
+    TaskAvailable.notify_all();
+    for (auto& thread : Threads)
+        thread.join();
+}
+
+void CCompileThreadPool::Enqueue(std::function<void()> task)
+{
+    {
+        std::lock_guard<std::mutex> lk(Mutex);
+        Tasks.push_back(std::move(task));
+    }
+    TaskAvailable.notify_one();
+}
+
+void CCompileThreadPool::WorkerMain()
+{
+    for (;;)
+    {
+        std::function<void()> task;
+        {
+            std::unique_lock<std::mutex> lk(Mutex);
+            TaskAvailable.wait(lk, [this] { return bQuit || !Tasks.empty(); });
+            if (Tasks.empty())
+                return;
+            task = std::move(Tasks.front());
+            Tasks.pop_front();
+        }
+        task();
+    }
+}
+
+}
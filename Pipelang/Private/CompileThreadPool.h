@@ -0,0 +1,50 @@
+#pragma once
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace Pl
+{
+
+// A fixed number of threads draining a queue of independent tasks, used to run shader compiles
+// side by side. Tasks still queued when the pool goes away are run before it returns.
+class CCompileThreadPool
+{
+public:
+    // 0 picks the hardware concurrency
+    explicit CCompileThreadPool(uint32_t threadCount = 0);
+    ~CCompileThreadPool();
+
+    CCompileThreadPool(const CCompileThreadPool&) = delete;
+    CCompileThreadPool& operator=(const CCompileThreadPool&) = delete;
+
+    uint32_t GetThreadCount() const { return static_cast<uint32_t>(Threads.size()); }
+
+    template <typename TFunc> auto Submit(TFunc&& func) -> std::future<decltype(func())>
+    {
+        using TResult = decltype(func());
+        auto task = std::make_shared<std::packaged_task<TResult()>>(std::forward<TFunc>(func));
+        std::future<TResult> future = task->get_future();
+        Enqueue([task]() { (*task)(); });
+        return future;
+    }
+
+private:
+    void Enqueue(std::function<void()> task);
+    void WorkerMain();
+
+    std::vector<std::thread> Threads;
+
+    std::mutex Mutex;
+    std::condition_variable TaskAvailable;
+    std::deque<std::function<void()>> Tasks;
+    bool bQuit = false;
+};
+
+}
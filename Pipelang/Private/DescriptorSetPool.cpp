@@ -0,0 +1,90 @@
+#include "DescriptorSetPool.h"
+#include "Pipelang.h"
+#include <algorithm>
+
+namespace Pl
+{
+
+CDescriptorSetPool::CDescriptorSetPool(const CPipelangContext* context,
+                                       RHI::CDescriptorSetLayout::Ref layout)
+    : Context(context)
+    , Layout(std::move(layout))
+{
+}
+
+RHI::CDescriptorSet::Ref CDescriptorSetPool::AllocatePersistent()
+{
+    RHI::CDescriptorSet::Ref set;
+    {
+        std::lock_guard<std::mutex> lk(Mutex);
+        set = TakeFree(Context->GetFrameNumber());
+    }
+
+    // The caller gets its own reference whose deleter hands the set back
+    RHI::CDescriptorSet* raw = set.get();
+    std::weak_ptr<CDescriptorSetPool> weakPool = weak_from_this();
+    return RHI::CDescriptorSet::Ref(raw, [weakPool, set](RHI::CDescriptorSet*) mutable {
+        if (auto pool = weakPool.lock())
+            pool->Release(std::move(set));
+    });
+}
+
+RHI::CDescriptorSet::Ref CDescriptorSetPool::AllocateTransient()
+{
+    std::lock_guard<std::mutex> lk(Mutex);
+    uint64_t frame = Context->GetFrameNumber();
+    RHI::CDescriptorSet::Ref set = TakeFree(frame);
+    Retiring.push_back({ frame, set });
+    return set;
+}
+
+void CDescriptorSetPool::AddStats(CDescriptorSetStats& stats) const
+{
+    std::lock_guard<std::mutex> lk(Mutex);
+    stats.Layouts++;
+    stats.SetsCreated += Created;
+    stats.SetsHeld += Created - static_cast<uint32_t>(Free.size() + Retiring.size());
+    stats.SetsRetiring += static_cast<uint32_t>(Retiring.size());
+    stats.SetsFree += static_cast<uint32_t>(Free.size());
+    stats.Allocations += Allocations;
+}
+
+RHI::CDescriptorSet::Ref CDescriptorSetPool::TakeFree(uint64_t frame)
+{
+    Allocations++;
+
+    uint64_t framesInFlight = Context->GetFramesInFlight();
+    while (!Retiring.empty() && Retiring.front().Frame + framesInFlight <= frame)
+    {
+        CRetiring entry = std::move(Retiring.front());
+        Retiring.pop_front();
+        // A transient set somebody still holds could be in use for another frame
+        if (entry.Set.use_count() > 1)
+        {
+            entry.Frame = frame;
+            Retiring.push_back(std::move(entry));
+        }
+        else
+            Free.push_back(std::move(entry.Set));
+    }
+
+    if (Free.empty())
+    {
+        uint32_t batchSize = std::min(MaxBatchSize, std::max(MinBatchSize, Created / 2));
+        for (uint32_t i = 0; i < batchSize; i++)
+            Free.push_back(Layout->CreateDescriptorSet());
+        Created += batchSize;
+    }
+
+    RHI::CDescriptorSet::Ref set = std::move(Free.back());
+    Free.pop_back();
+    return set;
+}
+
+void CDescriptorSetPool::Release(RHI::CDescriptorSet::Ref set)
+{
+    std::lock_guard<std::mutex> lk(Mutex);
+    Retiring.push_back({ Context->GetFrameNumber(), std::move(set) });
+}
+
+}
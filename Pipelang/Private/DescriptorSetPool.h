@@ -0,0 +1,56 @@
+#pragma once
+#include <Device.h>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace Pl
+{
+
+class CPipelangContext;
+struct CDescriptorSetStats;
+
+// The descriptor sets of one layout. Sets are created from the layout in batches and live as long
+// as the pool; a set that is given back waits until the frame it was last used in has retired and
+// is then handed out again. Thread safe.
+class CDescriptorSetPool : public std::enable_shared_from_this<CDescriptorSetPool>
+{
+public:
+    CDescriptorSetPool(const CPipelangContext* context, RHI::CDescriptorSetLayout::Ref layout);
+
+    // Returns to the pool when the last reference to it goes away
+    RHI::CDescriptorSet::Ref AllocatePersistent();
+    // Returns to the pool once the current frame retired and nobody holds it anymore
+    RHI::CDescriptorSet::Ref AllocateTransient();
+
+    void AddStats(CDescriptorSetStats& stats) const;
+
+private:
+    // Takes a free set, creating a batch of them if there is none. Mutex must be held.
+    RHI::CDescriptorSet::Ref TakeFree(uint64_t frame);
+    void Release(RHI::CDescriptorSet::Ref set);
+
+    struct CRetiring
+    {
+        // Last frame that may use the set
+        uint64_t Frame;
+        RHI::CDescriptorSet::Ref Set;
+    };
+
+    static const uint32_t MinBatchSize = 8;
+    static const uint32_t MaxBatchSize = 256;
+
+    const CPipelangContext* Context;
+    RHI::CDescriptorSetLayout::Ref Layout;
+
+    mutable std::mutex Mutex;
+    std::vector<RHI::CDescriptorSet::Ref> Free;
+    // Ordered by frame
+    std::deque<CRetiring> Retiring;
+    uint32_t Created = 0;
+    uint64_t Allocations = 0;
+};
+
+}
@@ -0,0 +1,135 @@
+#include "FileWatcher.h"
+#include <algorithm>
+#include <cstdio>
+
+#ifdef __linux__
+#include <cerrno>
+#include <dirent.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+namespace Pl
+{
+
+#ifdef __linux__
+
+CFileWatcher::CFileWatcher()
+{
+    Fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (Fd < 0)
+        perror("inotify_init1");
+}
+
+CFileWatcher::~CFileWatcher()
+{
+    if (Fd >= 0)
+        close(Fd);
+}
+
+bool CFileWatcher::Watch(const std::string& dir)
+{
+    if (Fd < 0)
+        return false;
+
+    // Editors tend to write a temporary file and move it over the original
+    int wd = inotify_add_watch(Fd, dir.c_str(),
+                               IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_ONLYDIR);
+    if (wd < 0)
+        return false;
+    DirByWatch[wd] = dir;
+
+    DIR* d = opendir(dir.c_str());
+    if (!d)
+        return true;
+    while (dirent* entry = readdir(d))
+    {
+        std::string name = entry->d_name;
+        if (entry->d_type == DT_DIR && name != "." && name != "..")
+            Watch(dir + "/" + name);
+    }
+    closedir(d);
+    return true;
+}
+
+std::vector<std::string> CFileWatcher::Poll()
+{
+    std::vector<std::string> changed;
+    if (Fd < 0)
+        return changed;
+
+    alignas(inotify_event) char buffer[4096];
+    for (;;)
+    {
+        ssize_t length = read(Fd, buffer, sizeof(buffer));
+        if (length <= 0)
+            break;
+
+        for (char* p = buffer; p < buffer + length;)
+        {
+            auto* event = reinterpret_cast<inotify_event*>(p);
+            p += sizeof(inotify_event) + event->len;
+
+            auto iter = DirByWatch.find(event->wd);
+            if (iter == DirByWatch.end() || event->len == 0)
+                continue;
+            std::string path = iter->second + "/" + event->name;
+            if (event->mask & IN_ISDIR)
+            {
+                if (event->mask & (IN_CREATE | IN_MOVED_TO))
+                    Watch(path);
+            }
+            else if (event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO))
+                changed.push_back(std::move(path));
+        }
+    }
+
+    std::sort(changed.begin(), changed.end());
+    changed.erase(std::unique(changed.begin(), changed.end()), changed.end());
+    return changed;
+}
+
+#else
+
+CFileWatcher::CFileWatcher() = default;
+
+CFileWatcher::~CFileWatcher() = default;
+
+bool CFileWatcher::Watch(const std::string& dir)
+{
+    std::error_code ec;
+    if (!std::filesystem::is_directory(dir, ec))
+        return false;
+    Dirs.push_back(dir);
+    // Only what changes from now on is reported
+    for (const auto& entry : std::filesystem::recursive_directory_iterator(dir, ec))
+        if (entry.is_regular_file(ec))
+            WriteTimes[entry.path().generic_string()] = entry.last_write_time(ec);
+    return true;
+}
+
+std::vector<std::string> CFileWatcher::Poll()
+{
+    std::vector<std::string> changed;
+    std::error_code ec;
+    for (const std::string& dir : Dirs)
+    {
+        for (const auto& entry : std::filesystem::recursive_directory_iterator(dir, ec))
+        {
+            if (!entry.is_regular_file(ec))
+                continue;
+            auto writeTime = entry.last_write_time(ec);
+            auto result = WriteTimes.emplace(entry.path().generic_string(), writeTime);
+            if (result.second || result.first->second != writeTime)
+            {
+                result.first->second = writeTime;
+                changed.push_back(result.first->first);
+            }
+        }
+    }
+    return changed;
+}
+
+#endif
+
+}
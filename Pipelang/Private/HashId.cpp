@@ -0,0 +1,24 @@
+#include "HashId.h"
+#include <cassert>
+#include <cstdio>
+#include <mutex>
+#include <unordered_map>
+
+namespace Pl
+{
+
+void CheckHashCollision(CHashId id, const std::string& text)
+{
+    static std::mutex mutex;
+    static std::unordered_map<CHashId, std::string> textById;
+
+    std::lock_guard<std::mutex> lk(mutex);
+    auto iter = textById.emplace(id, text).first;
+    if (iter->second != text)
+    {
+        fprintf(stderr, "Hash collision between %s and %s\n", iter->second.c_str(), text.c_str());
+        assert(false);
+    }
+}
+
+}
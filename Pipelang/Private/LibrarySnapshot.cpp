@@ -0,0 +1,231 @@
+#include "LibrarySnapshot.h"
+#include "Pipelang.h"
+#include <PathTools.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+
+namespace Pl
+{
+
+static const char SnapshotMagic[4] = { 'P', 'L', 'L', 'S' };
+static const uint32_t SnapshotVersion = 1;
+
+// One file per source directory, libraries over different scripts keep their own snapshot
+static std::string GetSnapshotPath(const std::string& sourceDir)
+{
+    char name[64];
+    snprintf(name, sizeof(name), "PipelangLibrary.%016llx.snapshot",
+             static_cast<unsigned long long>(CHashId().Append(sourceDir).GetValue()));
+    return name;
+}
+
+void CSnapshotWriter::WriteBytes(const void* data, size_t size)
+{
+    Data.append(static_cast<const char*>(data), size);
+}
+
+void CSnapshotWriter::WriteUInt(uint32_t value) { WriteBytes(&value, sizeof(value)); }
+
+void CSnapshotWriter::WriteUInt64(uint64_t value) { WriteBytes(&value, sizeof(value)); }
+
+void CSnapshotWriter::WriteString(const std::string& value)
+{
+    WriteUInt(static_cast<uint32_t>(value.size()));
+    WriteBytes(value.data(), value.size());
+}
+
+bool CSnapshotReader::ReadBytes(void* data, size_t size)
+{
+    if (static_cast<size_t>(End - Pos) < size)
+    {
+        Pos = End;
+        return false;
+    }
+    memcpy(data, Pos, size);
+    Pos += size;
+    return true;
+}
+
+bool CSnapshotReader::ReadUInt(uint32_t& value) { return ReadBytes(&value, sizeof(value)); }
+
+bool CSnapshotReader::ReadUInt64(uint64_t& value) { return ReadBytes(&value, sizeof(value)); }
+
+bool CSnapshotReader::ReadString(std::string& value)
+{
+    uint32_t size;
+    if (!ReadUInt(size))
+        return false;
+    if (static_cast<size_t>(End - Pos) < size)
+    {
+        Pos = End;
+        return false;
+    }
+    value.assign(Pos, size);
+    Pos += size;
+    return true;
+}
+
+void CVertexAttribs::WriteSnapshot(CSnapshotWriter& writer) const
+{
+    writer.WriteUInt(static_cast<uint32_t>(AttribsByLocation.size()));
+    for (const auto& pair : AttribsByLocation)
+    {
+        writer.WriteUInt(pair.first);
+        writer.WriteUInt(static_cast<uint32_t>(pair.second));
+    }
+}
+
+bool CVertexAttribs::ReadSnapshot(CSnapshotReader& reader)
+{
+    uint32_t count;
+    if (!reader.ReadUInt(count))
+        return false;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        uint32_t location, semantic;
+        if (!reader.ReadUInt(location) || !reader.ReadUInt(semantic))
+            return false;
+        if (semantic < static_cast<uint32_t>(ESemantic::Position)
+            || semantic > static_cast<uint32_t>(ESemantic::Weights0))
+            return false;
+        AttribsByLocation.emplace(location, static_cast<ESemantic>(semantic));
+    }
+    return true;
+}
+
+void CParameterBlock::WriteSnapshot(CSnapshotWriter& writer) const
+{
+    writer.WriteUInt(SetIndex);
+    writer.WriteUInt(static_cast<uint32_t>(Bindings.size()));
+    for (size_t i = 0; i < Bindings.size(); i++)
+    {
+        writer.WriteString(BindingNames[i]);
+        writer.WriteUInt(Bindings[i].Binding);
+        writer.WriteString(BindingDecls[i].Type);
+        writer.WriteUInt(Bindings[i].Count);
+        writer.WriteString(BindingDecls[i].Stages);
+    }
+}
+
+bool CParameterBlock::ReadSnapshot(CSnapshotReader& reader)
+{
+    uint32_t count;
+    if (!reader.ReadUInt(SetIndex) || !reader.ReadUInt(count))
+        return false;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        std::string name, type, stages;
+        uint32_t binding, bindingCount;
+        if (!reader.ReadString(name) || !reader.ReadUInt(binding) || !reader.ReadString(type)
+            || !reader.ReadUInt(bindingCount) || !reader.ReadString(stages))
+            return false;
+        // Replayed in the order the snapshot stored them, so handles come out the same
+        AddBinding(name, binding, type, bindingCount, stages);
+    }
+    return true;
+}
+
+uint64_t CPipelangLibrary::HashScripts() const
+{
+    namespace fs = std::filesystem;
+
+    std::vector<std::string> paths;
+    std::error_code ec;
+    std::string internalDir = tc::FPathTools::Join(PIPELANG_SOURCE_DIR, "Internal");
+    for (const auto& entry : fs::directory_iterator(internalDir, ec))
+        if (entry.path().extension() == ".lua")
+            paths.push_back(entry.path().generic_string());
+    std::sort(paths.begin(), paths.end());
+
+    CHashId hash = CHashId().AppendValue(SnapshotVersion).Append(SourceDir);
+    for (const std::string& path : paths)
+    {
+        std::ifstream ifs(path, std::ios::binary);
+        std::string source((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
+        hash = hash.Append(path).AppendValue(source.size()).Append(source);
+    }
+    return hash.GetValue();
+}
+
+bool CPipelangLibrary::LoadSnapshot(uint64_t sourceHash)
+{
+    std::ifstream ifs(GetSnapshotPath(SourceDir), std::ios::binary);
+    if (!ifs)
+        return false;
+    std::string data((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
+
+    CSnapshotReader reader(data.data(), data.size());
+    char magic[4];
+    uint32_t version;
+    uint64_t hash;
+    uint32_t blockCount;
+    if (!reader.ReadBytes(magic, sizeof(magic))
+        || memcmp(magic, SnapshotMagic, sizeof(magic)) != 0 || !reader.ReadUInt(version)
+        || version != SnapshotVersion || !reader.ReadUInt64(hash) || hash != sourceHash
+        || !reader.ReadUInt(blockCount))
+        return false;
+
+    // Nothing is replaced unless the whole snapshot reads
+    std::unordered_map<std::string, CParameterBlock> parameterBlocks;
+    for (uint32_t i = 0; i < blockCount; i++)
+    {
+        std::string name;
+        if (!reader.ReadString(name) || !parameterBlocks[name].ReadSnapshot(reader))
+            return false;
+    }
+    uint32_t attribsCount;
+    std::unordered_map<std::string, CVertexAttribs> vertexAttribDescs;
+    if (!reader.ReadUInt(attribsCount))
+        return false;
+    for (uint32_t i = 0; i < attribsCount; i++)
+    {
+        std::string name;
+        if (!reader.ReadString(name) || !vertexAttribDescs[name].ReadSnapshot(reader))
+            return false;
+    }
+    if (!reader.IsAtEnd())
+        return false;
+
+    ParameterBlocks = std::move(parameterBlocks);
+    VertexAttribDescs = std::move(vertexAttribDescs);
+    return true;
+}
+
+void CPipelangLibrary::SaveSnapshot(uint64_t sourceHash) const
+{
+    CSnapshotWriter writer;
+    writer.WriteBytes(SnapshotMagic, sizeof(SnapshotMagic));
+    writer.WriteUInt(SnapshotVersion);
+    writer.WriteUInt64(sourceHash);
+    writer.WriteUInt(static_cast<uint32_t>(ParameterBlocks.size()));
+    for (const auto& pair : ParameterBlocks)
+    {
+        writer.WriteString(pair.first);
+        pair.second.WriteSnapshot(writer);
+    }
+    writer.WriteUInt(static_cast<uint32_t>(VertexAttribDescs.size()));
+    for (const auto& pair : VertexAttribDescs)
+    {
+        writer.WriteString(pair.first);
+        pair.second.WriteSnapshot(writer);
+    }
+
+    // Written aside and renamed over, a run starting meanwhile reads the old snapshot or none
+    std::string snapshotPath = GetSnapshotPath(SourceDir);
+    std::string tempPath = snapshotPath + ".tmp";
+    {
+        std::ofstream ofs(tempPath, std::ios::binary | std::ios::trunc);
+        ofs.write(writer.GetData().data(), writer.GetData().size());
+        if (!ofs)
+            return;
+    }
+    std::error_code ec;
+    std::filesystem::rename(tempPath, snapshotPath, ec);
+}
+
+}
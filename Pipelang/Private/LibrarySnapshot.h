@@ -0,0 +1,47 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace Pl
+{
+
+// Builds the bytes of a library snapshot. Values are written in host byte order, a snapshot is a
+// cache for the machine that wrote it.
+class CSnapshotWriter
+{
+public:
+    void WriteBytes(const void* data, size_t size);
+    void WriteUInt(uint32_t value);
+    void WriteUInt64(uint64_t value);
+    void WriteString(const std::string& value);
+
+    const std::string& GetData() const { return Data; }
+
+private:
+    std::string Data;
+};
+
+// Reads what a CSnapshotWriter wrote. A read past the end fails and leaves the reader at the end.
+class CSnapshotReader
+{
+public:
+    CSnapshotReader(const char* data, size_t size)
+        : Pos(data)
+        , End(data + size)
+    {
+    }
+
+    bool ReadBytes(void* data, size_t size);
+    bool ReadUInt(uint32_t& value);
+    bool ReadUInt64(uint64_t& value);
+    bool ReadString(std::string& value);
+
+    bool IsAtEnd() const { return Pos == End; }
+
+private:
+    const char* Pos;
+    const char* End;
+};
+
+}
@@ -1,17 +1,273 @@
 #include "Pipelang.h"
 #include <RHIInstance.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <thread>
 
-int main()
+using namespace Pl;
+
+static const char* DefaultManifest = PIPELANG_SOURCE_DIR "/Internal/precache.manifest";
+static const char* DefaultArchive = "PipelangShaders.archive";
+
+static double MillisecondsSince(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start)
+        .count();
+}
+
+static std::string JoinStages(const std::vector<std::string>& stages)
+{
+    std::string joined;
+    for (const std::string& s : stages)
+        joined += (joined.empty() ? "" : " ") + s;
+    return joined;
+}
+
+static void PrintDedupeStats(const CPipelangContext& context)
+{
+    CShaderDedupeStats stats = context.GetShaderDedupeStats();
+    printf("%u shader requests: %u shared a source, %u shared SPIR-V, %u modules with %llu "
+           "bytes, %llu bytes saved\n",
+           stats.Requests, stats.SourceHits, stats.SPIRVHits, stats.Modules,
+           static_cast<unsigned long long>(stats.ModuleBytes),
+           static_cast<unsigned long long>(stats.SavedBytes));
+}
+
+// Compiles every pipeline of the manifest into the archive, side by side on the compile pool
+static int RunCompile(CPipelangContext& context, const char* manifestPath, const char* archivePath)
+{
+    std::vector<std::vector<std::string>> stageLists;
+    if (!ReadPipelineManifest(manifestPath, stageLists))
+    {
+        fprintf(stderr, "Cannot read manifest %s\n", manifestPath);
+        return 1;
+    }
+
+    auto& library = context.CreateLibrary("Internal");
+    library.Parse();
+    context.OpenShaderArchive(archivePath);
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<CPipelineCompileStats> stats;
+    library.CompilePipelines(stageLists, &stats);
+    double total = MillisecondsSince(start);
+
+    int failures = 0;
+    size_t totalSize = 0;
+    for (size_t i = 0; i < stageLists.size(); i++)
+    {
+        const CPipelineCompileStats& s = stats[i];
+        if (!s.bSuccess)
+        {
+            printf("FAILED    %s\n", JoinStages(stageLists[i]).c_str());
+            failures++;
+            continue;
+        }
+        printf("%8.2f ms %7u bytes%s  %s\n", s.Milliseconds, s.SPIRVSize,
+               s.bFromArchive ? " (archived)" : "", JoinStages(stageLists[i]).c_str());
+        totalSize += s.SPIRVSize;
+    }
+    printf("%zu pipelines, %d failed, %zu bytes of SPIR-V in %.2f ms\n", stageLists.size(),
+           failures, totalSize, total);
+    PrintDedupeStats(context);
+
+    if (!context.SaveShaderArchive())
+    {
+        fprintf(stderr, "Cannot write archive %s\n", archivePath);
+        return 1;
+    }
+    return failures;
+}
+
+// Per draw bind cost: a dynamic offset set by binding name against one set through a handle
+static void BenchmarkBindings(CPipelangLibrary& library)
+{
+    const int drawCount = 1000000;
+    auto& block = library.GetParameterBlock("PerInstance");
+    auto ds = block.CreateDescriptorSet();
+    CBindingHandle handle = block.GetBindingHandle("PerInstanceConstants");
+
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < drawCount; i++)
+        block.SetDynamicOffset(ds, (i & 255) * 256, "PerInstanceConstants");
+    double byName = MillisecondsSince(start);
+
+    start = std::chrono::steady_clock::now();
+    for (int i = 0; i < drawCount; i++)
+        block.SetDynamicOffset(ds, (i & 255) * 256, handle);
+    double byHandle = MillisecondsSince(start);
+
+    printf("SetDynamicOffset: %.1f ns by name, %.1f ns by handle\n",
+           byName * 1e6 / drawCount, byHandle * 1e6 / drawCount);
+}
+
+// Times parsing the library and the first GetPipeline of every pipeline in the manifest. Run it
+// twice from the same directory to compare against warm script bytecode and SPIR-V.
+static int RunBenchmark(CPipelangContext& context, const char* manifestPath)
+{
+    std::vector<std::vector<std::string>> stageLists;
+    if (!ReadPipelineManifest(manifestPath, stageLists))
+    {
+        fprintf(stderr, "Cannot read manifest %s\n", manifestPath);
+        return 1;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    auto& library = context.CreateLibrary("Internal");
+    library.Parse();
+    printf("Parse %.2f ms\n", MillisecondsSince(start));
+
+    int failures = 0;
+    for (const auto& stages : stageLists)
+    {
+        RHI::CPipelineDesc desc;
+        start = std::chrono::steady_clock::now();
+        bool bSuccess = library.GetPipeline(desc, stages);
+        printf("%8.2f ms%s  %s\n", MillisecondsSince(start), bSuccess ? "" : " (failed)",
+               JoinStages(stages).c_str());
+        failures += bSuccess ? 0 : 1;
+    }
+    PrintDedupeStats(context);
+    printf("%zu pipelines share %u pipeline layouts over %u descriptor set layouts\n",
+           stageLists.size(), context.GetPipelineLayoutCount(),
+           context.GetDescriptorSetLayoutCount());
+
+    // Variants come from patching the SPIR-V above, the compiler does not run again
+    CSpecializationValues noAlphaTest;
+    noAlphaTest.SetBool(CHashId { "AlphaTest" }, false);
+    for (const auto& stages : stageLists)
+    {
+        RHI::CPipelineDesc desc;
+        start = std::chrono::steady_clock::now();
+        bool bSuccess = library.GetPipeline(desc, stages, CHashId(stages), noAlphaTest);
+        printf("%8.2f ms%s  %s, AlphaTest off\n", MillisecondsSince(start),
+               bSuccess ? "" : " (failed)", JoinStages(stages).c_str());
+        failures += bSuccess ? 0 : 1;
+    }
+    PrintDedupeStats(context);
+
+    const std::vector<std::string> blurStages = { "SeparableBlurParams", "Workgroup64",
+                                                  "SeparableBlurCS" };
+    CComputePipelineDesc computeDesc;
+    start = std::chrono::steady_clock::now();
+    bool bComputeSuccess = library.GetComputePipeline(computeDesc, blurStages);
+    printf("%8.2f ms%s  %s, %ux%ux%u per workgroup\n", MillisecondsSince(start),
+           bComputeSuccess ? "" : " (failed)", JoinStages(blurStages).c_str(),
+           computeDesc.WorkgroupSize[0], computeDesc.WorkgroupSize[1],
+           computeDesc.WorkgroupSize[2]);
+    failures += bComputeSuccess ? 0 : 1;
+
+    BenchmarkBindings(library);
+    return failures;
+}
+
+// Runs body on threadCount threads for about durationMs and returns the sum of their iterations
+template <typename TBody>
+static uint64_t RunOnThreads(unsigned threadCount, int durationMs, TBody body)
 {
+    std::atomic<bool> bStop { false };
+    std::atomic<uint64_t> total { 0 };
+    std::vector<std::thread> threads;
+    for (unsigned t = 0; t < threadCount; t++)
+        threads.emplace_back([&, t]() {
+            uint64_t iterations = 0;
+            while (!bStop.load(std::memory_order_relaxed))
+                iterations += body(t);
+            total += iterations;
+        });
+    std::this_thread::sleep_for(std::chrono::milliseconds(durationMs));
+    bStop = true;
+    for (auto& thread : threads)
+        thread.join();
+    return total;
+}
+
+// Readers look up keys of a CHashIdMap while a writer keeps inserting and growing it, every hit is
+// checked against the value the writer stored. Then times GetPipeline of warm pipelines from one
+// thread and from all of them.
+static int RunStress(CPipelangContext& context, const char* manifestPath)
+{
+    unsigned threadCount = std::max(2u, std::thread::hardware_concurrency());
+    std::atomic<int> failures { 0 };
+    {
+        const uint64_t keyCount = 1 << 18;
+        auto keyOf = [](uint64_t i) { return CHashId().Append(std::to_string(i)); };
+        CHashIdMap<uint64_t> map;
+        std::atomic<uint64_t> inserted { 0 };
+        std::thread writer([&]() {
+            for (uint64_t i = 0; i < keyCount; i++)
+            {
+                map.Assign(keyOf(i), i);
+                inserted.store(i + 1, std::memory_order_release);
+            }
+        });
+        uint64_t lookups = RunOnThreads(threadCount - 1, 1000, [&](unsigned t) {
+            uint64_t published = inserted.load(std::memory_order_acquire);
+            uint64_t i = published ? (published * 2654435761u + t) % published : 0;
+            const uint64_t* value = map.Find(keyOf(i));
+            if (published && (!value || *value != i))
+                failures++;
+            return 1;
+        });
+        writer.join();
+        printf("CHashIdMap: %llu lookups on %u threads during inserts, %d wrong\n",
+               static_cast<unsigned long long>(lookups), threadCount - 1, failures.load());
+    }
+
+    std::vector<std::vector<std::string>> stageLists;
+    if (!ReadPipelineManifest(manifestPath, stageLists))
+    {
+        fprintf(stderr, "Cannot read manifest %s\n", manifestPath);
+        return 1;
+    }
+    auto& library = context.CreateLibrary("Internal");
+    library.Parse();
+    std::vector<CPipelineCompileStats> stats;
+    library.CompilePipelines(stageLists, &stats);
+    std::vector<CHashId> ids;
+    for (const auto& stages : stageLists)
+        ids.emplace_back(stages);
+
+    auto lookup = [&](unsigned) {
+        for (size_t i = 0; i < stageLists.size(); i++)
+        {
+            RHI::CPipelineDesc desc;
+            if (!library.GetPipeline(desc, stageLists[i], ids[i]) && stats[i].bSuccess)
+                failures++;
+        }
+        return stageLists.size();
+    };
+    double single = RunOnThreads(1, 1000, lookup) / 1000.0;
+    double multi = RunOnThreads(threadCount, 1000, lookup) / 1000.0;
+    printf("GetPipeline: %.0f lookups/ms on 1 thread, %.0f lookups/ms on %u threads (%.2fx)\n",
+           single, multi, threadCount, multi / single);
+    return failures != 0;
+}
+
+int main(int argc, char** argv)
+{
+    if (argc < 2
+        || (strcmp(argv[1], "compile") != 0 && strcmp(argv[1], "bench") != 0
+            && strcmp(argv[1], "stress") != 0))
+    {
+        fprintf(stderr, "Usage: %s compile [manifest] [archive]\n"
+                        "       %s bench [manifest]\n"
+                        "       %s stress [manifest]\n",
+                argv[0], argv[0], argv[0]);
+        return 1;
+    }
+    const char* manifestPath = argc > 2 ? argv[2] : DefaultManifest;
+
     auto device = RHI::CInstance::Get().CreateDevice(RHI::EDeviceCreateHints::NoHint);
 
-    using namespace Pl;
     CPipelangContext context;
     context.SetDevice(device);
-    auto& library = context.CreateLibrary("/Volumes/macData/BerkeleyCG/Final184/Pipelang/Internal");
-    library.Parse();
-
-    RHI::CPipelineDesc desc;
-    library.GetPipeline(desc, {"EngineCommon", "PerPrimitive", "StandardTriMesh", "StaticMeshVS", "DefaultRasterizer", "NormalVisPS"});
-    return 0;
+    if (strcmp(argv[1], "compile") == 0)
+        return RunCompile(context, manifestPath, argc > 3 ? argv[3] : DefaultArchive);
+    if (strcmp(argv[1], "stress") == 0)
+        return RunStress(context, manifestPath);
+    return RunBenchmark(context, manifestPath);
 }
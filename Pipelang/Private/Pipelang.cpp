@@ -1,4 +1,5 @@
 #include "Pipelang.h"
+#include "DescriptorSetPool.h"
 #include "ShaderCache.h"
 #include <PathTools.h>
 
@@ -8,7 +9,12 @@
 #include <LuaBridge/Vector.h>
 
 #include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <filesystem>
 #include <fstream>
+#include <iterator>
+#include <sstream>
 
 namespace Pl
 {
@@ -70,12 +76,89 @@ RHI::CDescriptorSetLayout::Ref CParameterBlock::GetDescriptorSetLayout() const {
 
 RHI::CDescriptorSet::Ref CParameterBlock::CreateDescriptorSet() const
 {
-    return GetDescriptorSetLayout()->CreateDescriptorSet();
+    return DescriptorSetPool->AllocatePersistent();
+}
+
+RHI::CDescriptorSet::Ref CParameterBlock::AllocateTransientDescriptorSet() const
+{
+    return DescriptorSetPool->AllocateTransient();
 }
 
 const RHI::CDescriptorSetLayoutBinding& CParameterBlock::GetBinding(const std::string& name) const
 {
-    return Bindings.at(name);
+    CBindingHandle handle = GetBindingHandle(name);
+    if (!handle.IsValid())
+        throw std::out_of_range("No binding " + name + " in parameter block");
+    return Bindings[handle.Index];
+}
+
+const RHI::CDescriptorSetLayoutBinding& CParameterBlock::GetBinding(CBindingHandle handle) const
+{
+    assert(handle.Index < Bindings.size());
+    return Bindings[handle.Index];
+}
+
+CBindingHandle CParameterBlock::GetBindingHandle(const std::string& name) const
+{
+    return GetBindingHandle(CHashId { name.c_str() });
+}
+
+CBindingHandle CParameterBlock::GetBindingHandle(CHashId nameId) const
+{
+    auto iter = HandleByName.find(nameId);
+    if (iter == HandleByName.end())
+        return CBindingHandle();
+    return CBindingHandle { iter->second };
+}
+
+uint32_t CParameterBlock::GetBindingCount() const
+{
+    return static_cast<uint32_t>(Bindings.size());
+}
+
+const std::string& CParameterBlock::GetBindingName(CBindingHandle handle) const
+{
+    static const std::string invalid = "<invalid>";
+    return handle.Index < BindingNames.size() ? BindingNames[handle.Index] : invalid;
+}
+
+void CParameterBlock::BindBuffer(const RHI::CDescriptorSet::Ref& ds, RHI::CBuffer::Ref buffer,
+                                 size_t offset, size_t range, CBindingHandle handle,
+                                 uint32_t index)
+{
+    ds->BindBuffer(std::move(buffer), offset, range, GetBinding(handle).Binding, index);
+}
+
+void CParameterBlock::BindConstants(const RHI::CDescriptorSet::Ref& ds, const void* data,
+                                    size_t size, CBindingHandle handle, uint32_t index)
+{
+    ds->BindConstants(data, size, GetBinding(handle).Binding, index);
+}
+
+void CParameterBlock::BindImageView(const RHI::CDescriptorSet::Ref& ds,
+                                    RHI::CImageView::Ref imageView, CBindingHandle handle,
+                                    uint32_t index)
+{
+    ds->BindImageView(std::move(imageView), GetBinding(handle).Binding, index);
+}
+
+void CParameterBlock::BindSampler(const RHI::CDescriptorSet::Ref& ds, RHI::CSampler::Ref sampler,
+                                  CBindingHandle handle, uint32_t index)
+{
+    ds->BindSampler(std::move(sampler), GetBinding(handle).Binding, index);
+}
+
+void CParameterBlock::BindBufferView(const RHI::CDescriptorSet::Ref& ds,
+                                     RHI::CBufferView::Ref bufferView, CBindingHandle handle,
+                                     uint32_t index)
+{
+    ds->BindBufferView(std::move(bufferView), GetBinding(handle).Binding, index);
+}
+
+void CParameterBlock::SetDynamicOffset(const RHI::CDescriptorSet::Ref& ds, size_t offset,
+                                       CBindingHandle handle, uint32_t index)
+{
+    ds->SetDynamicOffset(offset, GetBinding(handle).Binding, index);
 }
 
 void CParameterBlock::BindBuffer(const RHI::CDescriptorSet::Ref& ds, RHI::CBuffer::Ref buffer,
@@ -149,37 +232,174 @@ void CParameterBlock::AddBinding(const std::string& name, uint32_t binding, cons
         { "texture2D", RHI::EDescriptorType::Image },
         { "image2D", RHI::EDescriptorType::StorageImage },
         { "uimage2D", RHI::EDescriptorType::StorageImage },
+        { "iimage2D", RHI::EDescriptorType::StorageImage },
         { "texture3D", RHI::EDescriptorType::Image },
         { "image3D", RHI::EDescriptorType::StorageImage },
         { "uimage3D", RHI::EDescriptorType::StorageImage },
+        { "iimage3D", RHI::EDescriptorType::StorageImage },
         { "textureBuffer", RHI::EDescriptorType::UniformTexelBuffer },
         { "imageBuffer", RHI::EDescriptorType::StorageTexelBuffer },
         { "uniform", RHI::EDescriptorType::UniformBuffer },
         { "buffer", RHI::EDescriptorType::StorageBuffer },
     };
     b.Type = typeMap.at(type);
-    Bindings.emplace(name, b);
+
+    CHashId nameId { name.c_str() };
+#ifdef DEBUG
+    CheckHashCollision(nameId, name);
+#endif
+    if (!HandleByName.emplace(nameId, static_cast<uint32_t>(Bindings.size())).second)
+        return;
+    Bindings.push_back(b);
+    BindingNames.push_back(name);
+    BindingDecls.push_back({ type, stages });
 }
 
 void CParameterBlock::SetSetIndex(uint32_t index) { SetIndex = index; }
 
 uint32_t CParameterBlock::GetSetIndex() const { return SetIndex; }
 
-void CParameterBlock::CreateDescriptorLayout(const RHI::CDevice::Ref& device)
+bool CParameterBlock::HasSameLayout(const CParameterBlock& other) const
 {
+    // Bindings are matched by name, the order they were added in depends on Lua's table
+    // iteration and differs between states
+    if (SetIndex != other.SetIndex || Bindings.size() != other.Bindings.size())
+        return false;
+    for (size_t i = 0; i < Bindings.size(); i++)
+    {
+        CBindingHandle handle = other.GetBindingHandle(BindingNames[i]);
+        if (!handle.IsValid())
+            return false;
+        const RHI::CDescriptorSetLayoutBinding& a = Bindings[i];
+        const RHI::CDescriptorSetLayoutBinding& b = other.Bindings[handle.Index];
+        if (a.Binding != b.Binding || a.Type != b.Type || a.Count != b.Count
+            || a.StageFlags != b.StageFlags)
+            return false;
+    }
+    return true;
+}
+
+void CParameterBlock::CreateDescriptorLayout(CPipelangContext* context)
+{
+    const RHI::CDevice::Ref& device = context->GetDevice();
     if (!device)
     {
         Layout = nullptr;
+        DescriptorSetPool = nullptr;
         return;
     }
 
     if (Layout)
         return;
 
-    std::vector<RHI::CDescriptorSetLayoutBinding> b;
-    for (const auto& pair : Bindings)
-        b.emplace_back(pair.second);
-    Layout = device->CreateDescriptorSetLayout(b);
+    Layout = context->GetDescriptorSetLayout(GetLayoutSignature(), Bindings, DescriptorSetPool);
+}
+
+// One bit per stage letter of AddBinding, however the script ordered or repeated them
+static uint32_t GetStageBits(const std::string& stages)
+{
+    static const char StageLetters[] = "VDHGPC";
+    uint32_t bits = 0;
+    for (char ch : stages)
+        if (const char* letter = strchr(StageLetters, ch))
+            bits |= 1u << (letter - StageLetters);
+    return bits;
+}
+
+CHashId CParameterBlock::GetLayoutSignature() const
+{
+    std::vector<uint32_t> order(Bindings.size());
+    for (uint32_t i = 0; i < order.size(); i++)
+        order[i] = i;
+    std::sort(order.begin(), order.end(),
+              [&](uint32_t a, uint32_t b) { return Bindings[a].Binding < Bindings[b].Binding; });
+
+    CHashId signature;
+    for (uint32_t i : order)
+    {
+        const RHI::CDescriptorSetLayoutBinding& b = Bindings[i];
+        signature = signature.AppendValue(b.Binding)
+                        .AppendValue(static_cast<uint32_t>(b.Type))
+                        .AppendValue(b.Count)
+                        .AppendValue(GetStageBits(BindingDecls[i].Stages));
+    }
+    return signature;
+}
+
+static int WriteChunk(lua_State* L, const void* data, size_t size, void* ud)
+{
+    static_cast<std::string*>(ud)->append(static_cast<const char*>(data), size);
+    return 0;
+}
+
+// Loads one of the internal scripts and leaves the chunk on the stack. The compiled chunk is kept
+// in LuaCache under the build directory, tagged with a hash of the Lua release, the path and the
+// source, so an edited script or another Lua is recompiled. Lua does not verify bytecode, which is
+// why the cache never lives anywhere foreign files could end up. Returns a lua_load status with
+// the error message on failure.
+static int LoadScript(lua_State* L, const std::string& name)
+{
+    std::string sourcePath = tc::FPathTools::Join(PIPELANG_SOURCE_DIR, "Internal/" + name + ".lua");
+    std::string chunkName = "@" + sourcePath;
+    std::ifstream ifs(sourcePath, std::ios::binary);
+    if (!ifs)
+    {
+        lua_pushfstring(L, "cannot open %s", sourcePath.c_str());
+        return LUA_ERRFILE;
+    }
+    std::string source((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
+    uint64_t sourceHash = CHashId { LUA_RELEASE }.Append(sourcePath).Append(source).GetValue();
+
+    std::string cacheDir = tc::FPathTools::Join(PIPELANG_BINARY_DIR, "LuaCache");
+    std::string bytecodePath = tc::FPathTools::Join(cacheDir, name + ".luac");
+    std::ifstream cached(bytecodePath, std::ios::binary);
+    uint64_t cachedHash = 0;
+    if (cached.read(reinterpret_cast<char*>(&cachedHash), sizeof(cachedHash))
+        && cachedHash == sourceHash)
+    {
+        std::string bytecode((std::istreambuf_iterator<char>(cached)),
+                             std::istreambuf_iterator<char>());
+        if (luaL_loadbufferx(L, bytecode.data(), bytecode.size(), chunkName.c_str(), "b") == LUA_OK)
+            return LUA_OK;
+        lua_pop(L, 1);
+    }
+
+    int error = luaL_loadbufferx(L, source.data(), source.size(), chunkName.c_str(), "t");
+    if (error)
+        return error;
+
+    std::string bytecode;
+#if LUA_VERSION_NUM >= 503
+    lua_dump(L, WriteChunk, &bytecode, 0);
+#else
+    lua_dump(L, WriteChunk, &bytecode);
+#endif
+    // Written aside and renamed over, so a concurrent run never loads half a chunk
+    std::error_code ec;
+    std::filesystem::create_directories(cacheDir, ec);
+    std::string tempPath = bytecodePath + ".tmp";
+    {
+        std::ofstream ofs(tempPath, std::ios::binary | std::ios::trunc);
+        ofs.write(reinterpret_cast<const char*>(&sourceHash), sizeof(sourceHash));
+        ofs.write(bytecode.data(), bytecode.size());
+        if (!ofs)
+            return LUA_OK;
+    }
+    std::filesystem::rename(tempPath, bytecodePath, ec);
+    return LUA_OK;
+}
+
+static bool RunScript(lua_State* L, const std::string& name)
+{
+    int error = LoadScript(L, name);
+    if (!error)
+        error = lua_pcall(L, 0, 0, 0);
+    if (error)
+    {
+        fprintf(stderr, "%s\n", lua_tostring(L, -1));
+        lua_pop(L, 1);
+    }
+    return !error;
 }
 
 CPipelangLibrary::CPipelangLibrary(CPipelangContext* p, std::string sourceDir)
@@ -188,53 +408,124 @@ CPipelangLibrary::CPipelangLibrary(CPipelangContext* p, std::string sourceDir)
 {
 }
 
-void CPipelangLibrary::Parse()
+CPipelangLibrary::~CPipelangLibrary()
+{
+    if (LuaState)
+        lua_close(LuaState);
+}
+
+bool CPipelangLibrary::CreateLuaState()
 {
     using namespace luabridge;
-    int error;
+
+    if (LuaState)
+        lua_close(LuaState);
 
     lua_State* L = luaL_newstate();
     luaL_openlibs(L);
     ExportClassesToLua(L);
 
-    {
-        setGlobal(L, tc::FPathTools::Join(PIPELANG_SOURCE_DIR, "Internal").c_str(),
-                  "internal_path");
+    setGlobal(L, tc::FPathTools::Join(PIPELANG_SOURCE_DIR, "Internal").c_str(), "internal_path");
+    setGlobal(L, this, "library");
+    setGlobal(L, Parent, "context");
 
-        setGlobal(L, this, "library");
-        setGlobal(L, Parent, "context");
+    // The sandbox runs main.lua, after this the parsed stage table stays resident in the state
+    bool bSuccess = RunScript(L, "sandbox");
+    bSuccess = RunScript(L, "parser") && bSuccess;
+    bSuccess = RunScript(L, "codegen") && bSuccess;
+    LuaState = L;
+    return bSuccess;
+}
 
-        error = luaL_dofile(
-            L, tc::FPathTools::Join(PIPELANG_SOURCE_DIR, "Internal/sandbox.lua").c_str());
-        if (error)
-        {
-            fprintf(stderr, "%s\n", lua_tostring(L, -1));
-            lua_pop(L, 1);
-        }
-        error = luaL_dofile(
-            L, tc::FPathTools::Join(PIPELANG_SOURCE_DIR, "Internal/parser.lua").c_str());
-        if (error)
+void CPipelangLibrary::Parse()
+{
+    using namespace luabridge;
+
+    {
+        std::lock_guard<std::mutex> lk(LuaMutex);
+        uint64_t sourceHash = HashScripts();
+        if (!LoadSnapshot(sourceHash))
         {
-            fprintf(stderr, "%s\n", lua_tostring(L, -1));
-            lua_pop(L, 1);
-        }
+            bool bSuccess = CreateLuaState();
 
-        LuaRef parser = getGlobal(L, "parser");
-        parser["add_all_interface_stages"]();
+            LuaRef parser = getGlobal(LuaState, "parser");
+            parser["add_all_interface_stages"]();
+            // A script that failed may have declared only part of the interface
+            if (bSuccess)
+                SaveSnapshot(sourceHash);
+        }
     }
 
-    lua_close(L);
-
     RecreateDeviceResources();
 }
 
-void CPipelangLibrary::PrecacheShaders() {}
+void CSpecializationValues::SetFloat(CHashId name, float value)
+{
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    Set(name, bits);
+}
+
+CHashId CSpecializationValues::GetId() const
+{
+    CHashId id;
+    for (const auto& value : Values)
+        id = id.AppendValue(value.first.GetValue()).AppendValue(value.second);
+    return id;
+}
+
+void CSpecializationValues::Set(CHashId name, uint32_t bits)
+{
+    auto iter = std::lower_bound(Values.begin(), Values.end(), name,
+                                 [](const std::pair<CHashId, uint32_t>& value, CHashId key) {
+                                     return value.first.GetValue() < key.GetValue();
+                                 });
+    if (iter != Values.end() && iter->first == name)
+        iter->second = bits;
+    else
+        Values.emplace(iter, name, bits);
+}
+
+bool ReadPipelineManifest(const std::string& path,
+                          std::vector<std::vector<std::string>>& stageLists)
+{
+    std::ifstream ifs(path);
+    if (!ifs)
+        return false;
+
+    std::string line;
+    while (std::getline(ifs, line))
+    {
+        line = line.substr(0, line.find('#'));
+        std::istringstream words(line);
+        std::vector<std::string> stages;
+        std::string stage;
+        while (words >> stage)
+            stages.push_back(stage);
+        if (!stages.empty())
+            stageLists.push_back(std::move(stages));
+    }
+    return true;
+}
+
+bool CPipelangLibrary::PrecacheShaders(const std::string& archivePath,
+                                       const std::string& manifestPath)
+{
+    Parent->OpenShaderArchive(archivePath);
+    if (manifestPath.empty())
+        return true;
+
+    std::vector<std::vector<std::string>> stageLists;
+    if (!ReadPipelineManifest(manifestPath, stageLists))
+        return false;
+    return CompilePipelines(stageLists);
+}
 
 void CPipelangLibrary::RecreateDeviceResources()
 {
     for (auto& pair : ParameterBlocks)
     {
-        pair.second.CreateDescriptorLayout(Parent->GetDevice());
+        pair.second.CreateDescriptorLayout(Parent);
     }
 }
 
@@ -248,144 +539,477 @@ CParameterBlock& CPipelangLibrary::GetParameterBlock(const std::string& name)
     return ParameterBlocks[name];
 }
 
-bool CPipelangLibrary::GetPipeline(RHI::CPipelineDesc& desc, const std::vector<std::string>& stages)
+static std::string JoinStages(const std::vector<std::string>& stages)
 {
-    // TODO: use 64bit hash key, not string concat
-    std::string key;
+    std::string joined;
     for (const std::string& s : stages)
     {
-        key += "_";
-        key += s;
+        joined += "_";
+        joined += s;
     }
-    desc.VS = Parent->GetShaderCache()->RetrieveShader(key + "_VS");
-    desc.PS = Parent->GetShaderCache()->RetrieveShader(key + "_PS");
-    desc.GS = Parent->GetShaderCache()->RetrieveShader(key + "_GS");
-    auto plIter = Parent->GetPipelineLayoutCache().find(key);
-    if (plIter != Parent->GetPipelineLayoutCache().end())
-        desc.Layout = plIter->second;
-    if (desc.VS && desc.PS && desc.Layout)
-        return true;
-
-    // Create pipeline layout from the specified parameter blocks
-    std::vector<RHI::CDescriptorSetLayout::Ref> layouts;
-    for (const std::string& s : stages)
-    {
-        auto pbIter = ParameterBlocks.find(s);
-        if (pbIter != ParameterBlocks.end())
-        {
-            const auto& pb = pbIter->second;
-            layouts.resize(std::max((uint32_t)layouts.size(), pb.GetSetIndex() + 1));
-            layouts[pb.GetSetIndex()] = pb.GetDescriptorSetLayout();
-        }
-    }
-    auto pipelineLayout = Parent->GetDevice()->CreatePipelineLayout(layouts);
-    Parent->GetPipelineLayoutCache()[key] = pipelineLayout;
-    desc.Layout = pipelineLayout;
+    return joined;
+}
 
-    using namespace luabridge;
-    int error;
-    bool retval = true;
+static const char* const ShaderSuffixes[4] = { "VS", "PS", "GS", "CS" };
+static const char* const ShaderStages[4] = { "vertex", "fragment", "geometry", "compute" };
 
-    lua_State* L = luaL_newstate();
-    luaL_openlibs(L);
-    ExportClassesToLua(L);
+bool CPipelangLibrary::GetPipeline(RHI::CPipelineDesc& desc, const std::vector<std::string>& stages)
+{
+    return GetPipeline(desc, stages, CHashId(stages));
+}
 
+bool CPipelangLibrary::GetPipeline(RHI::CPipelineDesc& desc, const std::vector<std::string>& stages,
+                                   CHashId stagesId)
+{
+#ifdef DEBUG
+    assert(stagesId == CHashId(stages));
+    CheckHashCollision(stagesId, JoinStages(stages));
+#endif
+
+    // Only the record is read, never the shaders one by one
+    const CPipelineRecord* record = Pipelines.Find(stagesId);
+    CPipelineRecord launched;
+    if (!record)
     {
-        setGlobal(L, tc::FPathTools::Join(PIPELANG_SOURCE_DIR, "Internal").c_str(),
-                  "internal_path");
+        CPendingPipeline pending;
+        LaunchPipeline(stages, stagesId, pending);
+        if (!ResolvePipeline(pending, launched))
+            return false;
+        record = &launched;
+    }
+    if (record->CS)
+        return false;
+
+    desc.Layout = record->Layout;
+    desc.VS = record->VS;
+    desc.PS = record->PS;
+    desc.GS = record->GS;
+    return true;
+}
 
-        setGlobal(L, this, "library");
-        setGlobal(L, Parent, "context");
+bool CPipelangLibrary::GetPipeline(RHI::CPipelineDesc& desc, const std::vector<std::string>& stages,
+                                   CHashId stagesId, const CSpecializationValues& values)
+{
+    if (!GetPipeline(desc, stages, stagesId))
+        return false;
+    if (values.IsEmpty())
+        return true;
 
-        error = luaL_dofile(
-            L, tc::FPathTools::Join(PIPELANG_SOURCE_DIR, "Internal/sandbox.lua").c_str());
-        if (error)
+    // Variants are keyed by their base module too, a hot reloaded base gets variants of its own
+    CHashId valuesId = values.GetId();
+    RHI::CShaderModule::Ref* shaders[3] = { &desc.VS, &desc.PS, &desc.GS };
+    std::vector<CSpecializationConstant> constants;
+    bool bConstantsResolved = false;
+    for (int i = 0; i < 3; i++)
+    {
+        RHI::CShaderModule::Ref& shader = *shaders[i];
+        if (!shader)
+            continue;
+        CHashId variantId = stagesId.Append(ShaderSuffixes[i])
+                                .AppendValue(valuesId.GetValue())
+                                .AppendValue(reinterpret_cast<uintptr_t>(shader.get()));
+        if (RHI::CShaderModule::Ref variant = Parent->GetShaderCache()->RetrieveShader(variantId))
         {
-            fprintf(stderr, "%s\n", lua_tostring(L, -1));
-            lua_pop(L, 1);
+            shader = std::move(variant);
+            continue;
         }
-        error = luaL_dofile(
-            L, tc::FPathTools::Join(PIPELANG_SOURCE_DIR, "Internal/parser.lua").c_str());
-        if (error)
+
+        if (!bConstantsResolved)
         {
-            fprintf(stderr, "%s\n", lua_tostring(L, -1));
-            lua_pop(L, 1);
+            std::lock_guard<std::mutex> lk(LuaMutex);
+            for (const auto& pair : Generated[stagesId].SpecConstantIds)
+                for (const auto& value : values.GetValues())
+                    if (value.first == pair.first)
+                        constants.push_back({ pair.second, value.second });
+            bConstantsResolved = true;
         }
-        error = luaL_dofile(
-            L, tc::FPathTools::Join(PIPELANG_SOURCE_DIR, "Internal/codegen.lua").c_str());
-        if (error)
+        // None of the values is for a constant of this pipeline, the base module serves
+        if (constants.empty())
         {
-            fprintf(stderr, "%s\n", lua_tostring(L, -1));
-            lua_pop(L, 1);
+            Parent->GetShaderCache()->InsertShader(variantId, shader);
+            continue;
         }
+        shader = Parent->GetShaderCache()->SpecializeShader(variantId, shader, constants);
+        if (!shader)
+            return false;
+    }
+    return true;
+}
 
-        LuaRef codegen = getGlobal(L, "codegen");
-        LuaRef success = codegen["make_pipeline"](stages);
-        if (!success.cast<bool>())
-        {
-            lua_close(L);
+bool CPipelangLibrary::GetComputePipeline(CComputePipelineDesc& desc,
+                                          const std::vector<std::string>& stages)
+{
+    return GetComputePipeline(desc, stages, CHashId(stages));
+}
+
+bool CPipelangLibrary::GetComputePipeline(CComputePipelineDesc& desc,
+                                          const std::vector<std::string>& stages,
+                                          CHashId stagesId)
+{
+#ifdef DEBUG
+    assert(stagesId == CHashId(stages));
+    CheckHashCollision(stagesId, JoinStages(stages));
+#endif
+
+    const CPipelineRecord* record = Pipelines.Find(stagesId);
+    CPipelineRecord launched;
+    if (!record)
+    {
+        CPendingPipeline pending;
+        LaunchPipeline(stages, stagesId, pending);
+        if (!ResolvePipeline(pending, launched))
             return false;
+        record = &launched;
+    }
+    if (!record->CS)
+        return false;
+
+    desc.Layout = record->Layout;
+    desc.CS = record->CS;
+    std::copy(record->WorkgroupSize.begin(), record->WorkgroupSize.end(), desc.WorkgroupSize);
+    return true;
+}
+
+bool CPipelangLibrary::CompilePipelines(const std::vector<std::vector<std::string>>& stageLists,
+                                        std::vector<CPipelineCompileStats>* stats)
+{
+    // Codegen runs one list after the other, the compiles of all of them overlap on the pool
+    std::vector<CPendingPipeline> pending(stageLists.size());
+    for (size_t i = 0; i < stageLists.size(); i++)
+        LaunchPipeline(stageLists[i], CHashId(stageLists[i]), pending[i]);
+
+    if (stats)
+        stats->assign(stageLists.size(), CPipelineCompileStats());
+
+    bool bSuccess = true;
+    for (size_t i = 0; i < pending.size(); i++)
+    {
+        CPipelineRecord record;
+        bool bPipelineSuccess = ResolvePipeline(pending[i], record);
+        bSuccess = bPipelineSuccess && bSuccess;
+        if (!stats)
+            continue;
+
+        CPipelineCompileStats& pipelineStats = (*stats)[i];
+        pipelineStats.bSuccess = bPipelineSuccess;
+        for (const char* suffix : ShaderSuffixes)
+        {
+            CShaderCompileInfo info;
+            CHashId shaderId = pending[i].StagesId.Append(suffix);
+            if (!Parent->GetShaderCache()->GetCompileInfo(shaderId, info))
+                continue;
+            pipelineStats.Milliseconds = std::max(pipelineStats.Milliseconds, info.Milliseconds);
+            pipelineStats.SPIRVSize += info.SPIRVSize;
+            pipelineStats.bFromArchive = pipelineStats.bFromArchive && info.bFromArchive;
         }
+    }
+    return bSuccess;
+}
+
+bool CPipelangLibrary::ResolvePipeline(const CPendingPipeline& pending, CPipelineRecord& record)
+{
+    const std::shared_future<RHI::CShaderModule::Ref>* shaders[4] = { &pending.VS, &pending.PS,
+                                                                      &pending.GS, &pending.CS };
+    RHI::CShaderModule::Ref* modules[4] = { &record.VS, &record.PS, &record.GS, &record.CS };
+    for (int i = 0; i < 4; i++)
+    {
+        if (!shaders[i]->valid())
+            continue;
+        *modules[i] = shaders[i]->get();
+        if (!*modules[i])
+            return false;
+    }
+    // Nothing launched when codegen failed
+    if (!record.CS && !(record.VS && record.PS))
+        return false;
+
+    record.Layout = pending.Layout;
+    record.WorkgroupSize = pending.WorkgroupSize;
+    Pipelines.Assign(pending.StagesId, record);
+    return true;
+}
 
-        LuaRef result = codegen["result"];
-        std::string vs = result["vs"];
-        std::string ps = result["ps"];
+// The readable name only shows up in diagnostics, the source is compiled from memory
+static CShaderCompileEnvironment MakeShaderEnvironment(const std::string& key, std::string source,
+                                                       int shader)
+{
+    CShaderCompileEnvironment env;
+    env.MainSource = std::move(source);
+    env.SourceName = key + "_" + ShaderSuffixes[shader] + ".glsl";
+    env.ShaderStage = ShaderStages[shader];
+    return env;
+}
 
-        std::ofstream ofs(key + "_VS.glsl");
-        ofs << vs;
-        ofs.close();
+static uint64_t HashSource(const std::string& source)
+{
+    return source.empty() ? 0 : std::hash<std::string>()(source);
+}
 
-        CShaderCompileEnvironment env;
-        env.MainSourcePath = key + "_VS.glsl";
-        env.ShaderStage = "vertex";
+bool CPipelangLibrary::GenerateShaders(const std::vector<std::string>& stages,
+                                       CCodegenResult& generated)
+{
+    using namespace luabridge;
 
-        desc.VS = Parent->GetShaderCache()->RetrieveOrCompileShader(key + "_VS", env);
+    // Codegen is an incremental call into the resident state, it re-annotates only the listed
+    // stages of the parse tree
+    LuaRef codegen = getGlobal(LuaState, "codegen");
+    LuaRef success = codegen["make_pipeline"](stages);
+    if (!success.cast<bool>())
+        return false;
 
-        if (!desc.VS)
+    LuaRef result = codegen["result"];
+    if (result["compute"])
+    {
+        generated.Sources[3] = result["cs"].cast<std::string>();
+        LuaRef workgroupSize = result["workgroup_size"];
+        for (int i = 0; i < 3; i++)
+            generated.WorkgroupSize[i] = workgroupSize[i + 1].cast<uint32_t>();
+    }
+    else
+    {
+        generated.Sources[0] = result["vs"].cast<std::string>();
+        generated.Sources[1] = result["ps"].cast<std::string>();
+        generated.Sources[2] =
+            result["geometry"] ? result["gs"].cast<std::string>() : std::string();
+    }
+
+    LuaRef specConstants = result["spec_constants"];
+    generated.SpecConstantIds.clear();
+    for (int i = 1; !specConstants[i].isNil(); i++)
+    {
+        LuaRef constant = specConstants[i];
+        generated.SpecConstantIds.emplace_back(
+            CHashId { constant["name"].cast<std::string>().c_str() },
+            constant["id"].cast<uint32_t>());
+    }
+
+    // Codegen left out the interface members no shader reads. The blocks learn about new readers
+    // right away, so that their sets are complete by the time the pipeline can be bound.
+    LuaRef usedInterface = result["used_interface"];
+    for (const std::string& s : stages)
+    {
+        auto pbIter = ParameterBlocks.find(s);
+        if (pbIter == ParameterBlocks.end())
+            continue;
+        CParameterBlock& pb = pbIter->second;
+        uint32_t mask = 0;
+        for (uint32_t i = 0; i < pb.GetBindingCount() && i < 32; i++)
+            if (!usedInterface[pb.GetBindingName(CBindingHandle { i }).c_str()].isNil())
+                mask |= 1u << i;
+        pb.AddUsedBindings(mask);
+    }
+    return true;
+}
+
+bool CPipelangLibrary::LaunchPipeline(const std::vector<std::string>& stages, CHashId stagesId,
+                                      CPendingPipeline& pending)
+{
+    pending.StagesId = stagesId;
+
+    CCodegenResult result;
+    {
+        std::lock_guard<std::mutex> lk(LuaMutex);
+        if (!LuaState)
+            CreateLuaState();
+
+        // Create pipeline layout from the specified parameter blocks
+        std::vector<RHI::CDescriptorSetLayout::Ref> layouts;
+        for (const std::string& s : stages)
         {
-            retval = false;
-            goto exit;
+            auto pbIter = ParameterBlocks.find(s);
+            if (pbIter != ParameterBlocks.end())
+            {
+                const auto& pb = pbIter->second;
+                layouts.resize(std::max((uint32_t)layouts.size(), pb.GetSetIndex() + 1));
+                layouts[pb.GetSetIndex()] = pb.GetDescriptorSetLayout();
+            }
         }
+        pending.Layout = Parent->GetPipelineLayout(layouts);
+        Parent->GetPipelineLayoutCache().Assign(stagesId, pending.Layout);
+
+        if (!GenerateShaders(stages, result))
+            return false;
+        pending.WorkgroupSize = result.WorkgroupSize;
+
+        CGeneratedPipeline& generated = Generated[stagesId];
+        generated.Stages = stages;
+        for (int i = 0; i < 4; i++)
+            generated.SourceHash[i] = HashSource(result.Sources[i]);
+        generated.SpecConstantIds = result.SpecConstantIds;
+    }
+
+    // All stages of the pipeline compile side by side
+    std::string key = JoinStages(stages);
+    std::shared_future<RHI::CShaderModule::Ref>* shaders[4] = { &pending.VS, &pending.PS,
+                                                                &pending.GS, &pending.CS };
+    for (int i = 0; i < 4; i++)
+    {
+        if (result.Sources[i].empty())
+            continue;
+        CShaderCompileEnvironment env = MakeShaderEnvironment(key, std::move(result.Sources[i]), i);
+        // Variants are patched from the SPIR-V
+        env.bKeepSPIRV = !result.SpecConstantIds.empty();
+        *shaders[i] = Parent->GetShaderCache()->CompileShaderAsync(
+            stagesId.Append(ShaderSuffixes[i]), std::move(env));
+    }
+    return true;
+}
 
-        ofs.open(key + "_PS.glsl");
-        ofs << ps;
-        ofs.close();
+void CPipelangLibrary::EnableHotReload()
+{
+    ScriptWatcher = std::make_unique<CFileWatcher>();
+    if (!ScriptWatcher->Watch(tc::FPathTools::Join(PIPELANG_SOURCE_DIR, "Internal")))
+        fprintf(stderr, "Pipelang: cannot watch the internal scripts, hot reload is off\n");
+}
 
-        env.MainSourcePath = key + "_PS.glsl";
-        env.ShaderStage = "fragment";
+void CPipelangLibrary::StartReload()
+{
+    using namespace luabridge;
+
+    std::lock_guard<std::mutex> lk(LuaMutex);
 
-        desc.PS = Parent->GetShaderCache()->RetrieveOrCompileShader(key + "_PS", env);
+    // Descriptor sets are already allocated from the current parameter blocks and renderers point
+    // at them, so the blocks keep both their layouts and their addresses
+    auto parameterBlocks = ParameterBlocks;
+    auto vertexAttribDescs = VertexAttribDescs;
+    CreateLuaState();
+    LuaRef parser = getGlobal(LuaState, "parser");
+    parser["add_all_interface_stages"]();
 
-        if (!desc.PS)
+    for (auto& pair : parameterBlocks)
+    {
+        auto iter = ParameterBlocks.find(pair.first);
+        if (iter != ParameterBlocks.end() && !iter->second.HasSameLayout(pair.second))
+            fprintf(stderr, "Pipelang: parameter block %s changed, restart to apply\n",
+                    pair.first.c_str());
+        ParameterBlocks[pair.first] = std::move(pair.second);
+    }
+    for (auto& pair : vertexAttribDescs)
+    {
+        auto iter = VertexAttribDescs.find(pair.first);
+        if (iter != VertexAttribDescs.end() && !(iter->second == pair.second))
+            fprintf(stderr, "Pipelang: vertex attributes %s changed, restart to apply\n",
+                    pair.first.c_str());
+        VertexAttribDescs[pair.first] = std::move(pair.second);
+    }
+    RecreateDeviceResources();
+
+    // Only pipelines whose generated code differs are recompiled, and only their changed shaders
+    uint32_t changed = 0;
+    for (const auto& pair : Generated)
+    {
+        const CGeneratedPipeline& generated = pair.second;
+        CCodegenResult result;
+        if (!GenerateShaders(generated.Stages, result))
         {
-            retval = false;
-            goto exit;
+            fprintf(stderr, "Pipelang: codegen failed for %s, keeping the old shaders\n",
+                    JoinStages(generated.Stages).c_str());
+            continue;
         }
 
-        if (result["geometry"])
+        CPendingReload reload;
+        reload.StagesId = pair.first;
+        reload.SpecConstantIds = result.SpecConstantIds;
+        reload.WorkgroupSize = result.WorkgroupSize;
+        bool bChanged = false;
+        std::string key = JoinStages(generated.Stages);
+        for (int i = 0; i < 4; i++)
         {
-            std::string gs = result["gs"];
-
-            ofs.open(key + "_GS.glsl");
-            ofs << gs;
-            ofs.close();
-
-            env.MainSourcePath = key + "_GS.glsl";
-            env.ShaderStage = "geometry";
+            std::string& source = result.Sources[i];
+            reload.SourceHash[i] = HashSource(source);
+            if (reload.SourceHash[i] == generated.SourceHash[i] || source.empty())
+                continue;
+            CShaderCompileEnvironment env = MakeShaderEnvironment(key, std::move(source), i);
+            env.bKeepSPIRV = !reload.SpecConstantIds.empty();
+            std::string outputPath = key + "_" + ShaderSuffixes[i] + ".spv";
+            reload.Shaders[i] = Parent->GetShaderCache()->CompileUncachedAsync(
+                std::move(env), std::move(outputPath));
+            bChanged = true;
+        }
+        if (!bChanged)
+            continue;
+
+        // A newer edit supersedes a reload still compiling
+        PendingReloads.erase(std::remove_if(PendingReloads.begin(), PendingReloads.end(),
+                                            [&](const CPendingReload& r) {
+                                                return r.StagesId == reload.StagesId;
+                                            }),
+                             PendingReloads.end());
+        PendingReloads.push_back(std::move(reload));
+        changed++;
+    }
+    printf("Pipelang: scripts changed, recompiling %u of %zu pipelines\n", changed,
+           Generated.size());
+}
 
-            desc.GS = Parent->GetShaderCache()->RetrieveOrCompileShader(key + "_GS", env);
+std::vector<CHashId> CPipelangLibrary::PollHotReload()
+{
+    std::vector<CHashId> reloaded;
+    if (!ScriptWatcher)
+        return reloaded;
+
+    bool bScriptsChanged = false;
+    for (const std::string& path : ScriptWatcher->Poll())
+        bScriptsChanged = bScriptsChanged
+            || (path.size() > 4 && path.compare(path.size() - 4, 4, ".lua") == 0);
+    if (bScriptsChanged)
+        StartReload();
+
+    // A pipeline swaps all its shaders together, once every one of them has compiled
+    for (auto iter = PendingReloads.begin(); iter != PendingReloads.end();)
+    {
+        CPendingReload& reload = *iter;
+        bool bReady = true;
+        bool bSuccess = true;
+        for (const auto& shader : reload.Shaders)
+        {
+            if (!shader.valid())
+                continue;
+            bReady = bReady
+                && shader.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+            bSuccess = bSuccess && bReady && shader.get();
+        }
+        if (!bReady)
+        {
+            ++iter;
+            continue;
+        }
 
-            if (!desc.GS)
+        if (bSuccess)
+        {
+            std::lock_guard<std::mutex> lk(LuaMutex);
+            CGeneratedPipeline& generated = Generated[reload.StagesId];
+            const CPipelineRecord* current = Pipelines.Find(reload.StagesId);
+            CPipelineRecord record = current ? *current : CPipelineRecord();
+            RHI::CShaderModule::Ref* modules[4] = { &record.VS, &record.PS, &record.GS,
+                                                    &record.CS };
+            for (int i = 0; i < 4; i++)
             {
-                retval = false;
-                goto exit;
+                if (!reload.Shaders[i].valid())
+                    continue;
+                *modules[i] = reload.Shaders[i].get();
+                Parent->GetShaderCache()->InsertShader(reload.StagesId.Append(ShaderSuffixes[i]),
+                                                       *modules[i]);
+                generated.SourceHash[i] = reload.SourceHash[i];
             }
+            generated.SpecConstantIds = reload.SpecConstantIds;
+            record.WorkgroupSize = reload.WorkgroupSize;
+            // Readers switch to all new shaders at once. A pipeline that never compiled has no
+            // record yet, its next GetPipeline builds one from the shader cache.
+            if (current)
+                Pipelines.Assign(reload.StagesId, std::move(record));
+            reloaded.push_back(reload.StagesId);
         }
+        else
+            fprintf(stderr, "Pipelang: a shader failed to compile, keeping the old ones\n");
+        iter = PendingReloads.erase(iter);
     }
+    return reloaded;
+}
 
-exit:
-    lua_close(L);
-    return retval;
+void CPipelangLibrary::FreeRetired(uint64_t frame, uint64_t graceFrames)
+{
+    Pipelines.FreeRetired(frame, graceFrames);
 }
 
 void CPipelangLibrary::AddVertexAttribs(const std::string& name, CVertexAttribs vertexAttribs)
@@ -402,6 +1026,7 @@ CPipelangContext::CPipelangContext(RHI::CDevice::Ref device)
     : Device(std::move(device))
 {
     ShaderCache = std::make_unique<CShaderCache>();
+    ShaderCache->OpenArchive("PipelangShaders.archive");
 }
 
 CPipelangContext::~CPipelangContext() = default;
@@ -428,14 +1053,120 @@ const std::unique_ptr<CShaderCache>& CPipelangContext::GetShaderCache() const
     return ShaderCache;
 }
 
-std::unordered_map<std::string, RHI::CPipelineLayout::Ref>&
-CPipelangContext::GetPipelineLayoutCache()
+void CPipelangContext::OpenShaderArchive(const std::string& path)
+{
+    ShaderCache->OpenArchive(path);
+}
+
+bool CPipelangContext::SaveShaderArchive() { return ShaderCache->GetArchive().Save(); }
+
+CShaderDedupeStats CPipelangContext::GetShaderDedupeStats() const
+{
+    return ShaderCache->GetDedupeStats();
+}
+
+std::shared_future<RHI::CShaderModule::Ref>
+CPipelangContext::CompileShaderFileAsync(const std::string& path, const std::string& stage,
+                                         const std::vector<std::string>& includeDirs)
+{
+    CShaderCompileEnvironment env;
+    env.MainSourcePath = path;
+    env.ShaderStage = stage;
+    env.IncludeDirs = includeDirs;
+    return ShaderCache->CompileUncachedAsync(std::move(env), path + ".spv", true);
+}
+
+CHashIdMap<RHI::CPipelineLayout::Ref>& CPipelangContext::GetPipelineLayoutCache()
 {
     return PipelineLayoutCache;
 }
 
+RHI::CDescriptorSetLayout::Ref CPipelangContext::GetDescriptorSetLayout(
+    CHashId signature, const std::vector<RHI::CDescriptorSetLayoutBinding>& bindings,
+    std::shared_ptr<CDescriptorSetPool>& pool)
+{
+    std::lock_guard<std::mutex> lk(LayoutMutex);
+    CSharedSetLayout& shared = SetLayouts[signature];
+    if (!shared.Layout)
+    {
+        shared.Layout = Device->CreateDescriptorSetLayout(bindings);
+        shared.Pool = CreateDescriptorSetPool(shared.Layout);
+    }
+    pool = shared.Pool;
+    return shared.Layout;
+}
+
+RHI::CPipelineLayout::Ref
+CPipelangContext::GetPipelineLayout(const std::vector<RHI::CDescriptorSetLayout::Ref>& setLayouts)
+{
+    CHashId key = CHashId().AppendValue(setLayouts.size());
+    for (const auto& setLayout : setLayouts)
+        key = key.AppendValue(reinterpret_cast<uintptr_t>(setLayout.get()));
+
+    std::lock_guard<std::mutex> lk(LayoutMutex);
+    RHI::CPipelineLayout::Ref& layout = PipelineLayouts[key];
+    if (!layout)
+        layout = Device->CreatePipelineLayout(setLayouts);
+    return layout;
+}
+
+uint32_t CPipelangContext::GetDescriptorSetLayoutCount() const
+{
+    std::lock_guard<std::mutex> lk(LayoutMutex);
+    return static_cast<uint32_t>(SetLayouts.size());
+}
+
+uint32_t CPipelangContext::GetPipelineLayoutCount() const
+{
+    std::lock_guard<std::mutex> lk(LayoutMutex);
+    return static_cast<uint32_t>(PipelineLayouts.size());
+}
+
+void CPipelangContext::BeginFrame()
+{
+    uint64_t frame = FrameNumber.fetch_add(1, std::memory_order_relaxed) + 1;
+    uint64_t framesInFlight = GetFramesInFlight();
+    ShaderCache->FreeRetired(frame, framesInFlight);
+    PipelineLayoutCache.FreeRetired(frame, framesInFlight);
+    for (auto& pair : LibraryByDir)
+        pair.second->FreeRetired(frame, framesInFlight);
+}
+
+void CPipelangContext::SetFramesInFlight(uint32_t count)
+{
+    FramesInFlight.store(std::max(count, 1u), std::memory_order_relaxed);
+}
+
+std::shared_ptr<CDescriptorSetPool>
+CPipelangContext::CreateDescriptorSetPool(RHI::CDescriptorSetLayout::Ref layout)
+{
+    auto pool = std::make_shared<CDescriptorSetPool>(this, std::move(layout));
+    std::lock_guard<std::mutex> lk(DescriptorSetPoolMutex);
+    DescriptorSetPools.erase(std::remove_if(DescriptorSetPools.begin(), DescriptorSetPools.end(),
+                                            [](const auto& p) { return p.expired(); }),
+                             DescriptorSetPools.end());
+    DescriptorSetPools.push_back(pool);
+    return pool;
+}
+
+CDescriptorSetStats CPipelangContext::GetDescriptorSetStats() const
+{
+    CDescriptorSetStats stats;
+    std::lock_guard<std::mutex> lk(DescriptorSetPoolMutex);
+    for (const auto& weakPool : DescriptorSetPools)
+        if (auto pool = weakPool.lock())
+            pool->AddStats(stats);
+    return stats;
+}
+
 void CPipelangContext::NotifyDeviceChange()
 {
+    // Layouts of the old device must not be handed out for the new one
+    {
+        std::lock_guard<std::mutex> lk(LayoutMutex);
+        SetLayouts.clear();
+        PipelineLayouts.clear();
+    }
     for (auto& iter : LibraryByDir)
         iter.second->RecreateDeviceResources();
     ShaderCache->SetDevice(Device);
@@ -0,0 +1,260 @@
+#include "SPIRVArchive.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace Pl
+{
+
+static const char ArchiveMagic[4] = { 'P', 'L', 'S', 'A' };
+static const uint32_t ArchiveVersion = 1;
+
+struct CArchiveHeader
+{
+    char Magic[4];
+    uint32_t Version;
+    uint64_t Generation;
+    uint64_t EntryCount;
+    uint64_t IndexOffset;
+};
+
+struct CArchiveIndexEntry
+{
+    uint64_t Key;
+    uint64_t Offset;
+    uint32_t Size;
+    uint32_t Padding;
+    uint64_t LastUse;
+};
+
+CSPIRVArchive::~CSPIRVArchive() { Close(); }
+
+void CSPIRVArchive::Open(const std::string& path, size_t maxSize)
+{
+    Close();
+
+    std::lock_guard<std::mutex> lk(Mutex);
+    Path = path;
+    MaxSize = maxSize;
+    Generation = 1;
+
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return;
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size >= static_cast<off_t>(sizeof(CArchiveHeader)))
+    {
+        void* mapping = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapping != MAP_FAILED)
+        {
+            Mapping = static_cast<const uint8_t*>(mapping);
+            MappingSize = st.st_size;
+        }
+    }
+    // The mapping stays valid without the descriptor, and survives the file being replaced
+    close(fd);
+    if (!Mapping)
+        return;
+
+    CArchiveHeader header;
+    memcpy(&header, Mapping, sizeof(header));
+    if (memcmp(header.Magic, ArchiveMagic, 4) != 0 || header.Version != ArchiveVersion
+        || header.IndexOffset > MappingSize
+        || header.EntryCount > (MappingSize - header.IndexOffset) / sizeof(CArchiveIndexEntry))
+    {
+        fprintf(stderr, "Ignoring SPIR-V archive %s, it is damaged or from another version\n",
+                path.c_str());
+        Unmap();
+        return;
+    }
+
+    Generation = header.Generation + 1;
+    IndexOffset = header.IndexOffset;
+    const uint8_t* index = Mapping + IndexOffset;
+    for (uint64_t i = 0; i < header.EntryCount; i++)
+    {
+        CArchiveIndexEntry stored;
+        memcpy(&stored, index + i * sizeof(stored), sizeof(stored));
+        // Written so it cannot overflow, whatever a damaged index holds
+        if (stored.Offset < sizeof(CArchiveHeader) || stored.Offset > IndexOffset
+            || stored.Size > IndexOffset - stored.Offset || stored.Size % sizeof(uint32_t) != 0)
+            continue;
+
+        CEntry& entry = Entries[stored.Key];
+        entry.Offset = stored.Offset;
+        entry.Size = stored.Size;
+        entry.IndexSlot = static_cast<uint32_t>(i);
+        entry.LastUse = stored.LastUse;
+    }
+}
+
+void CSPIRVArchive::Close()
+{
+    Save();
+
+    std::lock_guard<std::mutex> lk(Mutex);
+    Unmap();
+    Entries.clear();
+    Path.clear();
+}
+
+void CSPIRVArchive::Unmap()
+{
+    if (Mapping)
+        munmap(const_cast<uint8_t*>(Mapping), MappingSize);
+    Mapping = nullptr;
+    MappingSize = 0;
+    IndexOffset = 0;
+}
+
+bool CSPIRVArchive::Find(uint64_t key, std::vector<uint32_t>& spirv)
+{
+    std::lock_guard<std::mutex> lk(Mutex);
+    auto iter = Entries.find(key);
+    if (iter == Entries.end())
+    {
+        MissCount++;
+        return false;
+    }
+
+    CEntry& entry = iter->second;
+    if (entry.Added.empty())
+    {
+        spirv.resize(entry.Size / sizeof(uint32_t));
+        memcpy(spirv.data(), Mapping + entry.Offset, entry.Size);
+    }
+    else
+        spirv = entry.Added;
+
+    if (entry.LastUse != Generation)
+    {
+        entry.LastUse = Generation;
+        bTouched = true;
+    }
+    HitCount++;
+    return true;
+}
+
+void CSPIRVArchive::Insert(uint64_t key, std::vector<uint32_t> spirv)
+{
+    std::lock_guard<std::mutex> lk(Mutex);
+    CEntry& entry = Entries[key];
+    entry.Size = static_cast<uint32_t>(spirv.size() * sizeof(uint32_t));
+    entry.IndexSlot = UINT32_MAX;
+    entry.LastUse = Generation;
+    entry.Added = std::move(spirv);
+    bAdded = true;
+}
+
+bool CSPIRVArchive::Save()
+{
+    std::lock_guard<std::mutex> lk(Mutex);
+    if (Path.empty() || (!bAdded && !bTouched))
+        return true;
+    if (!bAdded)
+        return SaveLastUse();
+
+    // Most recently used first, whatever does not fit the budget is evicted
+    std::vector<std::pair<uint64_t, const CEntry*>> order;
+    order.reserve(Entries.size());
+    for (const auto& pair : Entries)
+        order.emplace_back(pair.first, &pair.second);
+    std::sort(order.begin(), order.end(), [](const auto& a, const auto& b) {
+        return a.second->LastUse > b.second->LastUse;
+    });
+
+    std::string tempPath = Path + ".tmp";
+    std::ofstream ofs(tempPath, std::ios::binary | std::ios::trunc);
+    if (!ofs)
+        return false;
+
+    CArchiveHeader header {};
+    ofs.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+    std::vector<CArchiveIndexEntry> index;
+    uint64_t offset = sizeof(header);
+    for (const auto& pair : order)
+    {
+        const CEntry& entry = *pair.second;
+        if (offset + entry.Size + (index.size() + 1) * sizeof(CArchiveIndexEntry) > MaxSize
+            && !index.empty())
+            break;
+
+        const char* data = entry.Added.empty()
+            ? reinterpret_cast<const char*>(Mapping + entry.Offset)
+            : reinterpret_cast<const char*>(entry.Added.data());
+        ofs.write(data, entry.Size);
+
+        CArchiveIndexEntry stored {};
+        stored.Key = pair.first;
+        stored.Offset = offset;
+        stored.Size = entry.Size;
+        stored.LastUse = entry.LastUse;
+        index.push_back(stored);
+        offset += entry.Size;
+    }
+    if (index.size() < order.size())
+        printf("SPIR-V archive over budget, evicted %zu modules\n", order.size() - index.size());
+
+    ofs.write(reinterpret_cast<const char*>(index.data()),
+              index.size() * sizeof(CArchiveIndexEntry));
+
+    memcpy(header.Magic, ArchiveMagic, 4);
+    header.Version = ArchiveVersion;
+    header.Generation = Generation;
+    header.EntryCount = index.size();
+    header.IndexOffset = offset;
+    ofs.seekp(0);
+    ofs.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    ofs.close();
+    if (!ofs || std::rename(tempPath.c_str(), Path.c_str()) != 0)
+    {
+        std::remove(tempPath.c_str());
+        return false;
+    }
+
+    // This run's state is on disk now. Slots of the mapped index no longer match the file, so
+    // later touches only reach the disk together with the next full save.
+    for (auto& pair : Entries)
+        pair.second.IndexSlot = UINT32_MAX;
+    bAdded = false;
+    bTouched = false;
+    return true;
+}
+
+bool CSPIRVArchive::SaveLastUse()
+{
+    // Only the stamps change, so patch them in place rather than rewriting every module. A torn
+    // write leaves a stale stamp behind at worst.
+    std::fstream fs(Path, std::ios::binary | std::ios::in | std::ios::out);
+    if (!fs)
+        return false;
+
+    // Another process may have replaced the file since it was mapped
+    CArchiveHeader header;
+    if (!fs.read(reinterpret_cast<char*>(&header), sizeof(header)) || !Mapping
+        || memcmp(&header, Mapping, sizeof(header)) != 0)
+        return false;
+
+    for (const auto& pair : Entries)
+    {
+        const CEntry& entry = pair.second;
+        if (entry.LastUse != Generation || entry.IndexSlot == UINT32_MAX)
+            continue;
+        fs.seekp(IndexOffset + entry.IndexSlot * sizeof(CArchiveIndexEntry)
+                 + offsetof(CArchiveIndexEntry, LastUse));
+        fs.write(reinterpret_cast<const char*>(&entry.LastUse), sizeof(entry.LastUse));
+    }
+    fs.seekp(offsetof(CArchiveHeader, Generation));
+    fs.write(reinterpret_cast<const char*>(&Generation), sizeof(Generation));
+    bTouched = false;
+    return static_cast<bool>(fs);
+}
+
+}
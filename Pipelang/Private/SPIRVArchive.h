@@ -0,0 +1,71 @@
+#pragma once
+#include <LangUtils.h>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace Pl
+{
+
+// SPIR-V compiled by earlier runs, addressed by a hash of everything that went into the compile.
+//
+// Everything lives in one file, memory mapped on open: a header, the modules back to back, and an
+// index at the end. Modules compiled this run are kept in memory until Save, which writes a new
+// archive next to the old one and renames it over, so a reader never sees a half written file.
+// Once the archive outgrows its budget the modules used least recently are left out.
+class CSPIRVArchive : public tc::FNonCopyable
+{
+public:
+    static const size_t DefaultMaxSize = 64 * 1024 * 1024;
+
+    ~CSPIRVArchive();
+
+    // A missing or unreadable file just starts an empty archive
+    void Open(const std::string& path, size_t maxSize = DefaultMaxSize);
+    // Saves and unmaps
+    void Close();
+    bool Save();
+
+    bool Find(uint64_t key, std::vector<uint32_t>& spirv);
+    void Insert(uint64_t key, std::vector<uint32_t> spirv);
+
+    uint32_t GetHitCount() const { return HitCount; }
+    uint32_t GetMissCount() const { return MissCount; }
+
+private:
+    struct CEntry
+    {
+        // Byte offset into the mapping, unless the module was added this run
+        uint64_t Offset = 0;
+        uint32_t Size = 0;
+        // Position in the index of the mapped file, for touching it in place
+        uint32_t IndexSlot = UINT32_MAX;
+        uint64_t LastUse = 0;
+        std::vector<uint32_t> Added;
+    };
+
+    void Unmap();
+    // Writes back only the use stamps of entries found this run
+    bool SaveLastUse();
+
+    std::mutex Mutex;
+    std::string Path;
+    size_t MaxSize = DefaultMaxSize;
+
+    const uint8_t* Mapping = nullptr;
+    size_t MappingSize = 0;
+    uint64_t IndexOffset = 0;
+
+    // Bumped once per run, entries remember the run they were last used in
+    uint64_t Generation = 0;
+    std::unordered_map<uint64_t, CEntry> Entries;
+    bool bAdded = false;
+    bool bTouched = false;
+
+    uint32_t HitCount = 0;
+    uint32_t MissCount = 0;
+};
+
+}
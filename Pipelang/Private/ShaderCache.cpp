@@ -1,8 +1,20 @@
 #include "ShaderCache.h"
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <string_view>
+#include <unordered_map>
 
 namespace Pl
 {
 
+static std::shared_future<RHI::CShaderModule::Ref> MakeReady(RHI::CShaderModule::Ref shader)
+{
+    std::promise<RHI::CShaderModule::Ref> ready;
+    ready.set_value(std::move(shader));
+    return ready.get_future().share();
+}
+
 const RHI::CDevice::Ref& CShaderCache::GetDevice() const
 {
     return Device;
@@ -13,39 +25,297 @@ void CShaderCache::SetDevice(const RHI::CDevice::Ref& device)
     Device = device;
 }
 
-void CShaderCache::InsertShader(const std::string& key, RHI::CShaderModule::Ref shaderModule)
+void CShaderCache::OpenArchive(const std::string& path, size_t maxSize)
 {
     std::lock_guard<std::mutex> lk(ShaderCacheMutex);
+    Archive.Open(path, maxSize);
+    bArchiveOpen = true;
+}
 
+bool CShaderCache::GetCompileInfo(CHashId key, CShaderCompileInfo& info)
+{
+    std::lock_guard<std::mutex> lk(ShaderCacheMutex);
+    auto iter = CompileInfo.find(key);
+    if (iter == CompileInfo.end())
+        return false;
+    info = iter->second;
+    return true;
+}
+
+void CShaderCache::InsertShader(CHashId key, RHI::CShaderModule::Ref shaderModule)
+{
     assert(shaderModule);
-    ShaderHashMap[key] = shaderModule;
+    ShaderHashMap.Assign(key, std::move(shaderModule));
 }
 
-RHI::CShaderModule::Ref CShaderCache::RetrieveShader(const std::string& key)
+RHI::CShaderModule::Ref CShaderCache::RetrieveShader(CHashId key) const
 {
-    auto iter = ShaderHashMap.find(key);
-    if (iter == ShaderHashMap.end())
-        return nullptr;
-    return iter->second;
+    const RHI::CShaderModule::Ref* shader = ShaderHashMap.Find(key);
+    return shader ? *shader : nullptr;
 }
 
-RHI::CShaderModule::Ref CShaderCache::RetrieveOrCompileShader(const std::string& key,
+RHI::CShaderModule::Ref CShaderCache::RetrieveOrCompileShader(CHashId key,
                                                               CShaderCompileEnvironment env)
 {
-    auto iter = ShaderHashMap.find(key);
-    if (iter != ShaderHashMap.end())
-        return iter->second;
+    return CompileShaderAsync(key, std::move(env)).get();
+}
 
-    std::lock_guard<std::mutex> lk(ShaderCacheMutex);
+std::shared_future<RHI::CShaderModule::Ref>
+CShaderCache::CompileShaderAsync(CHashId key, CShaderCompileEnvironment env)
+{
+    // Cached modules never wait for the mutex. A compile finishing between this lookup and the one
+    // under the mutex is caught by the second.
+    if (RHI::CShaderModule::Ref shader = RetrieveShader(key))
+        return MakeReady(std::move(shader));
+
+    const std::string& sourceName = env.GetSourceName();
+    std::string outputPath = sourceName.substr(0, sourceName.rfind('.')) + ".spv";
+    bool bKeepSPIRV = env.bKeepSPIRV;
     CShaderCompileWorker worker(std::move(env));
-    worker.SetOutputPath(key + ".spv");
-    auto shader = worker.Compile(Device);
-    if (!shader)
+    worker.SetOutputPath(std::move(outputPath));
+    // Reads the includes, so better outside the lock
+    uint64_t sourceHash = worker.GetContentHash();
+
+    std::lock_guard<std::mutex> lk(ShaderCacheMutex);
+    if (RHI::CShaderModule::Ref shader = RetrieveShader(key))
+        return MakeReady(std::move(shader));
+
+    auto inFlight = InFlight.find(key);
+    if (inFlight != InFlight.end())
+        return inFlight->second;
+
+    DedupeStats.Requests++;
+    auto source = Sources.find(sourceHash);
+    if (source != Sources.end())
     {
+        CSourceEntry& entry = source->second;
+        DedupeStats.SourceHits++;
+        if (!entry.Shader)
+        {
+            entry.Keys.push_back(key);
+            return InFlight.emplace(key, entry.Module).first->second;
+        }
+        DedupeStats.SavedBytes += entry.Info.SPIRVSize;
+        CompileInfo[key] = entry.Info;
+        ShaderHashMap.Assign(key, entry.Shader);
+        return MakeReady(entry.Shader);
+    }
+
+    // The task publishes its result under the mutex, which is held until it is registered here.
+    // The archive is picked here as well, OpenArchive changes it under the mutex.
+    CSPIRVArchive* archive = bArchiveOpen ? &Archive : nullptr;
+    auto future = CompilePool.Submit([this, sourceHash, bKeepSPIRV, archive,
+                                      worker = std::move(worker)]() mutable {
+        auto start = std::chrono::steady_clock::now();
+        std::vector<uint32_t> spirv;
+        RHI::CShaderModule::Ref shader;
+        if (worker.CompileSPIRV(spirv, archive))
+            shader = FindOrCreateModule(spirv);
+        if (shader && bKeepSPIRV)
+            KeepSPIRV(shader, std::move(spirv));
+
+        CShaderCompileInfo info;
+        info.SPIRVSize = worker.GetSPIRVSize();
+        info.Milliseconds = std::chrono::duration<float, std::milli>(
+                                std::chrono::steady_clock::now() - start)
+                                .count();
+        info.bFromArchive = worker.IsFromArchive();
+
+        std::lock_guard<std::mutex> lk(ShaderCacheMutex);
+        CSourceEntry& entry = Sources[sourceHash];
+        for (CHashId waiting : entry.Keys)
+        {
+            if (shader)
+            {
+                CompileInfo[waiting] = info;
+                ShaderHashMap.Assign(waiting, shader);
+            }
+            InFlight.erase(waiting);
+        }
+        if (shader)
+        {
+            DedupeStats.SavedBytes += (entry.Keys.size() - 1) * uint64_t(info.SPIRVSize);
+            entry.Keys.clear();
+            entry.Shader = shader;
+            entry.Info = info;
+        }
+        else
+            // Forget the failure so that a later request tries again
+            Sources.erase(sourceHash);
+        return shader;
+    });
+
+    CSourceEntry& entry = Sources[sourceHash];
+    entry.Module = future.share();
+    entry.Keys.push_back(key);
+    return InFlight.emplace(key, entry.Module).first->second;
+}
+
+RHI::CShaderModule::Ref CShaderCache::FindOrCreateModule(const std::vector<uint32_t>& spirv)
+{
+    std::string_view code(reinterpret_cast<const char*>(spirv.data()),
+                          spirv.size() * sizeof(uint32_t));
+    uint64_t hash = std::hash<std::string_view>()(code);
+    {
+        std::lock_guard<std::mutex> lk(ShaderCacheMutex);
+        auto iter = Modules.find(hash);
+        if (iter != Modules.end() && iter->second.Code == spirv)
+        {
+            DedupeStats.SPIRVHits++;
+            DedupeStats.SavedBytes += code.size();
+            return iter->second.Shader;
+        }
+    }
+
+    // Outside the lock, other compiles keep publishing while the driver works
+    RHI::CShaderModule::Ref shader = Device->CreateShaderModule(code.size(), code.data());
+    if (!shader)
         return nullptr;
+
+    std::lock_guard<std::mutex> lk(ShaderCacheMutex);
+    auto result = Modules.emplace(hash, CModuleEntry { shader, spirv });
+    if (!result.second)
+    {
+        // Another compile got there first, or a hash collision which keeps its own module
+        if (result.first->second.Code != spirv)
+            return shader;
+        DedupeStats.SPIRVHits++;
+        DedupeStats.SavedBytes += code.size();
+        return result.first->second.Shader;
     }
-    ShaderHashMap[key] = shader;
+    DedupeStats.Modules++;
+    DedupeStats.ModuleBytes += code.size();
     return shader;
 }
 
+void CShaderCache::KeepSPIRV(const RHI::CShaderModule::Ref& shader, std::vector<uint32_t> spirv)
+{
+    auto kept = std::make_shared<const std::vector<uint32_t>>(std::move(spirv));
+    std::lock_guard<std::mutex> lk(ShaderCacheMutex);
+    KeptSPIRV.emplace(shader.get(), std::move(kept));
+}
+
+// Rewrites the defaults of the specialization constants in place. Decorations come before the
+// constants in a module, so one pass finds the SpecId of each constant before reaching it.
+static void PatchSpecializationConstants(std::vector<uint32_t>& spirv,
+                                         const std::vector<CSpecializationConstant>& constants)
+{
+    const uint32_t OpDecorate = 71;
+    const uint32_t OpSpecConstantTrue = 48;
+    const uint32_t OpSpecConstantFalse = 49;
+    const uint32_t OpSpecConstant = 50;
+    const uint32_t DecorationSpecId = 1;
+    const size_t HeaderWords = 5;
+
+    // Result id to the value it gets
+    std::unordered_map<uint32_t, uint32_t> values;
+    for (size_t i = HeaderWords; i < spirv.size();)
+    {
+        uint32_t wordCount = spirv[i] >> 16;
+        uint32_t opcode = spirv[i] & 0xffff;
+        if (wordCount == 0 || i + wordCount > spirv.size())
+            break;
+
+        if (opcode == OpDecorate && wordCount == 4 && spirv[i + 2] == DecorationSpecId)
+        {
+            for (const CSpecializationConstant& constant : constants)
+                if (constant.Id == spirv[i + 3])
+                    values[spirv[i + 1]] = constant.Value;
+        }
+        else if (opcode == OpSpecConstantTrue || opcode == OpSpecConstantFalse)
+        {
+            auto iter = values.find(spirv[i + 2]);
+            if (iter != values.end())
+                spirv[i] = (wordCount << 16)
+                    | (iter->second ? OpSpecConstantTrue : OpSpecConstantFalse);
+        }
+        // Only 32 bit scalars, wider ones keep their default
+        else if (opcode == OpSpecConstant && wordCount == 4)
+        {
+            auto iter = values.find(spirv[i + 2]);
+            if (iter != values.end())
+                spirv[i + 3] = iter->second;
+        }
+        i += wordCount;
+    }
+}
+
+RHI::CShaderModule::Ref
+CShaderCache::SpecializeShader(CHashId key, const RHI::CShaderModule::Ref& base,
+                               const std::vector<CSpecializationConstant>& constants)
+{
+    std::shared_ptr<const std::vector<uint32_t>> kept;
+    {
+        std::lock_guard<std::mutex> lk(ShaderCacheMutex);
+        auto iter = KeptSPIRV.find(base.get());
+        if (iter == KeptSPIRV.end())
+            return nullptr;
+        kept = iter->second;
+    }
+
+    std::vector<uint32_t> spirv = *kept;
+    PatchSpecializationConstants(spirv, constants);
+    // Variants with the same values as another, or as the defaults, share its module
+    RHI::CShaderModule::Ref shader = FindOrCreateModule(spirv);
+    if (shader)
+        ShaderHashMap.Assign(key, shader);
+    return shader;
+}
+
+CShaderDedupeStats CShaderCache::GetDedupeStats()
+{
+    std::lock_guard<std::mutex> lk(ShaderCacheMutex);
+    return DedupeStats;
+}
+
+std::shared_future<RHI::CShaderModule::Ref>
+CShaderCache::CompileUncachedAsync(CShaderCompileEnvironment env, std::string outputPath,
+                                   bool bKeepOutput)
+{
+    std::lock_guard<std::mutex> lk(ShaderCacheMutex);
+    CSPIRVArchive* archive = bArchiveOpen ? &Archive : nullptr;
+    // Compiles of the same file can overlap when it is edited again, each one writes its own temp
+    // file and only the latest renames it over the output
+    uint64_t generation = bKeepOutput ? ++KeptOutputGenerations[outputPath] : 0;
+    auto future = CompilePool.Submit(
+        [this, archive, env = std::move(env), outputPath, bKeepOutput, generation]() mutable {
+            bool bKeepSPIRV = env.bKeepSPIRV;
+            std::string tempPath = outputPath + "." + std::to_string(generation) + ".tmp";
+            CShaderCompileWorker worker(std::move(env));
+            worker.SetOutputPath(bKeepOutput ? tempPath : outputPath);
+
+            std::vector<uint32_t> spirv;
+            if (!worker.CompileSPIRV(spirv, archive))
+                return RHI::CShaderModule::Ref();
+            if (bKeepOutput)
+                PublishKeptOutput(outputPath, tempPath, generation, spirv);
+            RHI::CShaderModule::Ref shader = Device->CreateShaderModule(
+                spirv.size() * sizeof(uint32_t), spirv.data());
+            if (shader && bKeepSPIRV)
+                KeepSPIRV(shader, std::move(spirv));
+            return shader;
+        });
+    return future.share();
+}
+
+void CShaderCache::PublishKeptOutput(const std::string& path, const std::string& tempPath,
+                                     uint64_t generation, const std::vector<uint32_t>& spirv)
+{
+    {
+        std::ofstream ofs(tempPath, std::ios::binary | std::ios::trunc);
+        ofs.write(reinterpret_cast<const char*>(spirv.data()), spirv.size() * sizeof(uint32_t));
+        if (!ofs)
+        {
+            std::remove(tempPath.c_str());
+            return;
+        }
+    }
+
+    // Checked and renamed under the mutex, so no newer compile registers in between
+    std::lock_guard<std::mutex> lk(ShaderCacheMutex);
+    if (KeptOutputGenerations[path] != generation
+        || std::rename(tempPath.c_str(), path.c_str()) != 0)
+        std::remove(tempPath.c_str());
+}
+
 }
@@ -1,7 +1,13 @@
 #pragma once
+#include "CompileThreadPool.h"
+#include "HashId.h"
+#include "HashIdMap.h"
+#include "Pipelang.h"
+#include "SPIRVArchive.h"
 #include "ShaderCompileWorker.h"
 #include <LangUtils.h>
 #include <ShaderModule.h>
+#include <future>
 #include <mutex>
 #include <unordered_map>
 #include <Device.h>
@@ -9,22 +15,114 @@
 namespace Pl
 {
 
+struct CShaderCompileInfo
+{
+    uint32_t SPIRVSize = 0;
+    float Milliseconds = 0.0f;
+    bool bFromArchive = false;
+};
+
+// Value for the specialization constant with constant_id Id, the bits of a 32 bit scalar
+struct CSpecializationConstant
+{
+    uint32_t Id = 0;
+    uint32_t Value = 0;
+};
+
 class CShaderCache : public tc::FNonCopyable
 {
 public:
     const RHI::CDevice::Ref& GetDevice() const;
     void SetDevice(const RHI::CDevice::Ref& device);
 
-    void InsertShader(const std::string& key, RHI::CShaderModule::Ref shaderModule);
-    RHI::CShaderModule::Ref RetrieveShader(const std::string& key);
-    RHI::CShaderModule::Ref RetrieveOrCompileShader(const std::string& key,
-                                                    CShaderCompileEnvironment env);
+    void InsertShader(CHashId key, RHI::CShaderModule::Ref shaderModule);
+    // Wait-free, safe to call from any number of threads while others insert or compile
+    RHI::CShaderModule::Ref RetrieveShader(CHashId key) const;
+    // Without shaderc the SPIR-V is written next to env.GetSourceName()
+    RHI::CShaderModule::Ref RetrieveOrCompileShader(CHashId key, CShaderCompileEnvironment env);
+    // Starts compiling on the compile pool and returns right away. A key that is cached or already
+    // being compiled shares the existing result instead of compiling again. So does a key whose
+    // source matches one compiled before, and a compile whose SPIR-V matches an existing module
+    // shares that module.
+    std::shared_future<RHI::CShaderModule::Ref> CompileShaderAsync(CHashId key,
+                                                                   CShaderCompileEnvironment env);
+
+    // Compiles on the pool without looking at or adding to the cache, to replace a module with
+    // InsertShader once it is done. With bKeepOutput the SPIR-V is also written to outputPath,
+    // unless a later call for the same outputPath started meanwhile.
+    std::shared_future<RHI::CShaderModule::Ref>
+    CompileUncachedAsync(CShaderCompileEnvironment env, std::string outputPath,
+                         bool bKeepOutput = false);
+
+    // Creates the variant of base with the specialization constants set to other defaults, by
+    // patching its SPIR-V, and inserts it under key. The compile of base must have asked to keep
+    // the SPIR-V, returns null otherwise.
+    RHI::CShaderModule::Ref
+    SpecializeShader(CHashId key, const RHI::CShaderModule::Ref& base,
+                     const std::vector<CSpecializationConstant>& constants);
+
+    // Frees the modules InsertShader replaced at least graceFrames frames ago
+    void FreeRetired(uint64_t frame, uint64_t graceFrames)
+    {
+        ShaderHashMap.FreeRetired(frame, graceFrames);
+    }
+
+    uint32_t GetCompileThreadCount() const { return CompilePool.GetThreadCount(); }
+
+    // How the module for key was produced, false if it was not compiled through this cache
+    bool GetCompileInfo(CHashId key, CShaderCompileInfo& info);
+    CShaderDedupeStats GetDedupeStats();
+
+    // Compiles look up and store their SPIR-V in the archive at path from now on
+    void OpenArchive(const std::string& path, size_t maxSize = CSPIRVArchive::DefaultMaxSize);
+    CSPIRVArchive& GetArchive() { return Archive; }
 
 private:
+    // A module shared by every key whose source has the same content hash
+    struct CSourceEntry
+    {
+        std::shared_future<RHI::CShaderModule::Ref> Module;
+        // Keys waiting for the compile, published together once it is done
+        std::vector<CHashId> Keys;
+        RHI::CShaderModule::Ref Shader;
+        CShaderCompileInfo Info;
+    };
+
+    struct CModuleEntry
+    {
+        RHI::CShaderModule::Ref Shader;
+        // Compared before a module is shared, equal hashes alone do not make equal code
+        std::vector<uint32_t> Code;
+    };
+
+    // Creates a module for the SPIR-V, unless one with the same code already exists
+    RHI::CShaderModule::Ref FindOrCreateModule(const std::vector<uint32_t>& spirv);
+    void KeepSPIRV(const RHI::CShaderModule::Ref& shader, std::vector<uint32_t> spirv);
+    // Renames tempPath over path if generation is still the latest for path, removes it otherwise
+    void PublishKeptOutput(const std::string& path, const std::string& tempPath,
+                           uint64_t generation, const std::vector<uint32_t>& spirv);
+
+    // Guards everything but ShaderHashMap, which readers look up without taking it
     std::mutex ShaderCacheMutex;
     RHI::CDevice::Ref Device;
-    std::unordered_map<std::string, RHI::CShaderModule::Ref> ShaderHashMap;
-    std::unordered_map<std::string, uint64_t> LastCompileTimestamp;
+    CHashIdMap<RHI::CShaderModule::Ref> ShaderHashMap;
+    std::unordered_map<CHashId, std::shared_future<RHI::CShaderModule::Ref>> InFlight;
+    std::unordered_map<CHashId, CShaderCompileInfo> CompileInfo;
+    // By content hash, see CShaderCompileWorker::GetContentHash
+    std::unordered_map<uint64_t, CSourceEntry> Sources;
+    // By a hash of the code
+    std::unordered_map<uint64_t, CModuleEntry> Modules;
+    // SPIR-V of the modules that can be specialized
+    std::unordered_map<const RHI::CShaderModule*, std::shared_ptr<const std::vector<uint32_t>>>
+        KeptSPIRV;
+    // Output path of CompileUncachedAsync to the generation of its latest compile
+    std::unordered_map<std::string, uint64_t> KeptOutputGenerations;
+    CShaderDedupeStats DedupeStats;
+    CSPIRVArchive Archive;
+    bool bArchiveOpen = false;
+
+    // Last, so its threads are joined before anything they touch is destroyed
+    CCompileThreadPool CompilePool;
 };
 
 }
@@ -1,7 +1,19 @@
 #include "ShaderCompileWorker.h"
+#include "CompileThreadPool.h"
+#include "HashId.h"
+#include "SPIRVArchive.h"
+#include "ShaderDependencies.h"
+#include <cstdio>
+#include <set>
 #include <fstream>
 #include <sstream>
 
+#ifdef PIPELANG_HAS_SHADERC
+#include <shaderc/shaderc.hpp>
+#else
+#include <filesystem>
+#endif
+
 namespace Pl
 {
 
@@ -10,35 +22,274 @@ CShaderCompileWorker::CShaderCompileWorker(CShaderCompileEnvironment env)
 {
 }
 
-RHI::CShaderModule::Ref CShaderCompileWorker::Compile(const RHI::CDevice::Ref& device)
+std::string CShaderCompileWorker::LoadSource() const
+{
+    std::string sourceStr = CompileEnv.MainSource;
+    if (sourceStr.empty())
+    {
+        std::ifstream sourceFile(CompileEnv.MainSourcePath);
+        sourceStr.assign((std::istreambuf_iterator<char>(sourceFile)),
+                         std::istreambuf_iterator<char>());
+    }
+
+    for (const auto& pair : CompileEnv.StrReplaces)
+    {
+        std::string::size_type pos = 0u;
+        while ((pos = sourceStr.find(pair.first, pos)) != std::string::npos)
+        {
+            sourceStr.replace(pos, pair.first.length(), pair.second);
+            pos += pair.second.length();
+        }
+    }
+    return sourceStr;
+}
+
+uint64_t CShaderCompileWorker::GetContentHash()
+{
+    if (!ContentHash)
+        ContentHash = ComputeContentHash(LoadSource());
+    return ContentHash;
+}
+
+bool CShaderCompileWorker::CompileSPIRV(std::vector<uint32_t>& spirv, CSPIRVArchive* archive)
 {
     assert(!CompileEnv.ShaderStage.empty());
 
-    if (!CompileEnv.StrReplaces.empty())
+    std::string sourceStr = LoadSource();
+    if (archive && !ContentHash)
+        ContentHash = ComputeContentHash(sourceStr);
+    bFromArchive = archive && archive->Find(ContentHash, spirv);
+    if (!bFromArchive)
     {
-        std::ifstream sourceFile(CompileEnv.MainSourcePath);
-        std::string sourceStr((std::istreambuf_iterator<char>(sourceFile)),
-                              std::istreambuf_iterator<char>());
+        if (!CompileToSPIRV(sourceStr, spirv))
+            return false;
+        if (archive)
+            archive->Insert(ContentHash, spirv);
+    }
+    SPIRVSize = static_cast<uint32_t>(spirv.size() * sizeof(uint32_t));
+    return true;
+}
 
-        for (const auto& pair : CompileEnv.StrReplaces)
+RHI::CShaderModule::Ref CShaderCompileWorker::Compile(const RHI::CDevice::Ref& device,
+                                                      CSPIRVArchive* archive)
+{
+    std::vector<uint32_t> spirv;
+    if (!CompileSPIRV(spirv, archive))
+        return nullptr;
+    return device->CreateShaderModule(spirv.size() * sizeof(uint32_t),
+                                      reinterpret_cast<char*>(spirv.data()));
+}
+
+std::future<RHI::CShaderModule::Ref>
+CShaderCompileWorker::CompileAsync(const RHI::CDevice::Ref& device, CCompileThreadPool& pool) const
+{
+    return pool.Submit([worker = *this, device]() mutable { return worker.Compile(device); });
+}
+
+// Names the build of the compiler, so that SPIR-V from an older compiler is not served after an
+// upgrade. CMake identifies the shaderc library it links, glslc is asked at runtime since it is
+// whichever one is on the PATH.
+static const std::string& GetCompilerIdentity()
+{
+#ifdef PIPELANG_HAS_SHADERC
+    static const std::string identity = std::string("shaderc ") + PIPELANG_SHADERC_ID;
+#else
+    static const std::string identity = []() {
+        std::string version = "glslc ";
+        if (FILE* pipe = popen("glslc --version", "r"))
+        {
+            char buffer[256];
+            size_t size;
+            while ((size = fread(buffer, 1, sizeof(buffer), pipe)) > 0)
+                version.append(buffer, size);
+            pclose(pipe);
+        }
+        return version;
+    }();
+#endif
+    return identity;
+}
+
+uint64_t CShaderCompileWorker::ComputeContentHash(const std::string& source) const
+{
+    CHashId hash = CHashId().Append(GetCompilerIdentity());
+#ifdef DEBUG
+    hash = hash.Append("-g -O0");
+#else
+    hash = hash.Append("-O");
+#endif
+    hash = hash.Append(CompileEnv.ShaderStage);
+    for (const auto& pair : CompileEnv.Definitions)
+        hash = hash.Append(pair.first).Append(pair.second);
+    hash = hash.Append(source);
+
+    // Every file reachable through #include, each one once. Files are resolved the way the
+    // compiler resolves them and keyed by their path, so that headers of the same name in
+    // different dirs count separately.
+    std::set<std::string> visited;
+    std::vector<std::pair<std::string, std::string>> pending = {
+        { CompileEnv.GetSourceName(), source }
+    };
+    while (!pending.empty())
+    {
+        std::string includer = std::move(pending.back().first);
+        std::istringstream lines(std::move(pending.back().second));
+        pending.pop_back();
+        std::string line, name;
+        while (std::getline(lines, line))
         {
-            std::string::size_type pos = 0u;
-            while ((pos = sourceStr.find(pair.first, pos)) != std::string::npos)
+            if (!ParseIncludeLine(line, name))
+                continue;
+
+            std::string path, content;
+            auto iter = CompileEnv.IncludeSources.find(name);
+            if (iter != CompileEnv.IncludeSources.end())
             {
-                sourceStr.replace(pos, pair.first.length(), pair.second);
-                pos += pair.second.length();
+                path = name;
+                content = iter->second;
             }
+            else
+            {
+                path = ResolveInclude(includer, name, CompileEnv.IncludeDirs);
+                // Fails to compile, the name alone is enough to tell it apart
+                if (path.empty())
+                {
+                    hash = hash.Append(name);
+                    continue;
+                }
+                std::ifstream file(path);
+                content.assign((std::istreambuf_iterator<char>(file)),
+                               std::istreambuf_iterator<char>());
+            }
+            if (!visited.insert(path).second)
+                continue;
+            hash = hash.Append(path).Append(content);
+            pending.emplace_back(std::move(path), std::move(content));
         }
+    }
+    return hash.GetValue();
+}
+
+#ifdef PIPELANG_HAS_SHADERC
+
+// Serves #include from the environment's in-memory sources first, then through ResolveInclude
+class CIncluder : public shaderc::CompileOptions::IncluderInterface
+{
+public:
+    explicit CIncluder(const CShaderCompileEnvironment& env)
+        : Env(env)
+    {
+    }
+
+    shaderc_include_result* GetInclude(const char* requestedSource, shaderc_include_type type,
+                                       const char* requestingSource, size_t includeDepth) override
+    {
+        auto* result = new CResult();
+        auto iter = Env.IncludeSources.find(requestedSource);
+        if (iter != Env.IncludeSources.end())
+        {
+            result->Name = requestedSource;
+            result->Content = iter->second;
+        }
+        else
+        {
+            // Resolved like ComputeContentHash does, so the hash covers exactly these files
+            result->Name = ResolveInclude(requestingSource, requestedSource, Env.IncludeDirs);
+            std::ifstream file(result->Name);
+            if (!result->Name.empty() && file)
+                result->Content.assign((std::istreambuf_iterator<char>(file)),
+                                       std::istreambuf_iterator<char>());
+            // An empty name tells shaderc the include failed, the content is the message
+            else
+            {
+                result->Name.clear();
+                result->Content = std::string("Cannot find include ") + requestedSource;
+            }
+        }
+
+        result->source_name = result->Name.data();
+        result->source_name_length = result->Name.size();
+        result->content = result->Content.data();
+        result->content_length = result->Content.size();
+        result->user_data = nullptr;
+        return result;
+    }
+
+    void ReleaseInclude(shaderc_include_result* data) override
+    {
+        delete static_cast<CResult*>(data);
+    }
+
+private:
+    struct CResult : shaderc_include_result
+    {
+        std::string Name;
+        std::string Content;
+    };
+
+    const CShaderCompileEnvironment& Env;
+};
 
-        std::ofstream tempSrc("temp.glsl", std::ios ::out);
-        tempSrc << sourceStr;
-        tempSrc.close();
-        CompileEnv.MainSourcePath = "temp.glsl";
+bool CShaderCompileWorker::CompileToSPIRV(const std::string& source,
+                                          std::vector<uint32_t>& spirv) const
+{
+    static const std::map<std::string, shaderc_shader_kind> kindMap = {
+        { "vertex", shaderc_vertex_shader },
+        { "tesscontrol", shaderc_tess_control_shader },
+        { "tesseval", shaderc_tess_evaluation_shader },
+        { "geometry", shaderc_geometry_shader },
+        { "fragment", shaderc_fragment_shader },
+        { "compute", shaderc_compute_shader },
+    };
+
+    shaderc::CompileOptions options;
+#ifdef DEBUG
+    options.SetGenerateDebugInfo();
+    options.SetOptimizationLevel(shaderc_optimization_level_zero);
+#else
+    options.SetOptimizationLevel(shaderc_optimization_level_performance);
+#endif
+    for (const auto& pair : CompileEnv.Definitions)
+        options.AddMacroDefinition(pair.first, pair.second);
+    options.SetIncluder(std::make_unique<CIncluder>(CompileEnv));
+
+    // The compiler object is cheap to create and not meant to be shared between threads
+    shaderc::Compiler compiler;
+    auto result = compiler.CompileGlslToSpv(source, kindMap.at(CompileEnv.ShaderStage),
+                                            CompileEnv.GetSourceName().c_str(), options);
+    if (result.GetCompilationStatus() != shaderc_compilation_status_success)
+    {
+        fprintf(stderr, "%s\n", result.GetErrorMessage().c_str());
+        return false;
+    }
+    spirv.assign(result.cbegin(), result.cend());
+    return true;
+}
+
+#else
+
+bool CShaderCompileWorker::CompileToSPIRV(const std::string& source,
+                                          std::vector<uint32_t>& spirv) const
+{
+    // Without shaderc the source has to go through glslc on disk, named after the output so that
+    // concurrent compiles do not overwrite each other
+    std::string sourcePath = OutputPath + ".glsl";
+    std::ofstream tempSrc(sourcePath, std::ios ::out);
+    tempSrc << source;
+    tempSrc.close();
+
+    // In-memory includes have to be on disk for glslc as well
+    std::string includeDir = OutputPath + ".inc";
+    if (!CompileEnv.IncludeSources.empty())
+    {
+        std::filesystem::create_directories(includeDir);
+        for (const auto& pair : CompileEnv.IncludeSources)
+        {
+            std::ofstream inc(includeDir + "/" + pair.first);
+            inc << pair.second;
+        }
     }
 
-    // TODO:
-    // It's better to create a RPC wrapper for glslc
-    // For now just invoke the executable and see
     std::stringstream ss;
     ss << "glslc";
 #ifdef DEBUG
@@ -47,27 +298,45 @@ RHI::CShaderModule::Ref CShaderCompileWorker::Compile(const RHI::CDevice::Ref& d
     ss << " -O";
 #endif
     ss << " -fshader-stage=" << CompileEnv.ShaderStage;
+    if (!CompileEnv.IncludeSources.empty())
+        ss << " -I" << includeDir;
     for (const auto& incDir : CompileEnv.IncludeDirs)
         ss << " -I" << incDir;
     for (const auto& pair : CompileEnv.Definitions)
         ss << " -D" << pair.first << "=" << pair.second;
-    ss << " " << CompileEnv.MainSourcePath;
+    ss << " " << sourcePath;
     ss << " -o " << OutputPath;
-    printf("Running: %s\n", ss.str().c_str());
-    std::system(ss.str().c_str());
+    ss << " 2>&1";
+
+    // Whatever an earlier run left there must not pass for the result of this one
+    std::error_code ec;
+    std::filesystem::remove(OutputPath, ec);
+
+    std::string output;
+    FILE* pipe = popen(ss.str().c_str(), "r");
+    if (!pipe)
+        return false;
+    char buffer[256];
+    size_t size;
+    while ((size = fread(buffer, 1, sizeof(buffer), pipe)) > 0)
+        output.append(buffer, size);
+    int status = pclose(pipe);
+    if (!output.empty())
+        fprintf(stderr, "%s", output.c_str());
+    if (status != 0)
+        return false;
 
     std::ifstream file(OutputPath.c_str(), std::ios::binary | std::ios::ate);
     if (!file.is_open())
-        return nullptr;
-    std::streamsize size = file.tellg();
+        return false;
+    std::streamsize fileSize = file.tellg();
     file.seekg(0, std::ios::beg);
 
-    std::vector<char> buffer(size);
-    if (file.read(buffer.data(), size))
-        return device->CreateShaderModule(buffer.size(), buffer.data());
-    return nullptr;
+    spirv.resize(fileSize / sizeof(uint32_t));
+    return fileSize > 0
+        && static_cast<bool>(file.read(reinterpret_cast<char*>(spirv.data()), fileSize));
 }
 
-std::future<RHI::CShaderModule::Ref> CShaderCompileWorker::CompileAsync() { throw "unimplemented"; }
+#endif
 
 }
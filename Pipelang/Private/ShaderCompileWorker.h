@@ -4,17 +4,35 @@
 #include <future>
 #include <map>
 #include <string>
+#include <vector>
 
 namespace Pl
 {
 
+class CCompileThreadPool;
+class CSPIRVArchive;
+
 struct CShaderCompileEnvironment
 {
+    // Either compile the file at MainSourcePath, or MainSource directly when it is not empty. In
+    // that case SourceName only names it in diagnostics and output files.
     std::string MainSourcePath;
+    std::string MainSource;
+    std::string SourceName;
     std::string ShaderStage;
     std::vector<std::string> IncludeDirs;
+    // Include name to source, looked up before IncludeDirs
+    std::map<std::string, std::string> IncludeSources;
     std::map<std::string, std::string> Definitions;
     std::map<std::string, std::string> StrReplaces;
+    // Keep the SPIR-V in memory, for CShaderCache::SpecializeShader to patch. Not part of the
+    // content hash.
+    bool bKeepSPIRV = false;
+
+    const std::string& GetSourceName() const
+    {
+        return MainSource.empty() ? MainSourcePath : SourceName;
+    }
 };
 
 class CShaderCompileWorker
@@ -22,13 +40,35 @@ class CShaderCompileWorker
 public:
     explicit CShaderCompileWorker(CShaderCompileEnvironment env);
 
+    // Only used when shaderc is not available and glslc has to write the module to disk
     void SetOutputPath(std::string path) { OutputPath = std::move(path); }
-    RHI::CShaderModule::Ref Compile(const RHI::CDevice::Ref& device);
-    std::future<RHI::CShaderModule::Ref> CompileAsync();
+    // With an archive the compiler only runs when the archive has no module for the same inputs
+    RHI::CShaderModule::Ref Compile(const RHI::CDevice::Ref& device,
+                                    CSPIRVArchive* archive = nullptr);
+    // Same as Compile, stopping short of creating the module
+    bool CompileSPIRV(std::vector<uint32_t>& spirv, CSPIRVArchive* archive = nullptr);
+    // Hash of the source, stage, definitions, included files and compiler. Equal hashes compile
+    // to the same SPIR-V, the archive is keyed by it.
+    uint64_t GetContentHash();
+    // Size of the module produced by the last Compile, and whether it came out of the archive
+    uint32_t GetSPIRVSize() const { return SPIRVSize; }
+    bool IsFromArchive() const { return bFromArchive; }
+    // Compiles a copy of this worker on the pool
+    std::future<RHI::CShaderModule::Ref> CompileAsync(const RHI::CDevice::Ref& device,
+                                                      CCompileThreadPool& pool) const;
 
 private:
+    // The main source with StrReplaces applied
+    std::string LoadSource() const;
+    bool CompileToSPIRV(const std::string& source, std::vector<uint32_t>& spirv) const;
+    uint64_t ComputeContentHash(const std::string& source) const;
+
     std::string OutputPath;
     CShaderCompileEnvironment CompileEnv;
+    // Computed once, zero until then
+    uint64_t ContentHash = 0;
+    uint32_t SPIRVSize = 0;
+    bool bFromArchive = false;
 };
 
 }
@@ -0,0 +1,104 @@
+#include "ShaderDependencies.h"
+#include <filesystem>
+#include <fstream>
+
+namespace Pl
+{
+
+bool ParseIncludeLine(const std::string& line, std::string& name)
+{
+    auto pos = line.find_first_not_of(" \t");
+    if (pos == std::string::npos || line.compare(pos, 8, "#include") != 0)
+        return false;
+    auto open = line.find_first_of("\"<", pos + 8);
+    if (open == std::string::npos)
+        return false;
+    auto close = line.find_first_of("\">", open + 1);
+    if (close == std::string::npos)
+        return false;
+    name = line.substr(open + 1, close - open - 1);
+    return true;
+}
+
+// Paths are compared as strings, so spell each file one way only
+static std::string NormalizePath(const std::string& path)
+{
+    return std::filesystem::path(path).lexically_normal().generic_string();
+}
+
+std::string ResolveInclude(const std::string& includer, const std::string& name,
+                           const std::vector<std::string>& includeDirs)
+{
+    // A bare includer name is relative to the working directory
+    std::vector<std::filesystem::path> dirs = { std::filesystem::path(includer).parent_path() };
+    dirs.insert(dirs.end(), includeDirs.begin(), includeDirs.end());
+    for (const std::filesystem::path& dir : dirs)
+    {
+        std::string path = NormalizePath((dir / name).string());
+        if (std::ifstream(path))
+            return path;
+    }
+    return std::string();
+}
+
+CShaderDependencyGraph::CShaderDependencyGraph(std::vector<std::string> includeDirs)
+    : IncludeDirs(std::move(includeDirs))
+{
+}
+
+std::string CShaderDependencyGraph::AddShader(const std::string& path)
+{
+    std::string shader = NormalizePath(path);
+    Shaders.insert(shader);
+
+    std::set<std::string> visited = { shader };
+    std::vector<std::string> pending = { shader };
+    while (!pending.empty())
+    {
+        std::string file = std::move(pending.back());
+        pending.pop_back();
+
+        // Includes the file no longer has are forgotten, the scan below adds back the others
+        for (auto& pair : IncludedBy)
+            pair.second.erase(file);
+
+        std::ifstream ifs(file);
+        std::string line, name;
+        while (std::getline(ifs, line))
+        {
+            if (!ParseIncludeLine(line, name))
+                continue;
+            std::string included = ResolveInclude(file, name, IncludeDirs);
+            if (included.empty())
+                continue;
+            IncludedBy[included].insert(file);
+            if (visited.insert(included).second)
+                pending.push_back(std::move(included));
+        }
+    }
+    return shader;
+}
+
+std::vector<std::string> CShaderDependencyGraph::GetAffectedShaders(const std::string& path) const
+{
+    std::vector<std::string> affected;
+    std::set<std::string> visited = { NormalizePath(path) };
+    std::vector<std::string> pending = { *visited.begin() };
+    while (!pending.empty())
+    {
+        std::string file = std::move(pending.back());
+        pending.pop_back();
+        if (Shaders.count(file))
+            affected.push_back(file);
+
+        auto iter = IncludedBy.find(file);
+        if (iter == IncludedBy.end())
+            continue;
+        for (const std::string& includer : iter->second)
+            if (visited.insert(includer).second)
+                pending.push_back(includer);
+    }
+    return affected;
+}
+
+}
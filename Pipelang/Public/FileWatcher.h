@@ -0,0 +1,37 @@
+#pragma once
+#include <LangUtils.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#ifndef __linux__
+#include <filesystem>
+#endif
+
+namespace Pl
+{
+
+// Reports the files written under a set of directories, with inotify on Linux and by comparing
+// modification times elsewhere. Poll from one thread only.
+class CFileWatcher : public tc::FNonCopyable
+{
+public:
+    CFileWatcher();
+    ~CFileWatcher();
+
+    // Watches dir and every directory below it, including ones created later
+    bool Watch(const std::string& dir);
+    // Files written or moved in since the last call, each one once. Never blocks.
+    std::vector<std::string> Poll();
+
+private:
+#ifdef __linux__
+    int Fd = -1;
+    std::unordered_map<int, std::string> DirByWatch;
+#else
+    std::vector<std::string> Dirs;
+    std::unordered_map<std::string, std::filesystem::file_time_type> WriteTimes;
+#endif
+};
+
+}
@@ -1,19 +1,105 @@
 #pragma once
 #include <cstdint>
+#include <functional>
+#include <initializer_list>
 #include <string>
+#include <vector>
 
 namespace Pl
 {
 
 // We used 64bit hashes as identifiers for efficiency reasons
-
+//
+// FNV-1a over a sequence of strings, each one terminated by a zero byte so that { "ab", "c" } and
+// { "a", "bc" } differ. Literal lists hash at compile time.
 class CHashId
 {
 public:
-    CHashId();
+    constexpr CHashId() = default;
+
+    constexpr CHashId(std::initializer_list<const char*> strings)
+    {
+        for (const char* s : strings)
+            *this = Append(s);
+    }
+
+    template <size_t N> static constexpr CHashId FromStrings(const char* const (&strings)[N])
+    {
+        CHashId id;
+        for (size_t i = 0; i < N; i++)
+            id = id.Append(strings[i]);
+        return id;
+    }
+
+    explicit CHashId(const std::vector<std::string>& strings)
+    {
+        for (const std::string& s : strings)
+            *this = Append(s);
+    }
+
+    constexpr CHashId Append(const char* str) const
+    {
+        uint64_t value = Value;
+        for (; *str; str++)
+            value = (value ^ static_cast<uint8_t>(*str)) * Prime;
+        return CHashId(value * Prime);
+    }
+
+    CHashId Append(const std::string& str) const
+    {
+        uint64_t value = Value;
+        for (char c : str)
+            value = (value ^ static_cast<uint8_t>(c)) * Prime;
+        return CHashId(value * Prime);
+    }
+
+    CHashId AppendBytes(const void* data, size_t size) const
+    {
+        uint64_t value = Value;
+        const uint8_t* bytes = static_cast<const uint8_t*>(data);
+        for (size_t i = 0; i < size; i++)
+            value = (value ^ bytes[i]) * Prime;
+        return CHashId(value * Prime);
+    }
+
+    // Appends the bytes of a number, e.g. to tell apart variants of the same key
+    constexpr CHashId AppendValue(uint64_t number) const
+    {
+        uint64_t value = Value;
+        for (int i = 0; i < 8; i++)
+            value = (value ^ ((number >> (i * 8)) & 0xff)) * Prime;
+        return CHashId(value * Prime);
+    }
+
+    constexpr uint64_t GetValue() const { return Value; }
+
+    constexpr bool operator==(const CHashId& rhs) const { return Value == rhs.Value; }
+    constexpr bool operator!=(const CHashId& rhs) const { return Value != rhs.Value; }
 
 private:
-    uint64_t Value;
+    static constexpr uint64_t OffsetBasis = 14695981039346656037ull;
+    static constexpr uint64_t Prime = 1099511628211ull;
+
+    constexpr explicit CHashId(uint64_t value)
+        : Value(value)
+    {
+    }
+
+    uint64_t Value = OffsetBasis;
+};
+
+// Remembers the text behind every id passed here and asserts when two different texts end up with
+// the same id. Only meant to be called from DEBUG builds, the table is never trimmed.
+void CheckHashCollision(CHashId id, const std::string& text);
+
+}
+
+namespace std
+{
+
+template <> struct hash<Pl::CHashId>
+{
+    size_t operator()(const Pl::CHashId& id) const { return static_cast<size_t>(id.GetValue()); }
 };
 
 }
@@ -0,0 +1,176 @@
+#pragma once
+#include "HashId.h"
+#include <atomic>
+#include <cassert>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+namespace Pl
+{
+
+// Maps CHashId to values for many readers and few writers.
+//
+// Find is wait-free: one acquire load of the current table followed by a bounded linear probe, no
+// locks and no reference counts. Writers serialize on a mutex and publish an entry by storing its
+// key last. Past half full, a table twice the size is built and swapped in. Replaced tables stay
+// alive for as long as the map since a reader may still be probing them, which costs at most as
+// much again as the live table. Each value is allocated on its own so its address never changes.
+// A value that gets replaced is not freed right away, since a reader may still hold it: it waits
+// on a retire list until FreeRetired is called with a frame far enough past the replacement.
+template <typename TValue> class CHashIdMap
+{
+public:
+    CHashIdMap() { Current.store(Grow(InitialCapacity), std::memory_order_relaxed); }
+
+    CHashIdMap(const CHashIdMap&) = delete;
+    CHashIdMap& operator=(const CHashIdMap&) = delete;
+
+    // The pointer stays valid until key is assigned again and FreeRetired lets the old value go
+    const TValue* Find(CHashId key) const
+    {
+        const CTable* table = Current.load(std::memory_order_acquire);
+        uint64_t k = key.GetValue();
+        for (size_t i = k & table->Mask, probes = 0; probes <= table->Mask;
+             i = (i + 1) & table->Mask, probes++)
+        {
+            uint64_t slotKey = table->Slots[i].Key.load(std::memory_order_acquire);
+            if (slotKey == k)
+                return table->Slots[i].Value.load(std::memory_order_acquire);
+            if (slotKey == EmptyKey)
+                return nullptr;
+        }
+        return nullptr;
+    }
+
+    // Inserts or replaces the value of key
+    void Assign(CHashId key, TValue value)
+    {
+        assert(key.GetValue() != EmptyKey);
+
+        std::lock_guard<std::mutex> lk(WriteMutex);
+        std::unique_ptr<TValue>& owner = Values[key.GetValue()];
+        if (owner)
+            Retired.push_back({ Frame, std::move(owner) });
+        owner = std::make_unique<TValue>(std::move(value));
+        const TValue* stored = owner.get();
+
+        CTable* table = Current.load(std::memory_order_relaxed);
+        if (CSlot* slot = FindSlot(*table, key.GetValue()))
+        {
+            slot->Value.store(stored, std::memory_order_release);
+            return;
+        }
+
+        if ((Count + 1) * 2 > table->Mask + 1)
+        {
+            CTable* bigger = Grow((table->Mask + 1) * 2);
+            for (size_t i = 0; i <= table->Mask; i++)
+            {
+                uint64_t k = table->Slots[i].Key.load(std::memory_order_relaxed);
+                if (k != EmptyKey)
+                    Publish(*bigger, k, table->Slots[i].Value.load(std::memory_order_relaxed));
+            }
+            Publish(*bigger, key.GetValue(), stored);
+            // Everything above becomes visible together with the table
+            Current.store(bigger, std::memory_order_release);
+        }
+        else
+            Publish(*table, key.GetValue(), stored);
+        Count++;
+    }
+
+    size_t GetSize() const
+    {
+        std::lock_guard<std::mutex> lk(WriteMutex);
+        return Count;
+    }
+
+    // Call once per frame. Values replaced before frame - graceFrames are freed, later ones are
+    // stamped with frame when they get replaced.
+    void FreeRetired(uint64_t frame, uint64_t graceFrames)
+    {
+        std::lock_guard<std::mutex> lk(WriteMutex);
+        Frame = frame;
+        while (!Retired.empty() && Retired.front().Frame + graceFrames <= frame)
+            Retired.pop_front();
+    }
+
+    size_t GetRetiredCount() const
+    {
+        std::lock_guard<std::mutex> lk(WriteMutex);
+        return Retired.size();
+    }
+
+private:
+    static const uint64_t EmptyKey = 0;
+    static const size_t InitialCapacity = 64;
+
+    struct CSlot
+    {
+        std::atomic<uint64_t> Key { EmptyKey };
+        std::atomic<const TValue*> Value { nullptr };
+    };
+
+    struct CTable
+    {
+        explicit CTable(size_t capacity)
+            : Slots(new CSlot[capacity])
+            , Mask(capacity - 1)
+        {
+        }
+
+        std::unique_ptr<CSlot[]> Slots;
+        size_t Mask;
+    };
+
+    CTable* Grow(size_t capacity)
+    {
+        Tables.push_back(std::make_unique<CTable>(capacity));
+        return Tables.back().get();
+    }
+
+    static CSlot* FindSlot(CTable& table, uint64_t k)
+    {
+        for (size_t i = k & table.Mask;; i = (i + 1) & table.Mask)
+        {
+            uint64_t slotKey = table.Slots[i].Key.load(std::memory_order_relaxed);
+            if (slotKey == k)
+                return &table.Slots[i];
+            if (slotKey == EmptyKey)
+                return nullptr;
+        }
+    }
+
+    static void Publish(CTable& table, uint64_t k, const TValue* value)
+    {
+        size_t i = k & table.Mask;
+        while (table.Slots[i].Key.load(std::memory_order_relaxed) != EmptyKey)
+            i = (i + 1) & table.Mask;
+        // The value has to be in place before a reader can match the key
+        table.Slots[i].Value.store(value, std::memory_order_relaxed);
+        table.Slots[i].Key.store(k, std::memory_order_release);
+    }
+
+    struct CRetired
+    {
+        // Frame the value was replaced in
+        uint64_t Frame;
+        std::unique_ptr<TValue> Value;
+    };
+
+    std::atomic<CTable*> Current;
+
+    mutable std::mutex WriteMutex;
+    std::vector<std::unique_ptr<CTable>> Tables;
+    // By key, the current value of each
+    std::unordered_map<uint64_t, std::unique_ptr<TValue>> Values;
+    // Ordered by frame
+    std::deque<CRetired> Retired;
+    uint64_t Frame = 0;
+    size_t Count = 0;
+};
+
+}
@@ -1,16 +1,31 @@
 #pragma once
+#include "FileWatcher.h"
+#include "HashId.h"
+#include "HashIdMap.h"
 #include <Device.h>
+#include <ShaderModule.h>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <future>
 #include <map>
 #include <string>
 #include <vector>
 #include <unordered_map>
 #include <memory>
+#include <mutex>
+
+struct lua_State;
 
 namespace Pl
 {
 
 // Foward decls
 class CShaderCache;
+class CDescriptorSetPool;
+class CPipelangContext;
+class CSnapshotReader;
+class CSnapshotWriter;
 
 class CVertexAttribs
 {
@@ -28,21 +43,61 @@ public:
     };
 
     const std::map<uint32_t, ESemantic>& GetAttributesByLocation() const;
+    bool operator==(const CVertexAttribs& rhs) const
+    {
+        return AttribsByLocation == rhs.AttribsByLocation;
+    }
 
     // Called from Lua
     void AddAttribute(const std::string& name, uint32_t location);
 
+    void WriteSnapshot(CSnapshotWriter& writer) const;
+    bool ReadSnapshot(CSnapshotReader& reader);
+
 private:
     std::map<uint32_t, ESemantic> AttribsByLocation;
 };
 
+// A binding of a parameter block, resolved once so that binding resources does not look up names
+struct CBindingHandle
+{
+    static const uint32_t Invalid = UINT32_MAX;
+    uint32_t Index = Invalid;
+
+    bool IsValid() const { return Index != Invalid; }
+};
+
 class CParameterBlock
 {
 public:
     RHI::CDescriptorSetLayout::Ref GetDescriptorSetLayout() const;
+    // Comes from the pool of the layout and goes back to it when released, to be reused once the
+    // frames that could still use it retired
     RHI::CDescriptorSet::Ref CreateDescriptorSet() const;
+    // Only valid for the current frame, for sets that are rebound every frame anyway. Reused once
+    // the frame retired and the last reference is gone.
+    RHI::CDescriptorSet::Ref AllocateTransientDescriptorSet() const;
     const RHI::CDescriptorSetLayoutBinding& GetBinding(const std::string& name) const;
+    const RHI::CDescriptorSetLayoutBinding& GetBinding(CBindingHandle handle) const;
+
+    // Invalid if the block has no such binding. Handles stay valid for the lifetime of the block,
+    // the CHashId overload resolves ids computed at compile time, e.g. CHashId { "BaseColorTex" }.
+    CBindingHandle GetBindingHandle(const std::string& name) const;
+    CBindingHandle GetBindingHandle(CHashId nameId) const;
+    // Handle indices run from 0 to the count
+    uint32_t GetBindingCount() const;
+    // For diagnostics
+    const std::string& GetBindingName(CBindingHandle handle) const;
 
+    // Buffers and image views go to uniform and storage bindings alike
+    void BindBuffer(const RHI::CDescriptorSet::Ref& ds, RHI::CBuffer::Ref buffer, size_t offset, size_t range, CBindingHandle handle, uint32_t index = 0);
+    void BindConstants(const RHI::CDescriptorSet::Ref& ds, const void* data, size_t size, CBindingHandle handle, uint32_t index = 0);
+    void BindImageView(const RHI::CDescriptorSet::Ref& ds, RHI::CImageView::Ref imageView, CBindingHandle handle, uint32_t index = 0);
+    void BindSampler(const RHI::CDescriptorSet::Ref& ds, RHI::CSampler::Ref sampler, CBindingHandle handle, uint32_t index = 0);
+    void BindBufferView(const RHI::CDescriptorSet::Ref& ds, RHI::CBufferView::Ref bufferView, CBindingHandle handle, uint32_t index = 0);
+    void SetDynamicOffset(const RHI::CDescriptorSet::Ref& ds, size_t offset, CBindingHandle handle, uint32_t index = 0);
+
+    // Same as above by name, which costs a lookup per call
     void BindBuffer(const RHI::CDescriptorSet::Ref& ds, RHI::CBuffer::Ref buffer, size_t offset, size_t range, const std::string& name, uint32_t index = 0);
     void BindConstants(const RHI::CDescriptorSet::Ref& ds, const void* data, size_t size, const std::string& name, uint32_t index = 0);
     void BindImageView(const RHI::CDescriptorSet::Ref& ds, RHI::CImageView::Ref imageView, const std::string& name, uint32_t index = 0);
@@ -58,24 +113,143 @@ public:
                     const std::string& stages);
     void SetSetIndex(uint32_t index);
     uint32_t GetSetIndex() const;
+    // Descriptor sets of one block can be used with the other
+    bool HasSameLayout(const CParameterBlock& other) const;
+
+    // Bit i is set once a pipeline generated so far reads the binding with handle index i, a
+    // binding no pipeline reads can be left unbound. Indices past 31 always count as read.
+    uint32_t GetUsedBindingMask() const { return UsedBindingMask->load(std::memory_order_acquire); }
+    bool IsBindingUsed(CBindingHandle handle) const
+    {
+        return handle.Index >= 32 || (GetUsedBindingMask() >> handle.Index) & 1;
+    }
+    void AddUsedBindings(uint32_t mask)
+    {
+        UsedBindingMask->fetch_or(mask, std::memory_order_release);
+    }
 
-    void CreateDescriptorLayout(const RHI::CDevice::Ref& device);
+    void CreateDescriptorLayout(CPipelangContext* context);
+    // Equal for blocks the device sees the same layout in, whatever their names, binding order
+    // and set index
+    CHashId GetLayoutSignature() const;
+
+    // The declarations of the block, without device resources
+    void WriteSnapshot(CSnapshotWriter& writer) const;
+    bool ReadSnapshot(CSnapshotReader& reader);
 
 private:
-    std::unordered_map<std::string, RHI::CDescriptorSetLayoutBinding> Bindings;
+    // What the script passed to AddBinding beyond the layout binding itself
+    struct CBindingDecl
+    {
+        std::string Type;
+        std::string Stages;
+    };
+
+    // Indexed by handle, in the order the script declares them
+    std::vector<RHI::CDescriptorSetLayoutBinding> Bindings;
+    std::vector<std::string> BindingNames;
+    std::vector<CBindingDecl> BindingDecls;
+    std::unordered_map<CHashId, uint32_t> HandleByName;
     RHI::CDescriptorSetLayout::Ref Layout;
+    // Shared by the copies of the block
+    std::shared_ptr<CDescriptorSetPool> DescriptorSetPool;
+    std::shared_ptr<std::atomic<uint32_t>> UsedBindingMask =
+        std::make_shared<std::atomic<uint32_t>>(0);
     uint32_t SetIndex = 0;
 };
 
-class CPipelangContext;
+// Reads a list of stage combinations, one per line with the stages separated by whitespace.
+// Empty lines and everything after a # are ignored.
+bool ReadPipelineManifest(const std::string& path,
+                          std::vector<std::vector<std::string>>& stageLists);
+
+struct CPipelineCompileStats
+{
+    bool bSuccess = false;
+    // Of the slowest shader, they compile side by side
+    float Milliseconds = 0.0f;
+    uint32_t SPIRVSize = 0;
+    // None of the shaders needed the compiler
+    bool bFromArchive = true;
+};
+
+// How often shader compiles were shared since the context was created
+struct CShaderDedupeStats
+{
+    // Modules asked for under a key the cache did not know yet
+    uint32_t Requests = 0;
+    // Requests whose source matched an earlier one, the compiler did not run for them
+    uint32_t SourceHits = 0;
+    // Compiles whose SPIR-V matched an existing module, no new module was created for them
+    uint32_t SPIRVHits = 0;
+    // Distinct modules created and the size of their SPIR-V
+    uint32_t Modules = 0;
+    uint64_t ModuleBytes = 0;
+    // SPIR-V that would have been handed to the driver a second time without sharing
+    uint64_t SavedBytes = 0;
+};
+
+// Descriptor sets of every parameter block of a context
+struct CDescriptorSetStats
+{
+    // Layouts with a pool
+    uint32_t Layouts = 0;
+    // Sets created from the layouts, they are only destroyed along with their pool
+    uint32_t SetsCreated = 0;
+    // Given out and not released yet, transient sets count as retiring
+    uint32_t SetsHeld = 0;
+    // Waiting for the frame they were last used in to retire
+    uint32_t SetsRetiring = 0;
+    uint32_t SetsFree = 0;
+    // Requests served over the lifetime of the pools, reused sets included
+    uint64_t Allocations = 0;
+};
+
+// Values for the specialization constants the stages of a pipeline declare, by name. Constants
+// without a value keep the default of the script. Values are 32 bits, set them as the type the
+// script declares.
+class CSpecializationValues
+{
+public:
+    void SetBool(CHashId name, bool value) { Set(name, value ? 1 : 0); }
+    void SetInt(CHashId name, int32_t value) { Set(name, static_cast<uint32_t>(value)); }
+    void SetUInt(CHashId name, uint32_t value) { Set(name, value); }
+    void SetFloat(CHashId name, float value);
+
+    bool IsEmpty() const { return Values.empty(); }
+    // Equal for equal values, whatever order they were set in
+    CHashId GetId() const;
+    // Sorted by name
+    const std::vector<std::pair<CHashId, uint32_t>>& GetValues() const { return Values; }
+
+private:
+    void Set(CHashId name, uint32_t bits);
+
+    std::vector<std::pair<CHashId, uint32_t>> Values;
+};
+
+// What a compute pipeline is made of. The backend creates the pipeline object from the shader and
+// the layout, as it does for a CPipelineDesc.
+struct CComputePipelineDesc
+{
+    RHI::CShaderModule::Ref CS;
+    RHI::CPipelineLayout::Ref Layout;
+    // Invocations per workgroup as the ComputeShader stage declares them, to size dispatches with
+    uint32_t WorkgroupSize[3] = { 1, 1, 1 };
+};
 
 class CPipelangLibrary
 {
 public:
     CPipelangLibrary(CPipelangContext* p, std::string sourceDir);
+    ~CPipelangLibrary();
 
+    // Reads the parameter blocks and vertex attributes of the scripts, from the snapshot of an
+    // earlier run when the scripts did not change since
     void Parse();
-    void PrecacheShaders();
+    // Switches the shader cache to the archive at archivePath, as written by PipelangMgr compile.
+    // With a manifest every pipeline listed in it is loaded right away rather than on first use.
+    bool PrecacheShaders(const std::string& archivePath, const std::string& manifestPath = "");
     void RecreateDeviceResources();
 
     CVertexAttribs& GetVertexAttribs(const std::string& name);
@@ -84,13 +258,129 @@ public:
     void AddParameterBlock(const std::string& name, CParameterBlock parameterBlock);
 
     bool GetPipeline(RHI::CPipelineDesc& desc, const std::vector<std::string>& stages);
+    // Same as above with the id of the stage list already at hand, e.g. computed at compile time
+    bool GetPipeline(RHI::CPipelineDesc& desc, const std::vector<std::string>& stages,
+                     CHashId stagesId);
+    // A variant with other values for the specialization constants. Variants share the SPIR-V of
+    // the pipeline, only the first use of a set of values creates modules for it.
+    bool GetPipeline(RHI::CPipelineDesc& desc, const std::vector<std::string>& stages,
+                     CHashId stagesId, const CSpecializationValues& values);
+    // For stage lists with a ComputeShader stage, GetPipeline fails for them and this for any other
+    bool GetComputePipeline(CComputePipelineDesc& desc, const std::vector<std::string>& stages);
+    bool GetComputePipeline(CComputePipelineDesc& desc, const std::vector<std::string>& stages,
+                            CHashId stagesId);
+    // Generates and compiles every stage list, up to one shader compile per core at a time.
+    // Returns false if any of them failed.
+    bool CompilePipelines(const std::vector<std::vector<std::string>>& stageLists,
+                          std::vector<CPipelineCompileStats>* stats = nullptr);
+
+    // Watches the internal scripts. After an edit PollHotReload regenerates every pipeline built
+    // so far and recompiles, in the background, only the shaders whose generated code changed.
+    void EnableHotReload();
+    // Call at a frame boundary, on one thread. Swaps in the shaders of every pipeline whose
+    // recompile finished and returns their ids, pipeline objects built from them are stale.
+    std::vector<CHashId> PollHotReload();
+    // Frees the pipeline records PollHotReload replaced at least graceFrames frames ago, called
+    // by CPipelangContext::BeginFrame
+    void FreeRetired(uint64_t frame, uint64_t graceFrames);
 
 private:
+    // Runs the internal scripts in a fresh Lua state, replacing the current one. Returns false if
+    // any of them failed.
+    bool CreateLuaState();
+
+    // Parse writes the parameter blocks and vertex attributes it got from the scripts to
+    // PipelangLibrary.<hash of SourceDir>.snapshot in the working directory. A later Parse with
+    // the same scripts loads them from there and leaves starting Lua to the first codegen.
+    uint64_t HashScripts() const;
+    bool LoadSnapshot(uint64_t sourceHash);
+    void SaveSnapshot(uint64_t sourceHash) const;
+
+    using FWorkgroupSize = std::array<uint32_t, 3>;
+
+    // The shaders of one pipeline while they compile
+    struct CPendingPipeline
+    {
+        CHashId StagesId;
+        RHI::CPipelineLayout::Ref Layout;
+        std::shared_future<RHI::CShaderModule::Ref> VS;
+        std::shared_future<RHI::CShaderModule::Ref> PS;
+        std::shared_future<RHI::CShaderModule::Ref> GS;
+        // Compute pipelines have nothing but this
+        std::shared_future<RHI::CShaderModule::Ref> CS;
+        FWorkgroupSize WorkgroupSize = { 1, 1, 1 };
+    };
+
+    // Everything GetPipeline hands out for a pipeline. Published in one piece once all shaders
+    // compiled, so a reader never gets some shaders of a pipeline without the others, or new
+    // shaders mixed with old ones after a hot reload.
+    struct CPipelineRecord
+    {
+        RHI::CPipelineLayout::Ref Layout;
+        RHI::CShaderModule::Ref VS, PS, GS, CS;
+        FWorkgroupSize WorkgroupSize = { 1, 1, 1 };
+    };
+
+    // Creates the layout, generates code and starts compiling every stage of a pipeline
+    bool LaunchPipeline(const std::vector<std::string>& stages, CHashId stagesId,
+                        CPendingPipeline& pending);
+    // Waits for the compiles and publishes the record, returns false if codegen or any compile
+    // failed
+    bool ResolvePipeline(const CPendingPipeline& pending, CPipelineRecord& record);
+    // Name of a specialization constant to its constant_id
+    using FSpecConstantIds = std::vector<std::pair<CHashId, uint32_t>>;
+
+    // What codegen produces for a pipeline
+    struct CCodegenResult
+    {
+        // VS, PS, GS and CS, empty for a shader the pipeline does not have
+        std::string Sources[4];
+        FSpecConstantIds SpecConstantIds;
+        FWorkgroupSize WorkgroupSize = { 1, 1, 1 };
+    };
+
+    // Runs codegen for a pipeline. LuaMutex must be held.
+    bool GenerateShaders(const std::vector<std::string>& stages, CCodegenResult& result);
+    // Reruns the scripts after an edit and starts recompiling whatever they now generate
+    // differently
+    void StartReload();
+
+    // Hashes of the shaders codegen generated for a pipeline, to tell which ones an edit touched
+    struct CGeneratedPipeline
+    {
+        std::vector<std::string> Stages;
+        // Zero for a shader the pipeline does not have
+        uint64_t SourceHash[4] = {};
+        FSpecConstantIds SpecConstantIds;
+    };
+
+    // The shaders of one pipeline being recompiled for hot reload, invalid where unchanged
+    struct CPendingReload
+    {
+        CHashId StagesId;
+        uint64_t SourceHash[4] = {};
+        std::shared_future<RHI::CShaderModule::Ref> Shaders[4];
+        FSpecConstantIds SpecConstantIds;
+        FWorkgroupSize WorkgroupSize = { 1, 1, 1 };
+    };
+
     CPipelangContext* Parent;
 
+    // Kept alive between calls so the parsed library does not have to be rebuilt for every
+    // pipeline. Lua is single threaded, the mutex serializes parsing and codegen.
+    lua_State* LuaState = nullptr;
+    std::mutex LuaMutex;
+
     std::string SourceDir;
     std::unordered_map<std::string, CParameterBlock> ParameterBlocks;
     std::unordered_map<std::string, CVertexAttribs> VertexAttribDescs;
+
+    // Every pipeline launched so far, guarded by LuaMutex
+    std::unordered_map<CHashId, CGeneratedPipeline> Generated;
+    // Of every pipeline that compiled, readable without LuaMutex
+    CHashIdMap<CPipelineRecord> Pipelines;
+    std::unique_ptr<CFileWatcher> ScriptWatcher;
+    std::vector<CPendingReload> PendingReloads;
 };
 
 class CPipelangContext
@@ -102,7 +392,41 @@ public:
     CPipelangLibrary& CreateLibrary(std::string sourceDir);
     CPipelangLibrary& GetLibrary(const std::string& sourceDir);
     const std::unique_ptr<CShaderCache>& GetShaderCache() const;
-    std::unordered_map<std::string, RHI::CPipelineLayout::Ref>& GetPipelineLayoutCache();
+    // Compiled SPIR-V is looked up in and added to this archive, PipelangShaders.archive in the
+    // working directory by default. Saved when the context goes away or on SaveShaderArchive.
+    void OpenShaderArchive(const std::string& path);
+    bool SaveShaderArchive();
+    CShaderDedupeStats GetShaderDedupeStats() const;
+    // Compiles a standalone shader file on the compile pool, e.g. to reload it after an edit. The
+    // SPIR-V is also written to <path>.spv, where the build puts it.
+    std::shared_future<RHI::CShaderModule::Ref>
+    CompileShaderFileAsync(const std::string& path, const std::string& stage,
+                           const std::vector<std::string>& includeDirs);
+    CHashIdMap<RHI::CPipelineLayout::Ref>& GetPipelineLayoutCache();
+    // Parameter blocks with the same layout signature share one layout and one pool of
+    // descriptor sets, whichever library they come from
+    RHI::CDescriptorSetLayout::Ref
+    GetDescriptorSetLayout(CHashId signature,
+                           const std::vector<RHI::CDescriptorSetLayoutBinding>& bindings,
+                           std::shared_ptr<CDescriptorSetPool>& pool);
+    // One pipeline layout per sequence of set layouts, so that pipelines over the same parameter
+    // blocks keep their descriptor sets bound across pipeline switches
+    RHI::CPipelineLayout::Ref
+    GetPipelineLayout(const std::vector<RHI::CDescriptorSetLayout::Ref>& setLayouts);
+    uint32_t GetDescriptorSetLayoutCount() const;
+    uint32_t GetPipelineLayoutCount() const;
+
+    // Call once per frame on the render thread. Descriptor sets released during a frame, and the
+    // transient ones allocated in it, are reused FramesInFlight frames later. Shaders, layouts and
+    // pipeline records a hot reload replaced are freed just as late.
+    void BeginFrame();
+    uint64_t GetFrameNumber() const { return FrameNumber.load(std::memory_order_relaxed); }
+    // At least 1, 3 by default
+    void SetFramesInFlight(uint32_t count);
+    uint32_t GetFramesInFlight() const { return FramesInFlight.load(std::memory_order_relaxed); }
+    std::shared_ptr<CDescriptorSetPool>
+    CreateDescriptorSetPool(RHI::CDescriptorSetLayout::Ref layout);
+    CDescriptorSetStats GetDescriptorSetStats() const;
 
     const RHI::CDevice::Ref& GetDevice() const { return Device; }
     void SetDevice(const RHI::CDevice::Ref& device) { Device = device; NotifyDeviceChange(); }
@@ -114,7 +438,23 @@ private:
     std::unordered_map<std::string, std::unique_ptr<CPipelangLibrary>> LibraryByDir;
 
     std::unique_ptr<CShaderCache> ShaderCache;
-    std::unordered_map<std::string, RHI::CPipelineLayout::Ref> PipelineLayoutCache;
+    // By stage list, for lookups without locking
+    CHashIdMap<RHI::CPipelineLayout::Ref> PipelineLayoutCache;
+
+    struct CSharedSetLayout
+    {
+        RHI::CDescriptorSetLayout::Ref Layout;
+        std::shared_ptr<CDescriptorSetPool> Pool;
+    };
+    mutable std::mutex LayoutMutex;
+    std::unordered_map<CHashId, CSharedSetLayout> SetLayouts;
+    // Keyed by the addresses of the set layouts, which are shared and live as long as the context
+    std::unordered_map<CHashId, RHI::CPipelineLayout::Ref> PipelineLayouts;
+
+    std::atomic<uint64_t> FrameNumber { 0 };
+    std::atomic<uint32_t> FramesInFlight { 3 };
+    mutable std::mutex DescriptorSetPoolMutex;
+    std::vector<std::weak_ptr<CDescriptorSetPool>> DescriptorSetPools;
 };
 
 }
@@ -0,0 +1,38 @@
+#pragma once
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace Pl
+{
+
+// Pulls the name out of an #include line, returns false for any other line
+bool ParseIncludeLine(const std::string& line, std::string& name);
+// Path of the file an #include of name in includer refers to, empty if there is none. Looks next
+// to includer first, then in includeDirs, as glslc does.
+std::string ResolveInclude(const std::string& includer, const std::string& name,
+                           const std::vector<std::string>& includeDirs);
+
+// Which shader sources include which files, directly or through other includes, to find the
+// shaders an edit has to rebuild. Includes resolve through ResolveInclude.
+class CShaderDependencyGraph
+{
+public:
+    explicit CShaderDependencyGraph(std::vector<std::string> includeDirs = {});
+
+    // Scans path and everything it includes. Call again after path changed to pick up new
+    // includes and forget dropped ones. Returns path spelled the way GetAffectedShaders reports
+    // it.
+    std::string AddShader(const std::string& path);
+    // Every shader added so far that is path or includes it
+    std::vector<std::string> GetAffectedShaders(const std::string& path) const;
+
+private:
+    std::vector<std::string> IncludeDirs;
+    std::set<std::string> Shaders;
+    // File to the files including it
+    std::unordered_map<std::string, std::set<std::string>> IncludedBy;
+};
+
+}